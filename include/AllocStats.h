@@ -0,0 +1,85 @@
+#pragma once
+
+#include"Common.h"
+#include<string>
+
+/* 内存池的统计信息，ConcurrentGetStats()一次把各层的情况都收上来：
+ 1. 每个桶的块现在都在哪：tc的自由链表、tc的远程释放队列、cc的中转站、cc的span里没分出去的、程序正在用的
+ 2. pc里每个页数的桶有几个空闲span，一共向os要了多少、还回去了多少，span对象这些元数据占了多少
+ 3. 慢路径走了多少次：tc向cc要块、还块，cc向pc要span、还span，页堆向os要整块
+
+ 计数器都是平时顺手记的：tc的记在各自的自由链表里(只有自己的线程改)，cc、pc的在本来就拿着的锁里面记，
+ 读统计的时候再挨个加起来，所以快路径上没有多出任何原子操作，生产环境里一直开着也没关系。
+ 读的时候要挨个加各层的锁，别在很热的路径上调 */
+
+// 一个桶的统计，块数都是按这个桶的块算的
+struct ClassStats
+{
+	size_t _objSize = 0; // 块大小
+	size_t _spans = 0; // cc中这个桶有几个span
+	size_t _spanObjs = 0; // 这些span一共能切出多少块
+	size_t _centralObjs = 0; // 还在cc的span里没分出去的块
+	size_t _transferObjs = 0; // cc中转站里的块
+	size_t _threadObjs = 0; // 所有tc自由链表里的块
+	size_t _cpuObjs = 0; // per-cpu模式下所有cpu缓存里的块
+	size_t _remoteObjs = 0; // 别的线程释放了、还挂在tc远程释放队列上的块
+	size_t _inUseObjs = 0; // 程序正在用的块(上面剩下的)
+
+	size_t _centralFetches = 0; // tc向cc要块的次数
+	size_t _centralReleases = 0; // tc把块还给cc的次数
+	size_t _transferHits = 0; // 向cc要一整批的时候中转站里正好有的次数
+	size_t _transferMisses = 0; // 中转站里没有，要去span里拿的次数
+	size_t _spanFetches = 0; // cc向pc要span的次数
+	size_t _spanReleases = 0; // cc把空span还给pc的次数
+};
+
+// pc中一个页数的桶的统计，所有NUMA节点、所有页堆加起来
+struct PageBucketStats
+{
+	size_t _spans = 0; // 空闲的span个数
+	size_t _releasedSpans = 0; // 其中物理内存已经还给os的
+};
+
+struct AllocStats
+{
+	ClassStats _classes[FREE_LIST_NUM];
+	PageBucketStats _pages[PAGE_NUM]; // 下标是页数，0号不用，128页的包括整块池子里的
+
+	// 各层缓存的字节数
+	size_t _threadBytes = 0; // 所有tc
+	size_t _remoteBytes = 0; // 所有tc的远程释放队列
+	size_t _cpuBytes = 0; // per-cpu模式下所有cpu的缓存
+	size_t _transferBytes = 0; // cc的中转站
+	size_t _centralBytes = 0; // cc的span里没分出去的
+	size_t _inUseBytes = 0; // 程序正在用的小块(按桶的大小算)
+	size_t _pageFreeBytes = 0; // pc里空闲的span，包括已经还给os的
+	size_t _largeSpans = 0; // 直接向os要的、正在用的span(大于128页的和页堆放不下的对齐span)
+	size_t _largeBytes = 0;
+	size_t _arenaBytes = 0; // 所有ConcurrentArena手上的和线程留着给arena用的span
+
+	// 和os之间
+	size_t _mappedBytes = 0; // 页堆和大块一共向os要了多少(不算元数据)
+	size_t _releasedBytes = 0; // pc里已经还给os、现在不占物理内存的
+	size_t _metadataBytes = 0; // span和tc对象池向os要的
+	size_t _spanObjects = 0; // 现在有多少个span对象
+	size_t _threadCaches = 0; // 现在有几个活着的tc
+
+	// 慢路径计数，所有桶、所有页堆加起来
+	size_t _centralFetches = 0;
+	size_t _centralReleases = 0;
+	size_t _spanFetches = 0;
+	size_t _spanReleases = 0;
+	size_t _pageRefills = 0; // 页堆向os要128页整块的次数
+	size_t _chunkReuses = 0; // 页堆从整块池子里拿的次数
+	size_t _largeAllocs = 0; // 直接向os要span的次数
+	size_t _arenaSpanFetches = 0; // ConcurrentArena向pc要span的次数
+};
+
+// 各层的数收上来之后，算每个桶正在用的块数和各项总数
+void SumStats(AllocStats& stats);
+
+// 按人看的格式输出，只列有东西的桶
+std::string StatsToText(const AllocStats& stats);
+
+// 输出成JSON，给监控之类的程序读，所有桶都列出来
+std::string StatsToJson(const AllocStats& stats);
@@ -1,37 +1,213 @@
 #pragma once
 #include"Common.h"
+#include"AllocStats.h"
+
+/* tc和cc之间的中转站，每个桶一个，里面存的是整批整批的块(一批就是NumMoveSize块)，
+ 每一批在tc还回来的时候就已经串成链表了，所以这里只存首尾，放进去拿出来都是O(1)。
+ 一个线程ListTooLong还回来的一整批，可以原封不动地交给另一个线程的FetchFromCentralCache，
+ 中间不需要碰任何span，也不需要对每一块都做一次MapObjectToSpan */
+class TransferCache
+{
+public:
+	// 放进去一整批，放满了返回false
+	bool Insert(void* start, void* end, size_t size)
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (_used >= Capacity(size))
+			return false;
+
+		_batches[_used]._start = start;
+		_batches[_used]._end = end;
+		++_used;
+		_touched = true;
+		return true;
+	}
+
+	// 拿出来一整批，没有就返回false
+	bool Remove(void*& start, void*& end)
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (_used == 0)
+		{
+			++_misses;
+			return false;
+		}
+		++_hits;
+		_touched = true;
+
+		--_used;
+		start = _batches[_used]._start;
+		end = _batches[_used]._end;
+		return true;
+	}
+
+	// 把存着的批全部拿出来，一批一批交给release(还给span)，返回拿出来几批。
+	// onlyIdle的时候只清上一次调用之后没人放过、拿过的中转站，正在用的留着(后台回收线程用)
+	template<class Release>
+	size_t Drain(bool onlyIdle, Release release)
+	{
+		Batch batches[TRANSFER_CACHE_SLOTS];
+		size_t n = 0;
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			bool touched = _touched;
+			_touched = false;
+			if (onlyIdle && touched)
+				return 0;
+
+			n = _used;
+			memcpy(batches, _batches, n * sizeof(Batch));
+			_used = 0;
+		}
+
+		// 还给span要拿桶锁，不拿着中转站的锁去还
+		for (size_t i = 0; i < n; ++i)
+		{
+			ObjNext(batches[i]._end) = nullptr;
+			release(batches[i]._start);
+		}
+		return n;
+	}
+
+	// 最多能存多少批，块越大存的批数越少，免得大块在这里囤太多内存
+	static size_t Capacity(size_t size)
+	{
+		size_t batchBytes = SizeClass::NumMoveSize(size) * size;
+		size_t n = TRANSFER_CACHE_BYTES / batchBytes;
+		if (n < 1)
+			n = 1;
+		if (n > TRANSFER_CACHE_SLOTS)
+			n = TRANSFER_CACHE_SLOTS;
+		return n;
+	}
+
+	// 统计用：现在存了几批，拿的时候有几次正好有、几次没有
+	void GetStats(size_t& batches, size_t& hits, size_t& misses)
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		batches = _used;
+		hits = _hits;
+		misses = _misses;
+	}
+
+private:
+	struct Batch
+	{
+		void* _start;
+		void* _end;
+	};
+
+	Batch _batches[TRANSFER_CACHE_SLOTS] = {}; // 当成栈来用，后放进来的先拿走，cache更热
+	size_t _used = 0; // 当前存了多少批
+	size_t _hits = 0;
+	size_t _misses = 0;
+	bool _touched = false; // 上一次Drain之后有没有人放过、拿过
+	std::mutex _mtx; // 中转站自己的锁，不和桶锁抢
+};
+
+/* cc中的一个桶。原来一个桶只有一个SpanList，找有空闲块的span要从头挨个看，块全分出去了的span
+ 多了以后每次都要扫一大串。现在块全分出去了的span单独放在_full里，根本不会被扫到；还有空闲块的
+ 按用掉的比例分成CENTRAL_PARTIAL_BINS档，_partial[i]里的span用掉了[i/档数, (i+1)/档数)，
+ use_count变了跨档的话就挪到新的链表里，都是O(1)的。
+ 拿span的时候从用得最满的那一档开始拿，快满的先被用满，快空的那些就有机会全部还回来交给pc */
+struct CentralBucket
+{
+	SpanList _partial[CENTRAL_PARTIAL_BINS]; // 还有空闲块的span，按用掉的比例分档
+	SpanList _full; // 块全分出去了的span
+	size_t _spanFetches = 0; // 向pc要过几次span
+	size_t _spanReleases = 0; // 还给pc几个空span
+	std::mutex _mtx; // 桶锁，上面的都由它保护
+};
+
+/* 一个NUMA节点上cc的所有桶和中转站。cc按节点分开：线程从自己节点的桶里拿块，桶里的span也都是
+ 从这个节点的页堆要的，块还回来的时候按span记的节点还到那个节点的桶里，不管是在哪个节点上还的。
+ 中转站里的批不查span，按还的线程所在的节点放，跨节点还回来的批可能会被这个节点的线程拿走 */
+struct CentralNode
+{
+	CentralBucket _buckets[FREE_LIST_NUM]; // 哈希桶中挂的是一个一个的Span
+	TransferCache _transferCaches[FREE_LIST_NUM]; // 每个桶的中转站
+};
 
 class CentralCache
 {
 public:
-	// ӿ
+	// 单例接口
 	static CentralCache* GetInstance()
 	{
 		return &_sInst;
 	}
 
-	// ccԼ_spanListsΪtcṩtcҪĿռ
-	size_t FetchRangeObj(void*& start, void*& end, size_t batchNum, size_t size);
-		/*startendʾccṩĿռĿʼβͲ*/
-		/*batchNumʾtcҪٿsizeСĿռ*/
-		/*sizeʾtcҪĵռĴС*/
-		/*ֵccʵṩСռ*/
+	// cc从自己的桶中为tc提供tc所需要的块空间
+	size_t FetchRangeObj(void*& start, void*& end, size_t batchNum, size_t size, RemoteFreeList* owner = nullptr);
+		/*start和end表示cc提供的空间的开始结尾，输出型参数*/
+		/*batchNum表示tc需要多少块size大小的空间*/
+		/*size表示tc需要的单块空间的大小*/
+		/*owner是要块的tc的远程释放队列，从span切块的时候记到span上，per-cpu模式给空*/
+		/*返回值是cc实际提供的小块空间个数*/
 
-	// ȡһռ䲻Ϊյspan
-	Span* GetOneSpan(SpanList& list, size_t size);
+	// 获取一个管理空间不为空的span，没有就从node号节点的页堆要，调用前要拿着桶锁
+	Span* GetOneSpan(CentralBucket& bucket, size_t size, size_t node);
 
-	// tcĶռŵspan
+	// 将tc还回来的多块空间放到span中
 	void ReleaseListToSpans(void* start, size_t size);
 
+	// tc还回来n块空间，正好是一整批的话先放到中转站，放不下了再还给span
+	void InsertRange(void* start, void* end, size_t n, size_t size);
+
+	// 把中转站里存着的批都还给span，这样空了的span才能回到pc、再还给os，返回还了多少字节。
+	// onlyIdle的时候只清上一次之后没人用过的中转站
+	size_t ReleaseTransferCaches(bool onlyIdle);
+
+	// cc这一层每个桶的统计：几个span、span里和中转站里还有多少块，向pc要了几次、还了几次
+	void GetStats(AllocStats& stats);
+
+private:
+	// 一个span能切出来多少块，同一个桶里的span页数和块大小都一样
+	static size_t SpanCapacity(size_t index)
+	{
+		return (SizeClass::ClassPages(index) << PAGE_SHIFT) / SizeClass::ClassSize(index);
+	}
+
+	// 用掉useCount块的span该放在桶里的哪个链表
+	static SpanList& ListFor(CentralBucket& bucket, size_t useCount, size_t capacity)
+	{
+		if (useCount >= capacity)
+			return bucket._full;
+		return bucket._partial[useCount * CENTRAL_PARTIAL_BINS / capacity];
+	}
+
+	// span的use_count从oldCount变成了现在的值，跨档了就挪过去
+	static void MoveSpan(CentralBucket& bucket, Span* span, size_t oldCount, size_t capacity)
+	{
+		SpanList& from = ListFor(bucket, oldCount, capacity);
+		SpanList& to = ListFor(bucket, span->use_count, capacity);
+		if (&from != &to)
+		{
+			from.Erase(span);
+			to.PushFront(span);
+		}
+	}
+
+	// node号节点的桶，第一次用到的时候才开
+	CentralNode* GetNode(size_t node);
+
+	// span所在节点的index号桶
+	CentralBucket& BucketOf(Span* span, size_t index)
+	{
+		return GetNode(span->_heap / PAGE_HEAP_NUM)->_buckets[index];
+	}
+
 private:
-	// ȥ졢Ϳ
-	CentralCache()
+	// 单例，去掉构造、拷构和拷赋
+	constexpr CentralCache()
 	{}
 
 	CentralCache(const CentralCache& copy) = delete;
 	CentralCache& operator =(const CentralCache& copy) = delete;
 
 private:
-	SpanList _spanLists[FREE_LIST_NUM]; // ϣͰйҵһһSpan
-	static CentralCache _sInst; // ģʽһCentralCache
+	CentralNode _node0; // 0号节点的桶直接放在cc里，不是NUMA的机器就只有这一组
+	std::atomic<CentralNode*> _nodes[NUMA_MAX_NODES] = { &_node0 }; // 别的节点用到的时候才开
+	std::mutex _nodeMtx; // 开节点的时候用
+	static CentralCache _sInst; // 饿汉模式创建一个CentralCache
 };
\ No newline at end of file
@@ -5,6 +5,9 @@
 #include<iostream>
 #include<thread>
 #include<mutex>
+#include<atomic>
+#include<cstring>
+#include<cstdint>
 
 #include<unordered_map>
 #include<vector>
@@ -14,10 +17,38 @@ using std::vector;
 using std::cout;
 using std::endl;
 
+#ifdef CMP_SIZE_CLASS_HEADER
+// 用tools/SizeClassGen.cpp按实际负载生成的桶大小表，桶的个数由表决定
+#include CMP_SIZE_CLASS_HEADER
+static const size_t FREE_LIST_NUM = GEN_CLASS_NUM; // 哈希表中自由链表个数
+#else
 static const size_t FREE_LIST_NUM = 208; // 哈希表中自由链表个数
+#endif
 static const size_t MAX_BYTES = 256 * 1024; // ThreadCache单次申请的最大字节数
 static const size_t PAGE_NUM = 129; // span的最大管理页数
 static const size_t PAGE_SHIFT = 13; // 一页多少位，这里给一页8KB，就是13位
+static const size_t PAGE_HEAP_RANGES = 4; // pc按申请的页数分成几段，每段有自己的页堆，见PageCache.h
+static const size_t PAGE_HEAP_STRIPES = 4; // 每段再按线程分成几个页堆
+static const size_t PAGE_HEAP_NUM = PAGE_HEAP_RANGES * PAGE_HEAP_STRIPES; // 每个NUMA节点上有多少个页堆
+static const size_t NUMA_MAX_NODES = 8; // 最多支持多少个NUMA节点，再多的都算到前面的节点上
+static const size_t NUMA_MAX_CPUS = 1024; // cpu编号到NUMA节点的对照表有多大
+static const size_t CENTRAL_PARTIAL_BINS = 4; // cc每个桶里还有空闲块的span按用掉的比例分几档
+static const size_t CENTRAL_RELEASE_BATCH = 64; // cc把块还给span的时候，空了的span攒够多少个一起还给pc
+static const size_t TRANSFER_CACHE_SLOTS = 16; // cc中每个桶的中转站最多存多少批块
+static const size_t TRANSFER_CACHE_BYTES = 1024 * 1024; // cc中每个桶的中转站最多存多少字节
+static const size_t CPU_CACHE_MAX_SLOTS = 128; // per-cpu模式下每个cpu每个桶最多存多少块
+static const size_t CPU_CACHE_CLASS_BYTES = 64 * 1024; // per-cpu模式下每个cpu每个桶最多存多少字节
+static const size_t HEAP_SAMPLE_MAX_DEPTH = 32; // 堆采样最多记多少层调用栈
+static const size_t HEAP_SAMPLE_BUCKETS = 1024; // 采样记录的哈希表有多少个桶
+static const size_t HEAP_SAMPLE_RECHECK_BYTES = 16 * 1024 * 1024; // 没开采样的时候，每个线程每申请这么多字节看一下开了没有
+static const size_t OBJECT_POOL_MAGAZINE_SLOTS = 64; // 并发定长内存池的一个弹匣最多装多少个对象
+static const size_t OBJECT_POOL_CHUNK_BYTES = 128 * 1024; // 并发定长内存池没有对象了，一次向os要多少字节
+static const size_t ARENA_SPAN_PAGES = 8; // ConcurrentArena一次向pc要多少页
+static const size_t ARENA_CACHE_SPANS = 32; // 每个线程最多留多少个arena还回来的span给下一个arena用
+static const size_t THREAD_CACHE_BUDGET_BYTES = 32 * 1024 * 1024; // 所有线程的tc加起来默认最多缓存多少字节
+static const size_t THREAD_CACHE_MIN_BYTES = 2 * MAX_BYTES; // 每个tc至少能缓存多少字节，也是tc刚创建时的上限
+static const size_t THREAD_CACHE_MAX_BYTES = 4 * 1024 * 1024; // 每个tc最多能缓存多少字节
+static const size_t THREAD_CACHE_STEAL_BYTES = 64 * 1024; // tc不够用的时候一次多要(或者从别的tc偷)多少字节
 
 // 注意下面size_t的大小会随着平台位数发生变化，32位下size_t是unsigned int（4字节），64位下 是unsigned __int64（8字节）
 // 所以不需要进行预处理这里的_pageID的类型，所以下面的条件编译其实不用搞，只需要typedef size_t PageID就够了
@@ -36,17 +67,93 @@ typedef size_t PageID;
 
 #ifdef _WIN32
 	#include<Windows.h> // Windows下的头文件
+	#include<intrin.h> // _mm_prefetch
 #else
-	// 这里是Linux相关的头文件，我就不写出来了
+	#include<sys/mman.h> // Linux下的mmap、munmap、madvise
 #endif // _WIN32
 
-// 直接去堆上按页申请空间
-inline static void* SystemAlloc(size_t kpage)
+// Linux下SystemAlloc有几种可选的模式，默认都不开，需要的话编译时定义对应的宏（CMakeLists.txt中有对应的option）
+//	CMP_MAP_POPULATE	mmap时带上MAP_POPULATE，申请的时候就把物理页都映射好，后面用的时候不会再一页一页地缺页中断
+//	CMP_MADV_HUGEPAGE	申请完之后madvise(MADV_HUGEPAGE)，建议内核用透明大页去映射，减少TLB miss
+//	CMP_MAP_HUGETLB		大块的申请直接用MAP_HUGETLB要显式大页(需要提前配置vm.nr_hugepages)，要不到就退回普通页
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024; // x86-64下一个大页是2MB
+
+#ifndef _WIN32
+// 实际向os映射的字节数，SystemFree的时候也要按同样的长度去munmap
+inline static size_t SystemMapLength(size_t kpage)
+{
+	size_t len = kpage << PAGE_SHIFT;
+#ifdef CMP_MAP_HUGETLB
+	// 显式大页要求长度是2MB的整数倍，pc一次要128页(1MB)，所以超过半个大页的就补齐到整个大页，
+	// 再小的(比如对象池的128KB)补齐太浪费了，还是用普通页
+	if (len >= HUGE_PAGE_SIZE / 2)
+		len = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+#endif
+	return len;
+}
+#endif // !_WIN32
+
+// 直接去堆上按页申请空间，返回的地址按alignPages页对齐(alignPages要是2的幂)
+inline static void* SystemAlloc(size_t kpage, size_t alignPages = 1)
 {
 #ifdef _WIN32 // Windows下的系统调用接口
-	void* ptr = VirtualAlloc(0, kpage << PAGE_SHIFT, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	// VirtualAlloc按64KB对齐，要求更大的对齐时，先多保留一段看看对齐的地址在哪，放掉再到那个地址去要，
+	// 中间被别的线程抢走了就重来
+	size_t align = alignPages << PAGE_SHIFT;
+	void* ptr = nullptr;
+	if (align <= 64 * 1024)
+		ptr = VirtualAlloc(0, kpage << PAGE_SHIFT, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	while (ptr == nullptr && align > 64 * 1024)
+	{
+		void* raw = VirtualAlloc(0, (kpage << PAGE_SHIFT) + align, MEM_RESERVE, PAGE_NOACCESS);
+		if (raw == nullptr)
+			break;
+		VirtualFree(raw, 0, MEM_RELEASE);
+		void* aligned = (void*)(((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+		ptr = VirtualAlloc(aligned, kpage << PAGE_SHIFT, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	}
 #else
-	// linux下brk mmap等
+	size_t len = SystemMapLength(kpage);
+	void* ptr = nullptr;
+
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef CMP_MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+
+#ifdef CMP_MAP_HUGETLB
+	if (len % HUGE_PAGE_SIZE == 0 && (alignPages << PAGE_SHIFT) <= HUGE_PAGE_SIZE)
+	{ // 显式大页本身就是按2MB对齐的，不需要再修剪
+		ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+		if (ptr == MAP_FAILED)
+			ptr = nullptr; // 没有配置大页或者大页用完了，下面退回普通页
+	}
+#endif
+
+	if (ptr == nullptr)
+	{
+		/* mmap只保证按4KB对齐，但pc是按8KB一页来算页号的(地址右移PAGE_SHIFT)，页堆还要求整块是按块大小对齐的，
+		所以多映射align字节，再把首尾多出来的部分munmap掉，剩下的就是按align对齐的len字节 */
+		size_t align = alignPages << PAGE_SHIFT;
+		void* raw = mmap(nullptr, len + align, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (raw != MAP_FAILED)
+		{
+			uintptr_t start = (uintptr_t)raw;
+			uintptr_t aligned = (start + align - 1) & ~(uintptr_t)(align - 1);
+			size_t head = aligned - start; // 前面多出来的
+			size_t tail = align - head; // 后面多出来的
+
+			if (head != 0)
+				munmap(raw, head);
+			if (tail != 0)
+				munmap((void*)(aligned + len), tail);
+
+			ptr = (void*)aligned;
+#ifdef CMP_MADV_HUGEPAGE
+			madvise(ptr, len, MADV_HUGEPAGE); // 只是建议，失败了也不影响使用
+#endif
+		}
+	}
 #endif
 
 	if (ptr == nullptr)
@@ -55,13 +162,117 @@ inline static void* SystemAlloc(size_t kpage)
 	return ptr;
 }
 
-// 直接去堆上释放空间
-inline static void SystemFree(void* ptr)
+#if defined(__linux__) && !defined(CMP_MAP_HUGETLB) // 显式大页的映射长度补齐过，不去动它
+#define CMP_HAVE_MREMAP
+#endif
+
+/* SystemAlloc要的kpage页扩成newPage页分三步：后面的地址空着就SystemExtend原地扩，
+ 不然SystemReserve先占一段地址，调用的地方确认这段地址能用(比如基数树能开出节点)之后再SystemMove整段挪过去，
+ 挪的时候内核只改页表，不拷贝数据。用不了mremap的时候前两个都失败，调用的地方自己拷贝 */
+
+// 原地扩，扩不了返回false，原来的映射不动
+inline static bool SystemExtend(void* ptr, size_t kpage, size_t newPage)
+{
+#ifdef CMP_HAVE_MREMAP
+	return mremap(ptr, kpage << PAGE_SHIFT, newPage << PAGE_SHIFT, 0) != MAP_FAILED;
+#else
+	(void)ptr;
+	(void)kpage;
+	(void)newPage;
+	return false;
+#endif
+}
+
+// 占一段按页对齐的newPage页地址(不能访问)，给SystemMove当目的地，失败返回空
+inline static void* SystemReserve(size_t newPage)
+{
+#ifdef CMP_HAVE_MREMAP
+	// mmap只保证按4KB对齐，多占一页再把首尾切掉
+	size_t len = newPage << PAGE_SHIFT;
+	size_t align = (size_t)1 << PAGE_SHIFT;
+	void* raw = mmap(nullptr, len + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (raw == MAP_FAILED)
+		return nullptr;
+
+	uintptr_t start = (uintptr_t)raw;
+	uintptr_t aligned = (start + align - 1) & ~(uintptr_t)(align - 1);
+	size_t head = aligned - start;
+	size_t tail = align - head;
+	if (head != 0)
+		munmap(raw, head);
+	if (tail != 0)
+		munmap((void*)(aligned + len), tail);
+	return (void*)aligned;
+#else
+	(void)newPage;
+	return nullptr;
+#endif
+}
+
+// SystemReserve占的地址没用上，还掉
+inline static void SystemUnreserve(void* dst, size_t newPage)
+{
+#ifdef CMP_HAVE_MREMAP
+	munmap(dst, newPage << PAGE_SHIFT);
+#else
+	(void)dst;
+	(void)newPage;
+#endif
+}
+
+// 把kpage页挪到SystemReserve占好的dst，扩成newPage页(会顶掉占位的映射)
+// 失败的话(比如这一段中间被mbind、madvise分成了几个映射)原来的映射不动，dst还是占着的，调用的地方自己SystemUnreserve
+inline static bool SystemMove(void* ptr, size_t kpage, size_t newPage, void* dst)
+{
+#ifdef CMP_HAVE_MREMAP
+	size_t newLen = newPage << PAGE_SHIFT;
+	if (mremap(ptr, kpage << PAGE_SHIFT, newLen, MREMAP_MAYMOVE | MREMAP_FIXED, dst) == MAP_FAILED)
+		return false;
+#ifdef CMP_MADV_HUGEPAGE
+	madvise(dst, newLen, MADV_HUGEPAGE);
+#endif
+	return true;
+#else
+	(void)ptr;
+	(void)kpage;
+	(void)newPage;
+	(void)dst;
+	return false;
+#endif
+}
+
+// 直接去堆上释放空间，kpage是当初SystemAlloc时申请的页数
+inline static void SystemFree(void* ptr, size_t kpage)
 {
 #ifdef _WIN32
 	VirtualFree(ptr, 0, MEM_RELEASE);
 #else
-	// sbrk unmmap等
+	munmap(ptr, SystemMapLength(kpage)); // munmap需要知道长度
+#endif
+}
+
+// 把kpage页的物理内存还给os，但虚拟地址还留着，pc里闲着的span用这个来降RSS
+// Linux下默认MADV_DONTNEED，RSS马上就降；定义了CMP_MADV_FREE就用MADV_FREE，内核内存紧张的时候才真正回收，开销小一点
+// 真的还掉了返回true，失败了(比如显式大页里的一段会返回EINVAL)返回false，这些页还占着物理内存，不能算成还掉了
+inline static bool SystemRelease(void* ptr, size_t kpage)
+{
+#ifdef _WIN32
+	return VirtualFree(ptr, kpage << PAGE_SHIFT, MEM_DECOMMIT) != 0;
+#elif defined(CMP_MADV_FREE) && defined(MADV_FREE)
+	return madvise(ptr, kpage << PAGE_SHIFT, MADV_FREE) == 0;
+#else
+	return madvise(ptr, kpage << PAGE_SHIFT, MADV_DONTNEED) == 0;
+#endif
+}
+
+// SystemRelease过的页重新拿来用之前调一下，Linux下访问的时候会自己缺页中断映射回来，什么都不用做
+inline static void SystemCommit(void* ptr, size_t kpage)
+{
+#ifdef _WIN32
+	VirtualAlloc(ptr, kpage << PAGE_SHIFT, MEM_COMMIT, PAGE_READWRITE);
+#else
+	(void)ptr;
+	(void)kpage;
 #endif
 }
 
@@ -73,27 +284,36 @@ static void*& ObjNext(void* obj) // obj的头4/8个字节
 	return *(void**)obj;
 }
 
-class SizeClass; // 这里要声明一下，不然PageMap中用到了SizeClass会报错，或者直接将PageMap放到最后面引用
-
+// 软件预取：提前把p所在的cache行拉进来，不会阻塞，等后面真正用到的时候就不用再等内存了
+static inline void Prefetch(const void* p)
+{
+#ifdef _MSC_VER
+	_mm_prefetch((const char*)p, _MM_HINT_T0);
+#else
+	__builtin_prefetch(p);
+#endif
+}
 
 // 这里头文件要放到这，不然上面的函数ObjectPool中没有，就会报错
 #include"ObjectPool.h"
-#include"PageMap.h"
 
-class FreeList // ThreadCache中的自由链表
+/* ThreadCache中的自由链表
+ 块数和下面的统计计数只有tc自己的线程会改，但ConcurrentGetStats的时候别的线程要来读，所以用原子变量，
+ 改的时候是relaxed的load再store(没有fetch_add那样的lock前缀)，和改普通变量一样便宜 */
+class FreeList
 {
 public:
 	// 获取当前桶中有多少块空间
 	size_t Size()
 	{
-		return _size;
+		return _size.load(std::memory_order_relaxed);
 	}
 
 	// 删除掉桶中n个块（头删），并把删除的空间作为输出型参数返回
 	void PopRange(void*& start, void*& end, size_t n)
 	{
 		// 删除块数不能超过size块
-		assert(n <= _size);
+		assert(n <= Size());
 
 		start = end = _freeList;
 
@@ -104,7 +324,7 @@ public:
 
 		_freeList = ObjNext(end);
 		ObjNext(end) = nullptr;
-		_size -= n;
+		AddSize(0 - n);
 	}
 
 	// 向自由链表中头插，且插入多块空间
@@ -113,7 +333,7 @@ public:
 		ObjNext(end) = _freeList;
 		_freeList = start;
 
-		_size += size;
+		AddSize(size);
 	}
 
 	bool Empty() // 判断哈希桶是否为空
@@ -128,7 +348,7 @@ public:
 		ObjNext(obj) = _freeList;
 		_freeList = obj;
 
-		++_size; // 插入一块，size + 1
+		AddSize(1); // 插入一块，size + 1
 	}
 
 	void* Pop() // 用来提供空间的
@@ -138,7 +358,7 @@ public:
 		void* obj = _freeList;
 		_freeList = ObjNext(obj);
 
-		--_size; // 去掉一块，_size - 1
+		AddSize(0 - (size_t)1); // 去掉一块，_size - 1
 
 		return obj;
 	}
@@ -149,14 +369,46 @@ public:
 		return _maxSize;
 	}
 
+	// 统计用：这个桶向cc要过几次块、还过几次块
+	size_t Fetches()
+	{
+		return _fetches.load(std::memory_order_relaxed);
+	}
+
+	size_t Releases()
+	{
+		return _releases.load(std::memory_order_relaxed);
+	}
+
+	void CountFetch()
+	{
+		_fetches.store(_fetches.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	void CountRelease()
+	{
+		_releases.store(_releases.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+private:
+	void AddSize(size_t n) // 减的时候传补码进来，无符号数溢出回绕正好就是减
+	{
+		_size.store(_size.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
 private:
 	void* _freeList = nullptr; // 自由链表，初始为空
 	size_t _maxSize = 1; // 当前自由链表申请未达到上限时，能够申请的最大块空间是多少
 						 // 初始值给1，表示第一次能申请的就是1块
 						 // 到了上限之后_maxSize这个值就作废了
-	size_t _size = 0; // 当前自由链表中有多少块空间
+	std::atomic<size_t> _size{ 0 }; // 当前自由链表中有多少块空间
+
+	std::atomic<size_t> _fetches{ 0 }; // 向cc要过几次
+	std::atomic<size_t> _releases{ 0 }; // 还给cc几次
 };
 
+struct RemoteFreeList; // tc的远程释放队列，见ThreadCache.h
+
 struct Span // 以页为基本单位的结构体
 {
 public:
@@ -164,7 +416,8 @@ public:
 	size_t _n = 0; // 当前span管理的页的数量
 	size_t _objSize = 0; // span管理页被切分成的块有多大
 
-	void* _freeList = nullptr; // 每个span下面挂的小块空间的头结点
+	void* _freeList = nullptr; // 每个span下面挂的小块空间的头结点(还回来的块)
+	char* _bump = nullptr; // 还没切过的部分从这里开始，_freeList用完了再从这里往后切
 	size_t use_count = 0; // 当前span分配出去了多少个块空间
 
 
@@ -172,6 +425,16 @@ public:
 	Span* _next = nullptr; // 后一个节点
 
 	bool _isUse = false; // 判断当前span是在cc中还是在pc中
+	bool _sampled = false; // 堆采样采到的块，自己单独占一个span，释放的时候要先删掉采样记录
+	bool _aligned = false; // ConcurrentAlignedAlloc按超过一页对齐要的span，块可能不到256KB，释放的时候也要整个还给pc
+	bool _large = false; // 直接向os要的span(大于128页的，和页堆里放不下的对齐span)，不属于页堆，还的时候直接还给os
+	// 最近一次从这个span切块走的是哪个tc的远程释放队列，别的线程释放这个span的块的时候还到这里去，
+	// cc拿块的时候改，释放的时候不加锁读，所以是原子的。per-cpu模式切的、还在pc里的都是空
+	std::atomic<RemoteFreeList*> _owner{ nullptr };
+	uint16_t _heap = 0; // 属于pc中的哪个页堆(NUMA节点号 * PAGE_HEAP_NUM + 节点内的编号)，大于128页的span只记节点号
+
+	bool _isReleased = false; // pc中闲着的span，物理内存是不是已经还给os了，再用的时候会重新缺页
+	uint64_t _idleSince = 0; // 什么时候回到pc的(ms)，闲得够久了才还给os
 };
 
 class SpanList
@@ -244,19 +507,20 @@ public:
 		pos->_prev = ptr;
 	}
 
-	SpanList()
-	{ // 构造函数中搞哨兵位头结点
-		_head = new Span;
+	constexpr SpanList()
+		: _head(&_headSpan)
+	{ // 哨兵位头结点直接放在SpanList里面，不再new，这样pc、cc这些静态单例编译期就能初始化好，
+	  // 不依赖全局构造的顺序，别的全局构造函数里调malloc的时候桶也是好的
 
 		// 因为是双向循环的，所以都指向_head
-		_head->_next = _head;
-		_head->_prev = _head;
+		_headSpan._next = &_headSpan;
+		_headSpan._prev = &_headSpan;
 	}
 
 private:
-	Span* _head; // 哨兵位头结点
-public:
-	std::mutex _mtx; // 每个CentralCache中的哈希桶都要有一个桶锁
+	Span _headSpan; // 哨兵位头结点本身
+	Span* _head; // 指向_headSpan
+	// 桶锁挪到了用SpanList的地方(cc的桶、pc的页堆)，一个桶里现在有好几个SpanList，共用一把锁
 };
 
 class SizeClass
@@ -286,88 +550,40 @@ public:
 	//}
 
 	// 计算每个分区对应的对齐后的字节数(大佬写法)
-	static size_t _RoundUp(size_t size, size_t alignNum)
+	static constexpr size_t _RoundUp(size_t size, size_t alignNum)
 	{									// alignNum是size对应分区的对齐数
 		return ((size + alignNum - 1) & ~(alignNum - 1));
 	}
 
-	static size_t RoundUp(size_t size) // 计算对齐后的字节数，size为线程申请的空间大小
-	{
-		if (size <= 128)
-		{ // [1,128] 8B
-			return _RoundUp(size, 8);
-		}
-		else if (size <= 1024)
-		{ // [128+1,1024] 16B
-			return _RoundUp(size, 16);
-		}
-		else if (size <= 8 * 1024)
-		{ // [1024+1,8*1024] 128B
-			return _RoundUp(size, 128);
-		}
-		else if (size <= 64 * 1024)
-		{ // [8*1024+1,64*1024] 1024B
-			return _RoundUp(size, 1024);
-		}
-		else if (size <= 256 * 1024)
-		{ // [64*1024+1,256*1024] 8 * 1024B
-			return _RoundUp(size, 8 * 1024);
-		}
-		else
-		{ // 单次申请空间大于256KB，直接按照页来对齐
-			return _RoundUp(size, 1 << PAGE_SHIFT);
-			// 这里直接给PAGE_SHIFT虽然说和前一个的8 * 1024KB一样，但
-			// 是我们如果后续想要修改页大小的时候就直接修改PAGE_SHIFT
-			// 这样就和前面的不一样了
-		}
-	}
+	// 计算对齐后的字节数，size为线程申请的空间大小
+	// 不超过256KB的直接查表，见后面的SizeClassTable
+	static inline size_t RoundUp(size_t size);
 
-	// 求size对应在哈希表中的下标（大佬写法）
-	static inline size_t _Index(size_t size, size_t align_shift)
-	{							/*这里align_shift是指对齐数的二进制位数。比如size为2的时候对齐数
-								为8，8就是2^3，所以此时align_shift就是3*/
-		return ((size + (1 << align_shift) - 1) >> align_shift) - 1;
-		//这里_Index计算的是当前size所在区域的第几个下标，所以Index的返回值需要加上前面所有区域的哈希桶的个数
-	}
+	// 要按align(2的幂，不超过一页)对齐的时候实际该申请多大：块都是从按页对齐的span里一块挨一块切出来的，
+	// 桶的块大小是align的倍数的话每一块就都是对齐的，大于256KB的按页给，也是对齐的
+	static inline size_t AlignedSize(size_t align, size_t size);
 
-	// 计算映射的哪一个自由链表桶（tc和cc用，二者映射规则一样）
-	static inline size_t Index(size_t size)
-	{
-		assert(size <= MAX_BYTES);
+	// 计算映射的哪一个自由链表桶（tc和cc用，二者映射规则一样），也是查表
+	static inline size_t Index(size_t size);
 
-		// 每个区间有多少个链
-		static int group_array[4] = { 16, 56, 56, 56 };
-		if (size <= 128)
-		{ // [1,128] 8B -->8B就是2^3B，对应二进制位为3位
-			return _Index(size, 3); // 3是指对齐数的二进制位位数，这里8B就是2^3B，所以就是3
-		}
-		else if (size <= 1024)
-		{ // [128+1,1024] 16B -->4位
-			return _Index(size - 128, 4) + group_array[0];
-		}
-		else if (size <= 8 * 1024)
-		{ // [1024+1,8*1024] 128B -->7位
-			return _Index(size - 1024, 7) + group_array[1] + group_array[0];
-		}
-		else if (size <= 64 * 1024)
-		{ // [8*1024+1,64*1024] 1024B -->10位
-			return _Index(size - 8 * 1024, 10) + group_array[2] + group_array[1]
-				+ group_array[0];
-		}
-		else if (size <= 256 * 1024)
-		{ // [64*1024+1,256*1024] 8 * 1024B  -->13位
-			return _Index(size - 64 * 1024, PAGE_SHIFT) + group_array[3] +
-				group_array[2] + group_array[1] + group_array[0];
-		}
-		else
-		{
-			assert(false);
-		}
-		return -1;
+	// 下面三个都是按桶的下标查表，块大小、单批块数、span页数放在同一个8字节的表项里，一次访存都拿到
+	static inline size_t ClassSize(size_t index); // 桶里一块多大
+	static inline size_t BatchSize(size_t index); // 就是NumMoveSize(ClassSize(index))
+	static inline size_t ClassPages(size_t index); // 就是NumMovePage(ClassSize(index))
+
+	// 按上面那张对齐规则表算对齐后的字节数，只在编译期生成表的时候用
+	static constexpr size_t RuleRoundUp(size_t size)
+	{
+		return size <= 128 ? _RoundUp(size, 8)
+			: size <= 1024 ? _RoundUp(size, 16)
+			: size <= 8 * 1024 ? _RoundUp(size, 128)
+			: size <= 64 * 1024 ? _RoundUp(size, 1024)
+			: size <= 256 * 1024 ? _RoundUp(size, 8 * 1024)
+			: _RoundUp(size, 1 << PAGE_SHIFT);
 	}
 
 	// tc向cc单次申请块空间的上限块数
-	static size_t NumMoveSize(size_t size)
+	static constexpr size_t NumMoveSize(size_t size)
 	{
 		assert(size > 0); // 不能申请0大小的空间
 
@@ -400,7 +616,7 @@ public:
 	}
 
 	// 块页匹配算法
-	static size_t NumMovePage(size_t size)// size表示一块的大小
+	static constexpr size_t NumMovePage(size_t size)// size表示一块的大小
 	{ // 当cc中没有span为tc提供小块空间时，cc就需要向pc申请一块span，此时需要根据一块空间的大小来匹配
 	  // 出一个维护页空间较为合适的span，以保证span为size后尽量不浪费或不足够还再频繁申请相同大小的span
 
@@ -424,3 +640,139 @@ public:
 	}
 };
 
+/* 编译期生成的查表，代替原来RoundUp和Index里那一串区间比较，思路和tcmalloc的class_array_一样：
+ [0,1024]按8字节一格，用(size+7)>>3当下标；(1024,256KB]按128字节一格，用(size+127+(120<<7))>>7当下标，
+ 这样两段正好接上，一共2169格，每格一个字节存桶的下标。
+ 每一格里的size都落在同一个桶里(1024以内的桶都是8的倍数，1024以上的都是128的倍数)，所以查出来是准的 */
+struct SizeClassInfo
+{
+	uint32_t _size; // 桶里一块多大
+	uint16_t _batch; // tc向cc单次最多要多少块
+	uint16_t _pages; // cc向pc要span的时候要多少页
+};
+
+class SizeClassTable
+{
+public:
+	static const size_t SMALL_MAX = 1024; // 按8字节一格的部分
+	static const size_t CLASS_ARRAY_SIZE = ((MAX_BYTES + 127 + (120 << 7)) >> 7) + 1;
+
+	// 算size在_classArray中的下标
+	static constexpr size_t ClassArrayIndex(size_t size)
+	{
+		return size <= SMALL_MAX ? (size + 7) >> 3 : (size + 127 + (120 << 7)) >> 7;
+	}
+
+	constexpr SizeClassTable()
+	{
+#ifdef CMP_SIZE_CLASS_HEADER
+		// 桶的大小和每个桶span的页数都用生成的表里的
+		for (size_t index = 0; index < FREE_LIST_NUM; ++index)
+		{
+			_info[index]._size = GEN_CLASS_SIZES[index];
+			_info[index]._batch = (uint16_t)SizeClass::NumMoveSize(GEN_CLASS_SIZES[index]);
+			_info[index]._pages = GEN_CLASS_PAGES[index];
+		}
+#else
+		// 按对齐规则从8开始一个桶一个桶地往后算
+		size_t index = 0;
+		for (size_t size = 8; size <= MAX_BYTES; size = SizeClass::RuleRoundUp(size + 1))
+		{
+			_info[index]._size = (uint32_t)size;
+			_info[index]._batch = (uint16_t)SizeClass::NumMoveSize(size);
+			_info[index]._pages = (uint16_t)SizeClass::NumMovePage(size);
+			++index;
+		}
+#endif
+
+		// 每一格取这一格里最大的size，找第一个放得下它的桶
+		size_t cls = 0;
+		for (size_t i = 0; i < CLASS_ARRAY_SIZE; ++i)
+		{
+			size_t maxSize = i <= (SMALL_MAX >> 3) ? i << 3 : (i << 7) - (120 << 7);
+			while (_info[cls]._size < maxSize)
+				++cls;
+			_classArray[i] = (uint8_t)cls;
+		}
+	}
+
+#ifdef CMP_SIZE_CLASS_HEADER
+	// 生成的表要满足查表和对齐的要求：从小到大，最后一个正好是256KB；1024以内的要是8的倍数，大于1024的要是128的倍数(查表一格的大小)；
+	// 不是16倍数的桶前面要紧挨着一个小8字节的桶，这样按16字节取整之后找到的桶都是16的倍数(malloc要16字节对齐)；一个span至少放得下一块
+	static constexpr bool CheckGenerated()
+	{
+		for (size_t i = 0; i < GEN_CLASS_NUM; ++i)
+		{
+			size_t size = GEN_CLASS_SIZES[i];
+			if (i > 0 && size <= GEN_CLASS_SIZES[i - 1])
+				return false;
+			if (size % (size <= SMALL_MAX ? 8 : 128) != 0)
+				return false;
+			if (size % 16 != 0 && size > 8 && (i == 0 || GEN_CLASS_SIZES[i - 1] != size - 8))
+				return false;
+			if (GEN_CLASS_PAGES[i] == 0 || GEN_CLASS_PAGES[i] >= PAGE_NUM
+				|| ((size_t)GEN_CLASS_PAGES[i] << PAGE_SHIFT) < size)
+				return false;
+		}
+		return GEN_CLASS_SIZES[0] >= sizeof(void*) && GEN_CLASS_SIZES[GEN_CLASS_NUM - 1] == MAX_BYTES;
+	}
+#endif
+
+	uint8_t _classArray[CLASS_ARRAY_SIZE] = {};
+	SizeClassInfo _info[FREE_LIST_NUM] = {};
+};
+
+#ifdef CMP_SIZE_CLASS_HEADER
+static_assert(SizeClassTable::CheckGenerated(), "生成的桶大小表不合法，重新用SizeClassGen生成一下");
+#endif
+
+inline constexpr SizeClassTable SIZE_CLASS_TABLE{};
+
+static_assert(FREE_LIST_NUM <= 256, "桶的下标要能放进一个字节");
+static_assert(SIZE_CLASS_TABLE._info[FREE_LIST_NUM - 1]._size == MAX_BYTES, "桶的个数和对齐规则对不上");
+
+inline size_t SizeClass::RoundUp(size_t size)
+{
+	if (size <= MAX_BYTES)
+		return SIZE_CLASS_TABLE._info[SIZE_CLASS_TABLE._classArray[SizeClassTable::ClassArrayIndex(size)]]._size;
+
+	// 单次申请空间大于256KB，直接按照页来对齐
+	return _RoundUp(size, 1 << PAGE_SHIFT);
+}
+
+inline size_t SizeClass::AlignedSize(size_t align, size_t size)
+{
+	assert(align > 0 && (align & (align - 1)) == 0 && align <= ((size_t)1 << PAGE_SHIFT));
+	if (size == 0)
+		size = 1;
+	size = _RoundUp(size, align);
+
+	// 桶的大小不一定是align的倍数(比如用的是自己生成的桶大小表)，那就接着往上找，256KB那个桶肯定是
+	while (size <= MAX_BYTES && RoundUp(size) % align != 0)
+		size = _RoundUp(RoundUp(size) + align, align);
+	return size;
+}
+
+inline size_t SizeClass::Index(size_t size)
+{
+	assert(size <= MAX_BYTES);
+	return SIZE_CLASS_TABLE._classArray[SizeClassTable::ClassArrayIndex(size)];
+}
+
+inline size_t SizeClass::ClassSize(size_t index)
+{
+	return SIZE_CLASS_TABLE._info[index]._size;
+}
+
+inline size_t SizeClass::BatchSize(size_t index)
+{
+	return SIZE_CLASS_TABLE._info[index]._batch;
+}
+
+inline size_t SizeClass::ClassPages(size_t index)
+{
+	return SIZE_CLASS_TABLE._info[index]._pages;
+}
+
+// PageMap中用到了SizeClass，gcc下只声明不定义会报不完整类型的错，所以放到最后面引用
+#include"PageMap.h"
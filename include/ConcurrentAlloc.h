@@ -1,38 +1,61 @@
 #pragma once
 #include"ThreadCache.h"
+#include"CentralCache.h"
 #include"PageCache.h"
+#include"CpuCache.h"
+#include"AllocStats.h"
+#include"HeapProfiler.h"
+#include"ConcurrentArena.h"
 
-// ʵtcmalloc̵߳ռ
+// 其实就是tcmalloc，线程调用这个函数申请空间
 static void* ConcurrentAlloc(size_t size)
 {
-	// ռ䳬256KBֱ²ȥҪ
+	// 堆采样：倒数减到负数了才进去，没采到的时候快路径上只有这一次减法和判断
+	if ((t_sampleBytesLeft -= (intptr_t)size) < 0)
+	{
+		void* ptr = HeapProfiler::GetInstance()->SampleAlloc(size, t_sampleBytesLeft);
+		if (ptr)
+			return ptr;
+	}
+
+	// 如果申请空间超过256KB，就直接找下层的去要
 	if (size > MAX_BYTES)
 	{
-		size_t alignSize = SizeClass::RoundUp(size); // ȰҳС
-		size_t k = alignSize >> PAGE_SHIFT; // ֮Ҫҳ
+		size_t alignSize = SizeClass::RoundUp(size); // 先按照页大小对齐
+		size_t k = alignSize >> PAGE_SHIFT; // 算出来对齐之后需要多少页
 
-		PageCache::GetInstance()->_pageMtx.lock(); // pcеspanв
-		Span* span = PageCache::GetInstance()->NewSpan(k); // ֱpcҪ
-		span->_objSize = size; // ͳƴ256KBҳ
-		PageCache::GetInstance()->_pageMtx.unlock(); // 
+		Span* span = PageCache::GetInstance()->NewSpan(k); // 直接向pc要，NewSpan里面会加锁，也会标记成在用
+		span->_objSize = size; // 统计大于256KB的页
 
-		void* ptr = (void*)(span->_pageID << PAGE_SHIFT); // ͨõspanṩռ
+		void* ptr = (void*)(span->_pageID << PAGE_SHIFT); // 通过获得到的span来提供空间
 		return ptr;
 	}
-	else // ռС256KBľԭȵ߼
+	else // 申请空间小于256KB的就走原先的逻辑
 	{
-		/* ΪpTLSThreadCacheTLSģÿ̶߳һ໥Բھ
-		pTLSThreadCache⣬ֻҪжһξͿֱnew̰߳ȫ*/
+#ifdef CMP_PER_CPU_CACHE
+		// 打开了per-cpu模式的话前端用cpu的缓存，不用线程的tc
+		if (CpuCache::IsActive())
+			return CpuCache::GetInstance()->Allocate(size);
+#endif
+
+		/* 因为pTLSThreadCache是TLS的，每个线程都会有一个，且相互独立，所以不存在竞
+		争pTLSThreadCache的问题，所以这里只需要判断一次就可以直接new，不存在线程安全问题*/
 		if (pTLSThreadCache == nullptr)
 		{
-			// pTLSThreadCache = new ThreadCache; // malloc
-			// ʱ൱ÿ̶߳һThreadCache
-
-			// öڴռ
-			static ObjectPool<ThreadCache> objPool; // ̬ģһֱ
-			objPool._poolMtx.lock();
-			pTLSThreadCache = objPool.New();
-			objPool._poolMtx.unlock();
+			if (tlsThreadCacheExited)
+			{ // 线程已经在退出了，tc回收过了，直接找cc要一块，还的时候ConcurrentFreeSmall也是直接还给cc
+				void* start = nullptr;
+				void* end = nullptr;
+				CentralCache::GetInstance()->FetchRangeObj(start, end, 1, SizeClass::RoundUp(size));
+				return start;
+			}
+
+			// pTLSThreadCache = new ThreadCache; // 不用malloc
+			// 此时就相当于每个线程都有了一个ThreadCache对象
+
+			// 用定长内存池来申请空间，线程退出时tlsThreadCacheReleaser会把它还回去
+			pTLSThreadCache = ThreadCache::Create();
+			tlsThreadCacheReleaser.Enable();
 		}
 
 		//cout << std::this_thread::get_id() << " " << pTLSThreadCache << endl;
@@ -41,27 +64,249 @@ static void* ConcurrentAlloc(size_t size)
 	}
 }
 
-// ̵߳տռ
+// 小于256KB的块还给前端缓存，size是块所在桶的大小(对不对齐都行)
+static void ConcurrentFreeSmall(void* ptr, size_t size)
+{
+#ifdef CMP_PER_CPU_CACHE
+	if (CpuCache::IsActive())
+	{
+		CpuCache::GetInstance()->Deallocate(ptr, size);
+		return;
+	}
+#endif
+
+	if (pTLSThreadCache == nullptr)
+	{ // 这个线程还没有tc(从来没申请过就先释放，或者线程退出时tc已经回收了)，
+	  // 为了还一块去开一个tc不划算，直接还给cc
+		ObjNext(ptr) = nullptr;
+		CentralCache::GetInstance()->ReleaseListToSpans(ptr, size);
+		return;
+	}
+
+	pTLSThreadCache->Deallocate(ptr, size);
+}
+
+// 块是别的线程的tc从span切走的，而且当前线程自己不怎么申请这种块，就挂到那个tc的远程释放队列上，
+// 不放进自己的tc，挂上了返回true。per-cpu模式下块不分线程，不走这里
+static bool ConcurrentFreeRemote(void* ptr, size_t size, Span* span)
+{
+#ifdef CMP_PER_CPU_CACHE
+	if (CpuCache::IsActive())
+		return false;
+#endif
+
+	RemoteFreeList* owner = span->_owner.load(std::memory_order_relaxed);
+	if (owner == nullptr)
+		return false;
+
+	size_t index = SizeClass::Index(size);
+	if (pTLSThreadCache != nullptr && (owner == pTLSThreadCache->Remote() || !pTLSThreadCache->MostlyReleases(index)))
+		return false;
+
+	return owner->Push(ptr, index); // 那个线程已经退出了(队列关了)就还是走原来的路径
+}
+
+// 线程调用这个函数用来回收空间
 static void ConcurrentFree(void* ptr)
-{			/*ڶsizeȥģ
-			ֻΪôܲŸ*/
+{			/*这里第二个参数size后面会去掉的，
+			这里只是为了让代码能跑才给的*/
 	assert(ptr);
 	
-	// ͨptrҵӦspanΪǰռ
-	// ʱѾ֤άĿռҳַѾӳ
+	// 通过ptr找到对应的span，因为前面申请空间的
+	// 时候已经保证了维护的空间首页地址已经映射过了
 	Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
-	size_t size = span->_objSize; // ͨӳspanȡptrָռС
+	size_t size = span->_objSize; // 通过映射来的span获取ptr所指空间大小
+	assert(size != 0); // ConcurrentArena里的指针不能还到这里
 
-	// ͨsizeжǲǴ256KBģ˾pc
-	if (size > MAX_BYTES)
+	if (span->_sampled)
+	{ // 采样采到的块自己占一个span，删掉采样记录之后整个span还给pc
+		HeapProfiler::GetInstance()->SampleFree(ptr, span);
+		return;
+	}
+
+	// 通过size判断是不是大于256KB的，是了就走pc，按超过一页对齐要的span不管多大也是整个还
+	if (size > MAX_BYTES || span->_aligned)
+	{
+		span->_aligned = false;
+		PageCache::GetInstance()->ReleaseSpanToPageCache(span); // 直接通过span释放空间，锁在里面加
+	}
+	else if (!ConcurrentFreeRemote(ptr, size, span)) // 不是大于256KB的，不是别的线程的就走tc
+	{
+		ConcurrentFreeSmall(ptr, size);
+	}
+}
+
+// 调用方知道块多大的时候用这个，size就是当初ConcurrentAlloc时给的大小
+// 小块直接按size找桶，不用再去基数树里查span，省掉一次大概率不在cache里的访存，
+// 所以也不知道块是哪个线程的，不走远程释放队列，还是放进自己的tc
+static void ConcurrentFree(void* ptr, size_t size)
+{
+	assert(ptr);
+
+	// 大块本来就要拿span还给pc，查一次跑不掉；采样采到的块都在页的开头，按页对齐的也去查一下span
+	if (size > MAX_BYTES || ((uintptr_t)ptr & (((uintptr_t)1 << PAGE_SHIFT) - 1)) == 0)
+	{
+		ConcurrentFree(ptr);
+		return;
+	}
+
+	// debug下核对一下给的size和span里记的是不是同一个桶的，给错了会把块挂到别的桶上
+	assert(PageCache::GetInstance()->MapObjectToSpan(ptr)->_objSize == SizeClass::RoundUp(size));
+
+	ConcurrentFreeSmall(ptr, size);
+}
+
+/* 把ptr的大小改成size，返回改完之后的地址(可能会变)，原来的内容都还在：
+ 1. 小块：新的大小还在同一个桶里就不动，换桶的话申请新块拷过去(缩小到别的桶也要挪，不然带size释放的时候会找错桶)
+ 2. 大块(和ConcurrentAlignedAlloc按超过一页对齐要的)：span的页还放得下就只改一下记的大小；
+	放不下的先找pc原地扩，页堆里的span把右边紧挨着的空闲span吃进来，直接向os要的span用mremap，
+	内核只改页表不拷贝，都不行才申请新的再拷过去
+ ptr是空的相当于ConcurrentAlloc，size是0相当于ConcurrentFree，返回空。要不到内存的时候抛异常，原来的块不动 */
+static void* ConcurrentRealloc(void* ptr, size_t size)
+{
+	if (ptr == nullptr)
+		return ConcurrentAlloc(size);
+	if (size == 0)
 	{
-		PageCache::GetInstance()->_pageMtx.lock(); // ǵü
-		PageCache::GetInstance()->ReleaseSpanToPageCache(span); // ֱͨspanͷſռ
-		PageCache::GetInstance()->_pageMtx.unlock(); // ǵü
+		ConcurrentFree(ptr);
+		return nullptr;
 	}
-	else // Ǵ256KBľtc
+
+	Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+	size_t oldSize = span->_objSize;
+	if (!span->_sampled) // 采样采到的块挪一下，记录跟着新块走
 	{
-		pTLSThreadCache->Deallocate(ptr, size);
+		if (oldSize <= MAX_BYTES && !span->_aligned)
+		{
+			if (SizeClass::RoundUp(size) == oldSize)
+				return ptr;
+		}
+		else if (size > MAX_BYTES || span->_aligned)
+		{
+			size_t k = (size + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+			// 缩了一半以上的话挪到小一点的地方，多出来的页还回去
+			if ((k <= span->_n && k * 2 > span->_n)
+				|| (k > span->_n && PageCache::GetInstance()->GrowSpan(span, k)))
+			{
+				span->_objSize = size;
+				return (void*)(span->_pageID << PAGE_SHIFT);
+			}
+		}
 	}
+
+	void* newPtr = ConcurrentAlloc(size);
+	memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+	ConcurrentFree(ptr);
+	return newPtr;
+}
+
+/* 按align对齐申请size字节，align要是2的幂。ConcurrentAlloc只保证8字节对齐，
+ 要按缓存行(64)对齐防止伪共享、SIMD要16/32/64对齐、要按4KB对齐的时候用这个：
+ 1. 不超过一页的对齐：块都是从按页对齐的span里一块挨一块切出来的，挑一个块大小是align倍数的桶，
+	每一块就都是对齐的，还是走tc的快路径
+ 2. 超过一页的对齐：向pc要一个首页对齐的span，pc多拿align - 1页，对齐的那一段留下，
+	前后多出来的马上还回页堆，不像在块前面垫一段那样一直多占一倍 */
+static void* ConcurrentAlignedAlloc(size_t size, size_t align)
+{
+	assert(align > 0 && (align & (align - 1)) == 0);
+	if (size == 0)
+		size = 1;
+	if (align <= 8)
+		return ConcurrentAlloc(size);
+	if (size > SIZE_MAX - align - ((size_t)1 << PAGE_SHIFT))
+		throw std::bad_alloc(); // 大得离谱，对齐、按页取整都会溢出
+	if (align <= ((size_t)1 << PAGE_SHIFT))
+		return ConcurrentAlloc(SizeClass::AlignedSize(align, size));
+
+	size_t k = (size + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+	Span* span = PageCache::GetInstance()->NewAlignedSpan(k, align >> PAGE_SHIFT);
+	span->_objSize = size;
+	span->_aligned = true;
+	return (void*)(span->_pageID << PAGE_SHIFT);
+}
+
+// 释放ConcurrentAlignedAlloc申请的块，size、align要和申请的时候给的一样，不超过一页的对齐就能走带size的快路径
+// (也可以直接ConcurrentFree(ptr))
+static void ConcurrentAlignedFree(void* ptr, size_t size, size_t align)
+{
+	if (size == 0)
+		size = 1;
+	if (align <= 8)
+		ConcurrentFree(ptr, size);
+	else if (align <= ((size_t)1 << PAGE_SHIFT))
+		ConcurrentFree(ptr, SizeClass::AlignedSize(align, size));
+	else
+		ConcurrentFree(ptr); // 首页对齐的span，带size的也要查span
+}
+
+// 打开或者关闭per-cpu模式，当前平台用不了rseq的时候会打开失败，返回值是现在是不是per-cpu模式
+static bool ConcurrentSetPerCpuCache(bool enable)
+{
+#ifdef CMP_PER_CPU_CACHE
+	return CpuCache::GetInstance()->SetActive(enable);
+#else
+	return false;
+#endif
+}
+
+
+// 设置所有线程的tc加起来最多缓存多少字节，超了之后常用的线程会从最久没活动的线程那里偷缓存的额度
+static void ConcurrentSetThreadCacheBudget(size_t bytes)
+{
+	ThreadCache::SetBudget(bytes);
 }
 
+// 把pc中闲着的span的物理内存还给os(虚拟地址还留着，再用的时候会重新缺页)，最多还bytes字节，返回实际还了多少
+// tc和cc里缓存的块不在这里面
+static size_t ConcurrentReleaseFreeMemory(size_t bytes = SIZE_MAX)
+{
+	// cc中转站里囤着的整批块先还给span，这些span空了才会回到pc
+	CentralCache::GetInstance()->ReleaseTransferCaches(false);
+	return PageCache::GetInstance()->ReleaseIdleSpans(bytes, 0);
+}
+
+// 打开后台回收线程：每秒最多还bytesPerSec字节，只还在pc里闲了至少minIdleMs毫秒的span，bytesPerSec给0就停下来
+// 也可以用环境变量CMP_RELEASE_RATE、CMP_RELEASE_AGE_MS打开
+static void ConcurrentSetBackgroundRelease(size_t bytesPerSec, size_t minIdleMs = 10000)
+{
+	PageCache::GetInstance()->SetBackgroundRelease(bytesPerSec, minIdleMs);
+}
+
+// 收集内存池各层的统计，每一项是什么见AllocStats.h，要挨个加各层的锁，别在很热的路径上调
+static AllocStats ConcurrentGetStats()
+{
+	AllocStats stats;
+	ThreadCache::GetStats(stats);
+	CpuCache::GetInstance()->GetStats(stats);
+	CentralCache::GetInstance()->GetStats(stats);
+	PageCache::GetInstance()->GetStats(stats);
+	ConcurrentArena::GetStats(stats);
+	SumStats(stats);
+	return stats;
+}
+
+// 统计按人看的格式输出
+static std::string ConcurrentStatsText()
+{
+	return StatsToText(ConcurrentGetStats());
+}
+
+// 统计输出成JSON
+static std::string ConcurrentStatsJson()
+{
+	return StatsToJson(ConcurrentGetStats());
+}
+
+// 打开堆采样，平均每申请bytes字节采一次，0就是关掉。也可以用环境变量CMP_HEAP_SAMPLE_RATE=bytes打开
+// 调用的线程马上生效，别的线程在没开采样的时候是隔HEAP_SAMPLE_RECHECK_BYTES字节才看一次，最晚要再申请这么多才生效
+static void ConcurrentSetHeapSampleRate(size_t bytes)
+{
+	HeapProfiler::GetInstance()->SetSampleRate(bytes);
+	t_sampleBytesLeft = 0; // 下一次申请就进SampleAlloc按新的间隔重新倒数
+}
+
+// 把还活着的采样写到path里，pprof格式，写成功了返回true
+static bool ConcurrentDumpHeapProfile(const char* path)
+{
+	return HeapProfiler::GetInstance()->DumpHeapProfile(path);
+}
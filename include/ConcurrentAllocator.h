@@ -0,0 +1,89 @@
+#pragma once
+
+#include"ConcurrentAlloc.h"
+#include<new>
+#include<limits>
+
+#if __has_include(<memory_resource>)
+#include<memory_resource>
+#define CMP_HAVE_MEMORY_RESOURCE
+#endif
+
+/* 给标准库容器用的分配器：std::map<K, V, std::less<K>, ConcurrentAllocator<std::pair<const K, V>>>这样用，
+ pmr容器就把ConcurrentGetMemoryResource()交给它。
+
+ 容器释放的时候自己会把当初申请的个数(字节数)一起给回来，所以这两个都走带size的ConcurrentFree，
+ 小块直接按size找桶，不用再去基数树里查span。map、list这种一个节点申请一次的容器，节点又小又多，
+ 每次释放省掉的那一次访存就很可观了。
+
+ 对齐超过8的类型(alignas(16)、alignas(64)这种)走ConcurrentAlignedAlloc，挑一个块大小是align倍数的桶，
+ 释放的时候按同样的规则算回去，所以申请和释放给的n、align要一样(标准本来就是这么要求的) */
+
+template<class T>
+class ConcurrentAllocator
+{
+public:
+	typedef T value_type;
+
+	ConcurrentAllocator() noexcept
+	{}
+
+	template<class U>
+	ConcurrentAllocator(const ConcurrentAllocator<U>&) noexcept
+	{}
+
+	T* allocate(size_t n)
+	{
+		if (n > std::numeric_limits<size_t>::max() / sizeof(T))
+			throw std::bad_array_new_length();
+		return (T*)ConcurrentAlignedAlloc(n * sizeof(T), alignof(T));
+	}
+
+	void deallocate(T* p, size_t n) noexcept
+	{
+		ConcurrentAlignedFree(p, n * sizeof(T), alignof(T));
+	}
+};
+
+// 分配器里没有状态，哪个申请的都能由哪个释放
+template<class T, class U>
+bool operator==(const ConcurrentAllocator<T>&, const ConcurrentAllocator<U>&) noexcept
+{
+	return true;
+}
+
+template<class T, class U>
+bool operator!=(const ConcurrentAllocator<T>&, const ConcurrentAllocator<U>&) noexcept
+{
+	return false;
+}
+
+#ifdef CMP_HAVE_MEMORY_RESOURCE
+// pmr用的内存资源，do_deallocate的时候pmr也会把字节数和对齐给回来
+class ConcurrentMemoryResource : public std::pmr::memory_resource
+{
+protected:
+	void* do_allocate(size_t bytes, size_t align) override
+	{
+		return ConcurrentAlignedAlloc(bytes, align);
+	}
+
+	void do_deallocate(void* p, size_t bytes, size_t align) override
+	{
+		ConcurrentAlignedFree(p, bytes, align);
+	}
+
+	// 所有ConcurrentMemoryResource用的都是同一个内存池，互相释放没问题(每个编译单元的ConcurrentGetMemoryResource是不同的对象)
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		return dynamic_cast<const ConcurrentMemoryResource*>(&other) != nullptr;
+	}
+};
+
+// 没有状态，用这一个就够了
+static std::pmr::memory_resource* ConcurrentGetMemoryResource()
+{
+	static ConcurrentMemoryResource resource;
+	return &resource;
+}
+#endif
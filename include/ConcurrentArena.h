@@ -0,0 +1,90 @@
+#pragma once
+
+#include"Common.h"
+#include"AllocStats.h"
+#include<cstddef>
+#include<utility>
+#include<new>
+
+/* 区域分配器：一次请求里申请的成千上万个小对象，请求结束的时候一起扔掉。
+ 用ConcurrentAlloc/ConcurrentFree的话每个对象释放的时候都要查一次span、还一次tc；
+ 这里直接向pc要ARENA_SPAN_PAGES页的span，在里面挪指针切，单个对象不能释放，
+ Reset或者析构的时候所有span一次还掉：
+ 1. 申请就是对齐一下、加一下指针，当前span切完了才去拿下一个span
+ 2. 比span的1/4还大的申请单独要一个正好够的span，不浪费当前span剩下的部分
+ 3. 还回来的标准大小的span先留在当前线程(最多ARENA_CACHE_SPANS个)，同一个线程的下一个arena直接拿来用，
+	请求一个接一个处理的时候稳定下来就不用再找pc了。留不下的、单独要的大span攒在一起一次交给pc
+ 4. 线程退出的时候留着的span还给pc
+
+ 一个arena同时只能给一个线程用(不加锁)，可以在别的线程Reset，span就留在那个线程。
+ 对象的析构函数不会被调用，arena里的指针不能交给ConcurrentFree */
+class ConcurrentArena
+{
+public:
+	ConcurrentArena()
+	{}
+
+	~ConcurrentArena()
+	{
+		Reset();
+	}
+
+	ConcurrentArena(const ConcurrentArena&) = delete;
+	ConcurrentArena& operator=(const ConcurrentArena&) = delete;
+
+	// 申请size字节，按align对齐(要是2的幂，不能超过一页)
+	void* Alloc(size_t size, size_t align = alignof(std::max_align_t))
+	{
+		assert(align > 0 && (align & (align - 1)) == 0 && align <= ((size_t)1 << PAGE_SHIFT));
+		if (size > SIZE_MAX - ((size_t)1 << PAGE_SHIFT))
+			throw std::bad_alloc(); // 大得离谱，下面加上对齐、按页取整都会溢出
+
+		size_t pad = (0 - (uintptr_t)_ptr) & (align - 1);
+		if (size + pad <= (size_t)(_end - _ptr) && _ptr != nullptr)
+		{
+			void* obj = _ptr + pad;
+			_ptr += pad + size;
+			return obj;
+		}
+		return AllocSlow(size);
+	}
+
+	// 在arena里构造一个T，不会析构
+	template<class T, class... Args>
+	T* New(Args&&... args)
+	{
+		return new(Alloc(sizeof(T), alignof(T)))T(std::forward<Args>(args)...);
+	}
+
+	// 所有span还掉，之前申请的全部作废，arena可以接着用
+	void Reset();
+
+	// 已经切出去了多少字节(包括对齐浪费的)、手上的span一共多少字节
+	size_t BytesUsed()
+	{
+		return _usedBytes + (_ptr - _begin);
+	}
+
+	size_t BytesReserved()
+	{
+		return _spanBytes;
+	}
+
+	// 所有arena的统计：正在用的和线程留着的span一共多少字节，向pc要了几次span
+	static void GetStats(AllocStats& stats);
+
+private:
+	// 当前span切不下了，拿一个新的。新span的开头按页对齐，不超过一页的对齐都满足，不用再看align
+	void* AllocSlow(size_t size);
+
+	// 拿一个k页的span挂到_spans上
+	Span* NewSpan(size_t k);
+
+private:
+	Span* _spans = nullptr; // 这个arena所有的span，用span的_next串起来，第一个是正在切的
+	char* _begin = nullptr; // 正在切的span从哪开始
+	char* _ptr = nullptr; // 正在切的span切到哪了
+	char* _end = nullptr; // 正在切的span到哪结束
+	size_t _usedBytes = 0; // 之前的span切出去了多少
+	size_t _spanBytes = 0;
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include"Common.h"
+#include"AllocStats.h"
+
+/* 按cpu划分的前端缓存，是ThreadCache之外的另一种模式。
+ 线程特别多、但大部分线程都闲着的时候，每个线程一个tc(208个自由链表)，缓存的内存会跟着线程数
+ 成倍地涨；按cpu来缓存的话，缓存的总量就只和cpu个数有关了。
+
+ 每个cpu的每个桶是一个数组，当栈来用，压栈弹栈都放在Linux的rseq(restartable sequences)临界区
+ 里做：临界区执行过程中只要线程被抢占、被信号打断或者被迁移到别的cpu，内核就会把它弹到abort
+ 的位置重来，所以同一个cpu上的操作天然是串行的，不需要加锁，也不需要原子指令。
+ 后端还是原来的CentralCache。
+
+ 只有x86-64的Linux并且glibc已经给线程注册了rseq(glibc 2.35以后默认会注册)才能用，
+ 用不了的时候SetActive(true)会失败，还是用原来的ThreadCache */
+class CpuCache
+{
+public:
+	// 饿汉单例
+	static CpuCache* GetInstance()
+	{
+		return &_sInst;
+	}
+
+	// 现在是不是在用per-cpu缓存，ConcurrentAlloc/ConcurrentFree每次都会看一下
+	static bool IsActive()
+	{
+		return _active.load(std::memory_order_relaxed);
+	}
+
+	// 打开或者关闭per-cpu模式，rseq用不了的时候打开会失败，返回值是现在有没有在用
+	// 关掉的时候cpu缓存里的块不会清掉，下次打开的时候接着用
+	bool SetActive(bool active);
+
+	// 当前机器上能不能用rseq
+	bool Supported();
+
+	// 从当前cpu的缓存中申请size大小的空间
+	void* Allocate(size_t size);
+
+	// 把size大小的obj还到当前cpu的缓存中
+	void Deallocate(void* obj, size_t size);
+
+	// 所有cpu缓存中一共存了多少字节
+	size_t CachedBytes();
+
+	// 每个桶在所有cpu缓存中一共存了多少块，加到stats里
+	void GetStats(AllocStats& stats);
+
+private:
+	// 当前cpu的桶空了，从cc拿一批上来
+	void* FetchFromCentralCache(size_t index, int cpu);
+
+	// 当前cpu的桶满了，倒一部分给cc
+	void ReleaseToCentralCache(size_t index, int cpu);
+
+	// 拿到cpu对应的那一块缓存，第一次用到的时候才去开
+	char* GetRegion(int cpu);
+
+	// 第一次用的时候把每个桶的块大小、容量、在缓存中的偏移算好
+	void Init();
+
+	// 当前线程在哪个cpu上，rseq用不了的时候返回-1
+	static int CurrentCpu();
+
+	// 每个cpu的缓存前面是FREE_LIST_NUM个栈顶，后面是每个桶的数组
+	intptr_t* Tops(char* region)
+	{
+		return (intptr_t*)region;
+	}
+
+	void** Slots(char* region, size_t index)
+	{
+		return (void**)(region + _slotOffset[index]);
+	}
+
+private:
+	constexpr CpuCache()
+	{}
+
+	CpuCache(const CpuCache& copy) = delete;
+	CpuCache& operator =(const CpuCache& copy) = delete;
+
+private:
+	size_t _classSize[FREE_LIST_NUM] = { 0 }; // 每个桶对齐后的块大小
+	size_t _capacity[FREE_LIST_NUM] = { 0 }; // 每个桶在一个cpu上最多存多少块
+	size_t _slotOffset[FREE_LIST_NUM] = { 0 }; // 每个桶的数组在cpu缓存中的偏移
+	size_t _regionPages = 0; // 一个cpu的缓存有多少页
+
+	int _numCpus = 0; // 一共有多少个cpu
+	std::atomic<char*>* _regions = nullptr; // 每个cpu一块缓存
+
+	std::atomic<bool> _inited{ false };
+	std::mutex _initMtx;
+
+	static std::atomic<bool> _active;
+	static CpuCache _sInst; // 饿汉模式创建一个CpuCache
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include"Common.h"
+
+/* 采样的堆分析器，不用挂valgrind这种很重的工具，也能看出来内存都是被哪些调用栈拿着的。
+
+ 每个线程有一个倒数的字节数，每次ConcurrentAlloc减掉申请的大小，减到负数了才进SampleAlloc，
+ 所以不采样的时候快路径上只多了一次减法和一次判断。倒数的初始值按指数分布随机取，平均是采样间隔，
+ 这样平均每申请采样间隔那么多字节采一次，大块被采到的概率更大，也不会和程序申请的规律碰巧对上。
+
+ 采到的块不从tc拿，单独向pc要一个span(标上_sampled)，记下调用栈；ConcurrentFree查到的span
+ 标了_sampled就把记录删掉，再把span还给pc。带size的ConcurrentFree不查span，但采到的块都在页的开头，
+ 所以只有按页对齐的块才去查一下，别的块还是原来的快路径。
+
+ ConcurrentDumpHeapProfile把还活着的采样写成gperftools的heap profile格式，可以直接交给pprof看 */
+class HeapProfiler
+{
+public:
+	// 饿汉单例
+	static HeapProfiler* GetInstance()
+	{
+		return &_sInst;
+	}
+
+	// 平均每申请bytes字节采一次，0就是关掉。也可以用环境变量CMP_HEAP_SAMPLE_RATE=bytes打开
+	void SetSampleRate(size_t bytes)
+	{
+		_sampleRate.store(bytes, std::memory_order_relaxed);
+	}
+
+	size_t SampleRate()
+	{
+		return _sampleRate.load(std::memory_order_relaxed);
+	}
+
+	// 线程的倒数减到负数了调这个，bytesLeft就是那个倒数，这里重新设好。
+	// 这一次要采样的话返回采样的块，不采样(没开，或者刚开还没开始倒数)返回空，调用的地方接着走原来的路径
+	void* SampleAlloc(size_t size, intptr_t& bytesLeft);
+
+	// 释放采到的块，span是它的span
+	void SampleFree(void* ptr, Span* span);
+
+	// 把还活着的采样写到path里，写成功了返回true
+	bool DumpHeapProfile(const char* path);
+
+	// 现在还活着的采样有几个、一共多少字节
+	size_t LiveSamples();
+	size_t LiveBytes();
+
+private:
+	// 一次采样的记录
+	struct Sample
+	{
+		void* _ptr = nullptr; // 采到的块
+		size_t _size = 0; // 申请了多少字节
+		Sample* _next = nullptr; // 哈希桶里的下一个
+		int _depth = 0; // 调用栈有几层
+		void* _stack[HEAP_SAMPLE_MAX_DEPTH] = {};
+	};
+
+	static size_t Bucket(void* ptr)
+	{
+		return ((uintptr_t)ptr >> PAGE_SHIFT) % HEAP_SAMPLE_BUCKETS; // 采到的块都是按页对齐的
+	}
+
+	// 按指数分布取下一次要倒数多少字节
+	intptr_t NextInterval(size_t rate);
+
+private:
+	constexpr HeapProfiler()
+	{}
+
+	HeapProfiler(const HeapProfiler& copy) = delete;
+	HeapProfiler& operator =(const HeapProfiler& copy) = delete;
+
+private:
+	std::atomic<size_t> _sampleRate{ 0 }; // 采样间隔，0是没开
+
+	Sample* _table[HEAP_SAMPLE_BUCKETS] = {}; // 块地址到采样记录的哈希表
+	ObjectPool<Sample> _samplePool; // 采样记录从这里拿，不走malloc
+	size_t _liveSamples = 0;
+	size_t _liveBytes = 0;
+	size_t _totalSamples = 0; // 一共采了多少次，包括已经释放了的
+	size_t _totalBytes = 0;
+	std::mutex _mtx; // 上面这些的锁
+
+	static HeapProfiler _sInst;
+};
+
+// extern的thread_local变量，gcc/clang在别的编译单元里每次访问之前都要先看一下有没有动态初始化要做，
+// 快路径上平白多一次判断。只要清零的变量用__thread就没有这一步
+#ifdef __GNUC__
+#define CMP_THREAD_LOCAL_POD __thread
+#else
+#define CMP_THREAD_LOCAL_POD thread_local
+#endif
+
+// 每个线程还要申请多少字节才采下一次，一开始是0，第一次申请的时候就会进SampleAlloc设好
+// 定义在HeapProfiler.cpp里，所有编译单元用同一个
+extern CMP_THREAD_LOCAL_POD intptr_t t_sampleBytesLeft;
@@ -1,6 +1,6 @@
 #pragma once
 
-/*ڴ*/
+/*定长内存池*/
 
 #include"Common.h"
 
@@ -8,70 +8,349 @@ template<class T>
 class ObjectPool
 {
 public:
-	T* New() // һTʹСĿռ
+	T* New() // 申请一个T类型大小的空间
 	{
-		T* obj = nullptr; // շصĿռ
+		T* obj = nullptr; // 最终返回的空间
 		
 		if (_freelist)
-		{ // _freelistΪգʾлյTССظ
+		{ // _freelist不为空，表示有回收的T大小的小块可以重复利用
 			void* next = *(void**)_freelist;
 			obj = (T*)_freelist;
 			_freelist = next;
-			// ͷɾ
+			// 头删操作
 		}
 		else
-		{ // ûп飬ҲûпظõĿռ
-			// _memoryʣռСTĴСʱٿռ
-			if (_remanentBytes < sizeof(T)) // ҲʣռΪ0
+		{ // 自由链表中没有块，也就没有可以重复利用的空间
+			// _memory中剩余空间小于T的大小的时候再开空间
+			if (_remanentBytes < sizeof(T)) // 这样也会包含剩余空间为0的情况
 			{
-				_remanentBytes = 128 * 1024; // 128KĿռ
+				_remanentBytes = 128 * 1024; // 开128K的空间
 				//_memory = (char*)malloc(_remanentBytes);
 				
-				// 13λǳ8KBҲǵõ16ͱʾ16ҳ
+				// 右移13位，就是除以8KB，也就是得到的是16，这里就表示申请16页
 				_memory = (char*)SystemAlloc(_remanentBytes >> PAGE_SHIFT); 
 				
-				if (_memory == nullptr) // ʧ쳣
+				if (_memory == nullptr) // 开失败了抛异常
 				{
 					throw std::bad_alloc();
 				}
+				_reservedBytes += _remanentBytes;
 			}
 
-			obj = (T*)_memory; // һT͵ĴС
-			// жһTĴССָ͸һָСָͻTĴС
+			obj = (T*)_memory; // 给定一个T类型的大小
+			// 判断一下T的大小，小于指针就给一个指针大小，大于指针就还是T的大小
 			size_t objSize = sizeof(T) < sizeof(void*) ? sizeof(void*) : sizeof(T);
-			_memory += objSize; // _memoryһT͵ĴС
-			_remanentBytes -= objSize; // ռ_remanetBytesT͵ĴС
+			_memory += objSize; // _memory后移一个T类型的大小
+			_remanentBytes -= objSize; // 空间给出后_remanetBytes减少了T类型的大小
 		}
 		
-		new(obj)T; // ͨλnewù캯гʼ
-
-		if(obj == nullptr)
-		{
-			int x = 0;
-		}
+		new(obj)T; // 通过定位new调用构造函数进行初始化
+		++_inUse;
 		return obj;
 	}
 
-	void Delete(T* obj) // ջСռ
+	void Delete(T* obj) // 回收还回来的小空间
 	{
-		// ʾ
+		// 显示调用析构函数进行清理工作
 		obj->~T();
 
-		// ͷ
-		*(void**)obj = _freelist; // ¿ָɿ()
-		_freelist = obj; // ͷָָ¿
+		// 头插
+		*(void**)obj = _freelist; // 新块指向旧块(或空)
+		_freelist = obj; // 头指针指向新块
+		--_inUse;
+	}
+
+	// 统计用：一共向os要了多少字节、现在有多少个对象在用，要拿着保护这个池子的锁调
+	size_t ReservedBytes()
+	{
+		return _reservedBytes;
+	}
+
+	size_t InUse()
+	{
+		return _inUse;
 	}
 
 private:
-	char* _memory = nullptr; // ָڴָ
-	size_t _remanentBytes = 0; // ڴзֹеʣֽ
-	void* _freelist = nullptr; // ӹ黹Ŀпռ
+	char* _memory = nullptr; // 指向内存块的指针
+	size_t _remanentBytes = 0; // 大块内存在切分过程中的剩余字节数
+	void* _freelist = nullptr; // 自由链表，用来连接归还的空闲空间
+	size_t _reservedBytes = 0; // 一共向os要了多少字节
+	size_t _inUse = 0; // 现在有多少个对象在用
+public:
+	std::mutex _poolMtx; // 防止ThreadCache申请时申请到空指针
+};
+
+/* 多线程用的定长内存池。上面的ObjectPool只能一个线程用，多个线程要用的话得在外面包一把锁，
+ 每New/Delete一次都要抢这把锁。这里按T分，每个线程手上有弹匣(magazine，一个装着最多
+ OBJECT_POOL_MAGAZINE_SLOTS个空闲对象的数组)，公共的仓库(depot)里放装了对象的弹匣：
+ 1. New从当前线程装着的弹匣里拿，Delete往里放，都只是数组的下标加减，不碰锁也没有原子操作
+ 2. 装着的空了/满了先和备用的那个换一下，还不行再拿整个弹匣去仓库换(拿一个有对象的/放一个满的)，
+	一次换OBJECT_POOL_MAGAZINE_SLOTS个对象，对象在线程之间来回跑的时候也只有这里才碰共享的东西
+ 3. 仓库是无锁的栈，栈顶带一个版本号，每次改都加1，弹匣出栈又入栈的时候CAS不会认错(ABA)。
+	弹匣和对象一样都是从os要的，从来不还，所以别的线程拿着一个已经出栈了的弹匣读_next也没关系
+ 4. 仓库里也没有了就向os要OBJECT_POOL_CHUNK_BYTES，切成一批装满的弹匣，自己拿一个，剩下的放进仓库
+ 5. 线程退出的时候手上的弹匣还回仓库，不会丢
+
+ 状态都是按T的静态成员，同一个T不管在哪用都是同一个池子，所以New/Delete都是静态的，
+ 用的时候直接ConcurrentObjectPool<Node>::New()。一个线程New的对象可以在别的线程Delete。
+ 64位下栈顶的指针按48位算(和_idSpanMap一样)，高16位放版本号 */
+template<class T>
+class ConcurrentObjectPool
+{
 public:
-	std::mutex _poolMtx; // ֹThreadCacheʱ뵽ָ
+	static T* New()
+	{
+		Magazine* mag = t_cache._loaded;
+		void* obj = mag != nullptr && mag->_count > 0 ? mag->_objs[--mag->_count] : NewSlow();
+		return new(obj)T;
+	}
+
+	static void Delete(T* obj)
+	{
+		obj->~T();
+
+		Magazine* mag = t_cache._loaded;
+		if (mag != nullptr && mag->_count < OBJECT_POOL_MAGAZINE_SLOTS)
+			mag->_objs[mag->_count++] = obj;
+		else
+			DeleteSlow(obj);
+	}
+
+	// 这个T的池子一共向os要了多少字节
+	static size_t ReservedBytes()
+	{
+		return _reservedBytes.load(std::memory_order_relaxed);
+	}
+
+private:
+	// 一个弹匣，_objs[0, _count)是空闲的对象
+	struct Magazine
+	{
+		std::atomic<Magazine*> _next{ nullptr }; // 在仓库里的时候指向下一个
+		size_t _count = 0;
+		void* _objs[OBJECT_POOL_MAGAZINE_SLOTS];
+	};
+
+	// 无锁的栈，栈顶是指针和版本号拼在一起的
+	class MagazineStack
+	{
+	public:
+		void Push(Magazine* mag)
+		{
+			uint64_t top = _top.load(std::memory_order_relaxed);
+			do
+			{
+				mag->_next.store(Ptr(top), std::memory_order_relaxed);
+			} while (!_top.compare_exchange_weak(top, Pack(mag, top), std::memory_order_release, std::memory_order_relaxed));
+		}
+
+		Magazine* Pop()
+		{
+			uint64_t top = _top.load(std::memory_order_acquire);
+			while (Ptr(top) != nullptr)
+			{
+				Magazine* next = Ptr(top)->_next.load(std::memory_order_relaxed);
+				if (_top.compare_exchange_weak(top, Pack(next, top), std::memory_order_acquire, std::memory_order_acquire))
+					return Ptr(top);
+			}
+			return nullptr;
+		}
+
+	private:
+#if UINTPTR_MAX > 0xFFFFFFFF
+		static const int PTR_BITS = 48;
+#else
+		static const int PTR_BITS = 32;
+#endif
+		static const uint64_t PTR_MASK = ((uint64_t)1 << PTR_BITS) - 1;
+
+		static Magazine* Ptr(uint64_t top)
+		{
+			return (Magazine*)(uintptr_t)(top & PTR_MASK);
+		}
+
+		// 新的栈顶，版本号在旧的上面加1
+		static uint64_t Pack(Magazine* mag, uint64_t old)
+		{
+			assert(((uint64_t)(uintptr_t)mag & ~PTR_MASK) == 0);
+			return (uint64_t)(uintptr_t)mag | (((old >> PTR_BITS) + 1) << PTR_BITS);
+		}
+
+		std::atomic<uint64_t> _top{ 0 };
+	};
+
+	// 每个线程手上的两个弹匣，线程退出的时候CacheReleaser还回仓库
+	struct Cache
+	{
+		Magazine* _loaded = nullptr; // 正在用的
+		Magazine* _prev = nullptr; // 备用的
+		bool _exited = false; // 已经还过了，线程退出的最后还有New/Delete的话直接走仓库
+	};
+
+	// 还的事情不放在Cache自己的析构函数里：析构函数里最后对成员的写(置空、_exited)，
+	// 编译器会当成没用的删掉(对象已经没了)，后面的New还会从已经还回仓库的弹匣里拿
+	struct CacheReleaser
+	{
+		~CacheReleaser()
+		{
+			Cache& cache = t_cache;
+			Return(cache._loaded);
+			Return(cache._prev);
+			cache._loaded = cache._prev = nullptr;
+			cache._exited = true;
+		}
+
+		// thread_local对象是第一次用到的时候才注册析构函数的，手上放弹匣之前要调用一下
+		void Enable()
+		{}
+	};
+
+	// 对象至少要能放下一个指针，还要满足T的对齐
+	static size_t ObjSize()
+	{
+		size_t size = sizeof(T) < sizeof(void*) ? sizeof(void*) : sizeof(T);
+		return (size + alignof(T) - 1) & ~(alignof(T) - 1);
+	}
+
+	// 弹匣还回仓库，有对象的放_full，空的放_empty
+	static void Return(Magazine* mag)
+	{
+		if (mag == nullptr)
+			return;
+		if (mag->_count > 0)
+			_full.Push(mag);
+		else
+			_empty.Push(mag);
+	}
+
+	// 装着的弹匣空了：备用的有对象就换一下，没有就把备用的(空的)还回去，装着的当备用，从仓库拿一个有对象的
+	static void* NewSlow()
+	{
+		Cache& cache = t_cache;
+		if (cache._exited)
+		{ // 线程已经在退出了，不能再往手上放，从仓库借一个弹匣拿一个对象就还回去
+			Magazine* mag = Fetch();
+			void* obj = mag->_objs[--mag->_count];
+			Return(mag);
+			return obj;
+		}
+
+		t_releaser.Enable();
+		if (cache._prev != nullptr && cache._prev->_count > 0)
+		{
+			std::swap(cache._loaded, cache._prev);
+		}
+		else
+		{
+			Return(cache._prev);
+			cache._prev = cache._loaded;
+			cache._loaded = Fetch();
+		}
+		return cache._loaded->_objs[--cache._loaded->_count];
+	}
+
+	// 装着的弹匣满了：备用的有空位就换一下，没有就把备用的(满的)放进仓库，装着的当备用，拿一个空的
+	// 两个弹匣这样倒着用，New/Delete在弹匣的边上来回的时候不会每次都去碰仓库
+	static void DeleteSlow(void* obj)
+	{
+		Cache& cache = t_cache;
+		if (cache._exited)
+		{ // 线程已经在退出了，这一个对象单独装一个弹匣放进仓库
+			Magazine* one = GetEmpty();
+			one->_objs[one->_count++] = obj;
+			_full.Push(one);
+			return;
+		}
+
+		t_releaser.Enable();
+		if (cache._prev != nullptr && cache._prev->_count < OBJECT_POOL_MAGAZINE_SLOTS)
+		{
+			std::swap(cache._loaded, cache._prev);
+		}
+		else
+		{
+			Return(cache._prev);
+			cache._prev = cache._loaded;
+			cache._loaded = GetEmpty();
+		}
+		cache._loaded->_objs[cache._loaded->_count++] = obj;
+	}
+
+	// 从仓库拿一个有对象的弹匣，仓库没有了就向os要一批
+	static Magazine* Fetch()
+	{
+		Magazine* mag = _full.Pop();
+		if (mag)
+			return mag;
+
+		// 一次要的内存里先放对象，后面放装它们的弹匣
+		size_t perMag = sizeof(Magazine) + OBJECT_POOL_MAGAZINE_SLOTS * ObjSize();
+		size_t bytes = OBJECT_POOL_CHUNK_BYTES < perMag + alignof(Magazine) ? perMag + alignof(Magazine) : OBJECT_POOL_CHUNK_BYTES;
+		size_t kpage = (bytes + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+		bytes = kpage << PAGE_SHIFT;
+		size_t n = (bytes - alignof(Magazine)) / perMag; // 弹匣放在对象后面，要留出对齐的空
+
+		char* memory = (char*)SystemAlloc(kpage);
+		if (memory == nullptr)
+			throw std::bad_alloc();
+		_reservedBytes.fetch_add(bytes, std::memory_order_relaxed);
+
+		char* obj = memory;
+		size_t magOffset = (n * OBJECT_POOL_MAGAZINE_SLOTS * ObjSize() + alignof(Magazine) - 1) & ~(alignof(Magazine) - 1);
+		Magazine* mags = (Magazine*)(memory + magOffset);
+		for (size_t i = 0; i < n; ++i)
+		{
+			mag = new(mags + i)Magazine;
+			for (size_t j = 0; j < OBJECT_POOL_MAGAZINE_SLOTS; ++j, obj += ObjSize())
+				mag->_objs[j] = obj;
+			mag->_count = OBJECT_POOL_MAGAZINE_SLOTS;
+			if (i + 1 < n)
+				_full.Push(mag);
+		}
+		return mag;
+	}
+
+	// 拿一个空弹匣，没有就向os要一页切成一批
+	static Magazine* GetEmpty()
+	{
+		Magazine* mag = _empty.Pop();
+		if (mag)
+			return mag;
+
+		size_t kpage = (sizeof(Magazine) * 16 + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+		size_t n = (kpage << PAGE_SHIFT) / sizeof(Magazine);
+		Magazine* mags = (Magazine*)SystemAlloc(kpage);
+		if (mags == nullptr)
+			throw std::bad_alloc();
+		_reservedBytes.fetch_add(kpage << PAGE_SHIFT, std::memory_order_relaxed);
+
+		for (size_t i = 1; i < n; ++i)
+			_empty.Push(new(mags + i)Magazine);
+		return new(mags)Magazine;
+	}
+
+private:
+	static MagazineStack _full; // 仓库：有对象的弹匣
+	static MagazineStack _empty; // 空弹匣
+	static std::atomic<size_t> _reservedBytes;
+	static thread_local Cache t_cache;
+	static thread_local CacheReleaser t_releaser;
 };
 
+template<class T>
+typename ConcurrentObjectPool<T>::MagazineStack ConcurrentObjectPool<T>::_full;
+template<class T>
+typename ConcurrentObjectPool<T>::MagazineStack ConcurrentObjectPool<T>::_empty;
+template<class T>
+std::atomic<size_t> ConcurrentObjectPool<T>::_reservedBytes{ 0 };
+template<class T>
+thread_local typename ConcurrentObjectPool<T>::Cache ConcurrentObjectPool<T>::t_cache;
+template<class T>
+thread_local typename ConcurrentObjectPool<T>::CacheReleaser ConcurrentObjectPool<T>::t_releaser;
+
 //
-//struct TreeNode // һṹĽڵ㣬Ȼռʱڵ
+//struct TreeNode // 一个树结构的节点，等会申请空间的时候就用这个树节点来申请
 //{
 //	int _val;
 //	TreeNode* _left;
@@ -84,33 +363,33 @@ public:
 //	{}
 //};
 //
-//void TestObjectPool() // malloc͵ǰڴܶԱ
+//void TestObjectPool() // malloc和当前定长内存池性能对比
 //{
-//	// ͷŵִ
+//	// 申请释放的轮次
 //	const size_t Rounds = 5;
 //
-//	// ÿͷŶٴ
+//	// 每轮申请释放多少次
 //	const size_t N = 100000;
 //
-//	// ܹͷŵĴRounds * NΣôЩ˭
+//	// 这里总共申请和释放的次数就是Rounds * N次，测试这么些次谁更快
 //
 //	std::vector<TreeNode*> v1;
 //	v1.reserve(N);
 //
-//	// malloc
+//	// 测试malloc的性能
 //	size_t begin1 = clock();
 //	for (size_t j = 0; j < Rounds; ++j)
 //	{
 //		for (int i = 0; i < N; ++i)
 //		{
-//			v1.push_back(new TreeNode); // ȻõnewnewײõҲmalloc
+//			v1.push_back(new TreeNode); // 这里虽然用的是new，但是new底层用的也是malloc
 //		}
 //		for (int i = 0; i < N; ++i)
 //		{
-//			delete v1[i]; // ͬģdeleteײҲfree
+//			delete v1[i]; // 同样的，delete底层也是free
 //		}
-//		v1.clear(); // clearþǽvectorеգsize㣬
-//		// capacityֲ䣬ѭȥpush_back
+//		v1.clear(); // 这里clear作用就是将vector中的内容清空，size置零，
+//		// 但capacity保持不变，这样才能循环上去重新push_back
 //	}
 //	size_t end1 = clock();
 //
@@ -118,26 +397,26 @@ public:
 //	std::vector<TreeNode*> v2;
 //	v2.reserve(N);
 //
-//	// ڴأͷŵT;ڵ
+//	// 定长内存池，其中申请和释放的T类型就是树节点
 //	ObjectPool<TreeNode> TNPool;
 //	size_t begin2 = clock();
 //	for (size_t j = 0; j < Rounds; ++j)
 //	{
 //		for (int i = 0; i < N; ++i)
 //		{
-//			v2.push_back(TNPool.New()); // ڴеռ
+//			v2.push_back(TNPool.New()); // 定长内存池中的申请空间
 //		}
 //		for (int i = 0; i < N; ++i)
 //		{
-//			TNPool.Delete(v2[i]); // ڴеĻտռ
+//			TNPool.Delete(v2[i]); // 定长内存池中的回收空间
 //		}
-//		v2.clear();// clearþǽvectorеգsize㣬
-//		// capacityֲ䣬ѭȥpush_back
+//		v2.clear();// 这里clear作用就是将vector中的内容清空，size置零，
+//		// 但capacity保持不变，这样才能循环上去重新push_back
 //	}
 //	size_t end2 = clock();
 //
 //
-//	cout << "new cost time:" << end1 - begin1 << endl; // Ϊʱ䵥λms
+//	cout << "new cost time:" << end1 - begin1 << endl; // 这里可以认为时间单位就是ms
 //	cout << "object pool cost time:" << end2 - begin2 << endl;
 //}
 //
@@ -1,43 +1,207 @@
 #pragma once
 
 #include"Common.h"
+#include"AllocStats.h"
+
+/* pc原来只有一把大锁_pageMtx，cc每次补span、还span，大于256KB的申请和释放，全都在抢这一把锁，
+ 线程一多这里就成了最热的一把锁。现在拆成了PAGE_HEAP_NUM个页堆(PageHeap)：
+
+ 1. 按申请的页数分成PAGE_HEAP_RANGES段([1,4]、[5,16]、[17,64]、[65,128])，每段再按线程分成PAGE_HEAP_STRIPES个页堆，
+	每个页堆有自己的锁、自己的桶和自己的span对象池，申请不同页数的、或者不同线程申请同样页数的，基本不会去抢同一把锁
+ 2. 页堆向os要内存是按128页一整块(chunk)要的，并且按整块的大小对齐，span合并只在同一块里面合并，
+	这样一块里的所有span都归同一个页堆管，合并的时候看相邻的span不会碰到别的页堆
+ 3. 页堆里某一块全部合并回来了(又是完整的128页)，自己留一块备用，多的交给公共的整块池子，
+	别的页堆缺内存的时候先去池子里拿，内存不会一直卡在某一个页堆里
+ 4. 大于128页的直接找os要，只有拿span对象的时候加一下专门的小锁
+ 5. 多路服务器上每个NUMA节点一组页堆，线程从自己所在节点的页堆拿span，页堆向os要的整块会用mbind
+	绑到这个节点上，释放的时候按span记的页堆号还回原来那个节点，不管是在哪个节点上释放的。
+	不是NUMA的机器上只有0号节点，和原来一样
+
+ 锁都放到NewSpan、ReleaseSpanToPageCache里面自己加了，调用的地方不用再加锁 */
+
+// pc中的一个页堆，逻辑都写在PageCache里
+struct PageHeap
+{
+	SpanList _spanLists[PAGE_NUM]; // 页堆中的哈希
+	ObjectPool<Span> _spanPool; // 这个页堆创建span的对象池
+	size_t _releasedPages = 0; // 这个页堆中已经还给os的页数
+
+	// 统计用
+	size_t _mappedPages = 0; // 这个页堆向os要了多少页
+	size_t _refills = 0; // 向os要整块的次数
+	size_t _chunkReuses = 0; // 从整块池子里拿的次数
+
+	std::mutex _mtx; // 页堆的锁，上面的都由它保护
+};
+
+// 一个NUMA节点上的所有页堆，加上这个节点的整块池子
+struct NumaNode
+{
+	PageHeap _heaps[PAGE_HEAP_NUM]; // 下标是段号 * PAGE_HEAP_STRIPES + 段内编号
+
+	// 这个节点上页堆用不上的整块(128页)放在这里，谁缺内存谁拿
+	SpanList _chunks;
+	size_t _chunkReleasedPages = 0; // _chunks中已经还给os的页数
+	std::mutex _chunkMtx; // 上面两个的锁
+};
 
 class PageCache
 {
 public:
-	// 
+	// 饿汉单例
 	static PageCache* GetInstance()
 	{
 		return &_sInst;
 	}
 
-	// pc_spanListsóһkҳspan
-	Span* NewSpan(size_t k);
+	// pc拿出来一个k页的span，自己会加锁
+	Span* NewSpan(size_t k)
+	{
+		return NewSpan(k, CurrentNode());
+	}
+
+	// 从node号节点的页堆拿k页的span(cc按节点分桶，补进桶里的span要是桶所在节点的)，自己会加锁
+	Span* NewSpan(size_t k, size_t node);
 
-	// ͨҳַҵspan
+	// 拿一个k页、首页按alignPages页对齐的span(alignPages是2的幂)，自己会加锁。
+	// 多拿alignPages - 1页，对齐的那一段留下，前后多出来的马上还回页堆，不会一直占着
+	Span* NewAlignedSpan(size_t k, size_t alignPages);
+
+	// 通过页地址找到span
 	Span* MapObjectToSpan(void* obj);
 
-	// ccspan
+	// 管理cc还回来的span，自己会加锁
 	void ReleaseSpanToPageCache(Span* span);
 
+	// 在用的span扩成k页，成功了返回true：页堆里的span把右边紧挨着的空闲span吃掉一部分，首页不动；
+	// 直接向os要的span用mremap扩，首页可能会变。自己会加锁
+	bool GrowSpan(Span* span, size_t k);
+
+	// 一次还好几个页堆里的span(不能是直接向os要的)，同一个页堆的放在一起还，每个页堆只加一次锁
+	void ReleaseSpansToPageCache(Span** spans, size_t n);
+
+	// 提前把obj所在页的映射拉进cache，马上要MapObjectToSpan一大批的时候先挨个预取一遍
+	void PrefetchObjectSpan(void* obj)
+	{
+		_idSpanMap.prefetch(((PageID)obj) >> PAGE_SHIFT);
+	}
+
+	// 把pc中闲了至少minIdleMs毫秒的span的物理内存还给os，大的span先还，
+	// 还够bytes字节就停(按整个span还，可能会多还一点)，返回实际还了多少字节。自己会加锁
+	size_t ReleaseIdleSpans(size_t bytes, uint64_t minIdleMs);
+
+	// 后台线程每秒最多还bytesPerSec字节，只还闲了至少minIdleMs毫秒的span，bytesPerSec为0就停下来
+	void SetBackgroundRelease(size_t bytesPerSec, uint64_t minIdleMs);
+
+	// 现在有多少字节已经还给os了(还在pc里，但没有占物理内存)
+	size_t ReleasedBytes();
+
+	// 单调时钟，ms
+	static uint64_t NowMs();
+
+	// pc这一层的统计：每个页数的桶有几个空闲span，向os要了多少、还了多少，span对象占了多少，页堆向os要了几次
+	void GetStats(AllocStats& stats);
+
+	// 现在有几个NUMA节点(假装的也算)
+	size_t NumaNodes();
+
+	// ptr是哪个NUMA节点的页堆给的
+	size_t NumaNodeOf(void* ptr)
+	{
+		return MapObjectToSpan(ptr)->_heap / PAGE_HEAP_NUM;
+	}
+
+	// 假装有n个NUMA节点，cpu按编号轮流分到各个节点上，内存不会真的绑到节点上，在没有NUMA的机器上测试用。
+	// n不大于1就恢复成机器真实的节点数。也可以用环境变量CMP_NUMA_FAKE_NODES=n打开
+	void FakeNumaNodes(size_t n);
+
+	// 当前线程固定从node号节点拿内存，不再看自己在哪个cpu上(线程已经绑好核了，或者测试的时候用)，给-1恢复
+	static void SetThreadNumaNode(int node);
+
+	// 当前线程在哪个NUMA节点上
+	size_t CurrentNode();
+
 private:
-	SpanList _spanLists[PAGE_NUM]; // pcеĹϣ
+	// node号节点上k页的申请该去哪个页堆：先按页数找到段，再按当前线程找段里的哪一个
+	size_t HeapIndex(size_t k, size_t node);
+
+	// 直接向os要k页(大于128页的，或者页堆里放不下的对齐span)绑到node号节点上，首页按alignPages页对齐，不进页堆，标上_large
+	Span* NewLargeSpan(size_t k, size_t alignPages, size_t node);
+
+	// 从id号页堆中拿一个k页的span，调用前要拿着这个页堆的锁
+	Span* HeapNewSpan(size_t id, size_t k);
+
+	// 把span还到id号页堆，和同一块里相邻的span合并，调用前要拿着这个页堆的锁
+	void HeapReleaseSpan(size_t id, Span* span);
+
+	// id号页堆
+	PageHeap& Heap(size_t id)
+	{
+		return GetNode(id / PAGE_HEAP_NUM)->_heaps[id % PAGE_HEAP_NUM];
+	}
+
+	// node号节点的页堆，第一次用到的时候在那个节点自己的内存上开
+	NumaNode* GetNode(size_t node);
 
-	// ϣӳ䣬ͨҳҵӦspan
+	// 第一次用的时候读一下机器的NUMA拓扑
+	void InitNuma();
+
+	// 把刚向os要的kpage页绑到node号节点上，之后缺页的时候从这个节点分物理内存
+	void BindToNode(void* ptr, size_t kpage, size_t node);
+
+	// 把list中闲了至少minIdleMs毫秒的span还给os，还够bytes字节就停，releasedPages跟着加，调用前要拿着list所在的锁
+	static size_t ReleaseIdleList(SpanList& list, size_t bytes, uint64_t minIdleMs, uint64_t now, size_t& releasedPages);
+
+	// span的前n页要重新拿来用了，之前还给os了的话要重新提交一下，记的数也要减掉
+	void CommitPages(PageHeap& heap, Span* span, size_t n)
+	{
+		if (span->_isReleased)
+		{
+			SystemCommit((void*)(span->_pageID << PAGE_SHIFT), n);
+			heap._releasedPages -= n;
+		}
+	}
+
+	// 后台回收线程
+	void BackgroundReleaseLoop();
+
+private:
+	NumaNode _node0; // 0号节点的页堆直接放在pc里，不是NUMA的机器就只有这一组
+	std::atomic<NumaNode*> _nodes[NUMA_MAX_NODES] = { &_node0 }; // 别的节点用到的时候才开
+	std::mutex _nodeMtx; // 开节点、读拓扑的时候用
+
+	std::atomic<bool> _numaInited{ false }; // 拓扑读过了没有
+	std::atomic<size_t> _numNodes{ 1 }; // 现在按几个节点来分
+	std::atomic<bool> _numaFake{ false }; // 是不是假装的节点
+	size_t _sysNodes = 1; // 机器真实的节点数
+	uint8_t _cpuToNode[NUMA_MAX_CPUS] = {}; // cpu编号对应的节点
+
+	// 大于128页的span对象从这里拿
+	ObjectPool<Span> _largeSpanPool;
+	size_t _largeSpans = 0; // 现在在用的大span个数
+	size_t _largePages = 0; // 它们一共多少页
+	size_t _largeAllocs = 0; // 一共向os要过几次
+	std::mutex _largeMtx; // 上面几个的锁
+
+	// 哈希映射，用来快速通过页号找到对应span
 	//std::unordered_map<PageID, Span*> _idSpanMap;
-	TCMalloc_PageMap1<32 - PAGE_SHIFT> _idSpanMap;
+	//TCMalloc_PageMap1<32 - PAGE_SHIFT> _idSpanMap;
+#if UINTPTR_MAX > 0xFFFFFFFF
+	TCMalloc_PageMap3<48 - PAGE_SHIFT> _idSpanMap; // 64位下用三层基数树，用户态地址是48位的
+#else
+	TCMalloc_PageMap2<32 - PAGE_SHIFT> _idSpanMap; // 32位下用两层基数树
+#endif
 
-	ObjectPool<Span> _spanPool; // spanĶ
-public:
-	// רŸһӿڣҾֱӹ
-	std::mutex _pageMtx; // pc
+	std::atomic<size_t> _releaseRate{ 0 }; // 后台线程每秒最多还多少字节
+	std::atomic<uint64_t> _releaseAge{ 0 }; // 后台线程只还闲了多少ms以上的span
+	std::atomic<bool> _releaseThreadStarted{ false };
 
-private: // ˽Уȥ
-	PageCache()
+private: // 单例，构造私有，拷构、拷赋去掉
+	constexpr PageCache()
 	{}
 
 	PageCache(const PageCache& pc) = delete;
 	PageCache& operator = (const PageCache& pc) = delete;
 
-	static PageCache _sInst; // 
-};
\ No newline at end of file
+	static PageCache _sInst; // 单例类对象
+};
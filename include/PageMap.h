@@ -2,7 +2,7 @@
 #include"Common.h"
 
 // Single-level array
-template <int BITS> // ʾҳҪλ
+template <int BITS> // 表示所有页号所需要的位数
 class TCMalloc_PageMap1 {
 private:
 	static const int LENGTH = 1 << BITS;
@@ -13,17 +13,17 @@ public:
 
 	explicit TCMalloc_PageMap1() {
 		
-		// array_дŵĶspan*ҲǴŵĶָ룬ÿҳŶӦһspan*Ҳ(ҳ * ָС)
-		// 32λģ419ȼ46λ13λҲ25613λҲ256ҳ
+		// array_中存放的都是span*，也就是存放的都是指针，每个页号对应一个span*，也就是(总页数 * 指针大小)
+		// 假设这里是32位的，4左移19，等价于4左移6位再左移13位，也就是256左移13位，也就是256页
 		size_t size = sizeof(void*) << BITS;
 		
-		// ôڶsizeʱsizeǴ256KBģͻᰴһҳж룬sizeѾ256ҳˣ
-		// Ƕˣsizeǵalignsize
+		// 那么这里在对其size的时候，size是大于256KB的，就会按照一页进行对齐，不过size已经是256页了，已
+		// 经是对齐的数了，所以size是等于alignsize的
 		size_t alignSize = SizeClass::_RoundUp(size, 1 << PAGE_SHIFT);
 		
 		//cout << size << ' ' << alignSize << endl;
 
-		// Ҫֱӿ256ҳҲ256 * 8KB2048KBҲ2MB
+		// 这里数组要直接开256页，也就是256 * 8KB，即2048KB，也就是2MB
 		array_ = (void**)SystemAlloc(alignSize >> PAGE_SHIFT);
 		memset(array_, 0, sizeof(void*) << BITS);
 	}
@@ -32,7 +32,7 @@ public:
 	// or if k is out of range.
 	void* get(Number k) const {
 		if ((k >> BITS) > 0)
-		{	// ͨҳҶӦspanҳλ19Ǿǲܵ
+		{	// 通过页号找对应的span，如果页号位数超过19，那就是不可能的情况
 			return NULL;
 		}
 		return array_[k];
@@ -43,175 +43,214 @@ public:
 	//
 	// Sets the value 'v' for key 'k'.
 	void set(Number k, void* v) {
-		array_[k] = v;	// ҳΪӦspan
+		array_[k] = v;	// 将页号设置为对应span
+	}
+
+	// 数组一开始就全开好了，不需要再开
+	bool Ensure(Number start, size_t n) {
+		return ((start + n - 1) >> BITS) == 0;
+	}
+
+	// 提前把k对应的那一项拉进cache
+	void prefetch(Number k) const {
+		if ((k >> BITS) == 0)
+			Prefetch(&array_[k]);
+	}
+};
+
+/* 下面两个基数树都是只在用到某段地址的时候才去开对应的叶子，并且读(get)是完全不加锁的：
+ 写set是在span所属页堆的锁里面做的(大于128页的span是申请、释放它的线程自己写)，同一页不会有两个线程同时写，
+ Ensure会被好几个页堆同时调，
+ 自己拿一把锁来开节点，新开的节点先清零再用release发布到上一层，
+ 读的时候一路acquire下去，所以读线程要么看到nullptr，要么看到一个已经初始化好的节点，
+ 不会被写线程阻塞，也不需要重试(wait-free) */
+
+// Two-level radix tree
+// 32位下用，根是前5位，叶子是剩下的14位
+template <int BITS>
+class TCMalloc_PageMap2 {
+private:
+	// Put 32 entries in the root and (2^BITS)/32 entries in each leaf.
+	static const int ROOT_BITS = 5; // 32位下前5位搞一个第一层的数组
+	static const int ROOT_LENGTH = 1 << ROOT_BITS;
+
+	static const int LEAF_BITS = BITS - ROOT_BITS; // 32位下后14位搞成第二层的数组
+	static const int LEAF_LENGTH = 1 << LEAF_BITS;
+
+	// Leaf node
+	struct Leaf { // 叶子就是后14位的数组
+		std::atomic<void*> values[LEAF_LENGTH];
+	};
+
+	std::atomic<Leaf*> root_[ROOT_LENGTH] = {}; // 根就是前5位的数组，pc是静态对象，这里初始就是全0
+	ObjectPool<Leaf> leafPool_; // 叶子从定长内存池里拿，不走malloc
+	std::mutex mtx_; // 开节点的时候用，内存池和根都要保护
+public:
+	typedef uintptr_t Number;
+
+	void* get(Number k) const {
+		const Number i1 = k >> LEAF_BITS;
+		const Number i2 = k & (LEAF_LENGTH - 1);
+		if ((k >> BITS) > 0) {
+			return NULL;
+		}
+		Leaf* leaf = root_[i1].load(std::memory_order_acquire);
+		if (leaf == NULL) { // 这段地址还没用过
+			return NULL;
+		}
+		return leaf->values[i2].load(std::memory_order_acquire);
+	}
+
+	// REQUIRES "k" has been ensured before.
+	void set(Number k, void* v) {
+		const Number i1 = k >> LEAF_BITS;
+		const Number i2 = k & (LEAF_LENGTH - 1);
+		assert(i1 < ROOT_LENGTH);
+		root_[i1].load(std::memory_order_relaxed)->values[i2].store(v, std::memory_order_release);
+	}
+
+	// 提前把k对应的那一项拉进cache，根是热的，真正会缺的是叶子里的那一项
+	void prefetch(Number k) const {
+		const Number i1 = k >> LEAF_BITS;
+		const Number i2 = k & (LEAF_LENGTH - 1);
+		if ((k >> BITS) > 0)
+			return;
+		Leaf* leaf = root_[i1].load(std::memory_order_acquire);
+		if (leaf != NULL)
+			Prefetch(&leaf->values[i2]);
+	}
+
+	// 确保从start开始往后的n页对应的叶子都开好了
+	bool Ensure(Number start, size_t n) {
+		std::lock_guard<std::mutex> lock(mtx_);
+		for (Number key = start; key <= start + n - 1;) {
+			const Number i1 = key >> LEAF_BITS;
+
+			// Check for overflow
+			if (i1 >= ROOT_LENGTH)
+				return false;
+
+			// 如果没开好就开空间
+			if (root_[i1].load(std::memory_order_relaxed) == NULL) {
+				Leaf* leaf = leafPool_.New();
+				for (int i = 0; i < LEAF_LENGTH; ++i)
+					leaf->values[i].store(NULL, std::memory_order_relaxed);
+				root_[i1].store(leaf, std::memory_order_release); // 清零之后再发布
+			}
+
+			// Advance key past whatever is covered by this leaf node
+			key = ((key >> LEAF_BITS) + 1) << LEAF_BITS;
+		}
+		return true;
 	}
 };
 
+// Three-level radix tree
+// 64位下用，x86-64/aarch64的用户态地址是48位的，去掉页内偏移还剩35位页号，
+// 按12/12/11拆成三层，根(32KB)直接放在对象里，中间节点和叶子都是用到了才开
+template <int BITS>
+class TCMalloc_PageMap3 {
+private:
+	// How many bits should we consume at each interior level
+	static const int INTERIOR_BITS = (BITS + 2) / 3; // Round-up
+	static const int INTERIOR_LENGTH = 1 << INTERIOR_BITS;
+
+	// How many bits should we consume at leaf level
+	static const int LEAF_BITS = BITS - 2 * INTERIOR_BITS;
+	static const int LEAF_LENGTH = 1 << LEAF_BITS;
+
+	// Leaf node
+	struct Leaf {
+		std::atomic<void*> values[LEAF_LENGTH];
+	};
+
+	// Interior node
+	struct Node {
+		std::atomic<Leaf*> ptrs[INTERIOR_LENGTH];
+	};
+
+	std::atomic<Node*> root_[INTERIOR_LENGTH] = {}; // Root of radix tree
+	ObjectPool<Node> nodePool_; // 中间节点和叶子都从定长内存池里拿，不走malloc
+	ObjectPool<Leaf> leafPool_;
+	std::mutex mtx_; // 开节点的时候用，内存池和各层节点都要保护
+
+public:
+	typedef uintptr_t Number;
+
+	void* get(Number k) const {
+		const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+		const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+		const Number i3 = k & (LEAF_LENGTH - 1);
+		if ((k >> BITS) > 0) {
+			return NULL;
+		}
+		Node* node = root_[i1].load(std::memory_order_acquire);
+		if (node == NULL) {
+			return NULL;
+		}
+		Leaf* leaf = node->ptrs[i2].load(std::memory_order_acquire);
+		if (leaf == NULL) {
+			return NULL;
+		}
+		return leaf->values[i3].load(std::memory_order_acquire);
+	}
+
+	// REQUIRES "k" has been ensured before.
+	void set(Number k, void* v) {
+		assert(k >> BITS == 0);
+		const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+		const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+		const Number i3 = k & (LEAF_LENGTH - 1);
+		Node* node = root_[i1].load(std::memory_order_relaxed);
+		node->ptrs[i2].load(std::memory_order_relaxed)->values[i3].store(v, std::memory_order_release);
+	}
+
+	// 提前把k对应的那一项拉进cache，前两层节点少、一直是热的，真正会缺的是叶子里的那一项
+	void prefetch(Number k) const {
+		const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+		const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+		const Number i3 = k & (LEAF_LENGTH - 1);
+		if ((k >> BITS) > 0)
+			return;
+		Node* node = root_[i1].load(std::memory_order_acquire);
+		if (node == NULL)
+			return;
+		Leaf* leaf = node->ptrs[i2].load(std::memory_order_acquire);
+		if (leaf != NULL)
+			Prefetch(&leaf->values[i3]);
+	}
+
+	// 确保从start开始往后的n页对应的中间节点和叶子都开好了
+	bool Ensure(Number start, size_t n) {
+		std::lock_guard<std::mutex> lock(mtx_);
+		for (Number key = start; key <= start + n - 1;) {
+			const Number i1 = key >> (LEAF_BITS + INTERIOR_BITS);
+			const Number i2 = (key >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+
+			// Check for overflow
+			if (i1 >= INTERIOR_LENGTH || i2 >= INTERIOR_LENGTH)
+				return false;
+
+			// Make 2nd level node if necessary
+			Node* node = root_[i1].load(std::memory_order_relaxed);
+			if (node == NULL) {
+				node = nodePool_.New();
+				for (int i = 0; i < INTERIOR_LENGTH; ++i)
+					node->ptrs[i].store(NULL, std::memory_order_relaxed);
+				root_[i1].store(node, std::memory_order_release); // 清零之后再发布
+			}
 
-//
-//// Two-level radix tree
-//template <int BITS>
-//class TCMalloc_PageMap2 {
-//private:
-//	// Put 32 entries in the root and (2^BITS)/32 entries in each leaf.
-//	static const int ROOT_BITS = 5; // 32λǰ5λһһ
-//	static const int ROOT_LENGTH = 1 << ROOT_BITS;
-//
-//	static const int LEAF_BITS = BITS - ROOT_BITS; // 32λº14λɵڶ
-//	static const int LEAF_LENGTH = 1 << LEAF_BITS;
-//
-//	// Leaf node
-//	struct Leaf { // ҶӾǺ14λ
-//		void* values[LEAF_LENGTH];
-//	};
-//
-//	Leaf* root_[ROOT_LENGTH];             // ǰ5λ
-//public:
-//	typedef uintptr_t Number;
-//
-//	//explicit TCMalloc_PageMap2(void* (*allocator)(size_t)) {
-//	explicit TCMalloc_PageMap2() { // ֱӰеĿռ䶼
-//		memset(root_, 0, sizeof(root_));
-//		PreallocateMoreMemory(); // ֱӿ2Mspan*ȫ
-//	}
-//
-//	void* get(Number k) const {
-//		const Number i1 = k >> LEAF_BITS;
-//		const Number i2 = k & (LEAF_LENGTH - 1);
-//		if ((k >> BITS) > 0 || root_[i1] == NULL) {
-//			return NULL;
-//		}
-//		return root_[i1]->values[i2];
-//	}
-//
-//	void set(Number k, void* v) {
-//		const Number i1 = k >> LEAF_BITS;
-//		const Number i2 = k & (LEAF_LENGTH - 1);
-//		ASSERT(i1 < ROOT_LENGTH);
-//		root_[i1]->values[i2] = v;
-//	}
-//
-//	// ȷstartʼnҳռ俪
-//	bool Ensure(Number start, size_t n) {
-//		for (Number key = start; key <= start + n - 1;) {
-//			const Number i1 = key >> LEAF_BITS;
-//
-//			// Check for overflow
-//			if (i1 >= ROOT_LENGTH)
-//				return false;
-//
-//			// ûþͿռ
-//			if (root_[i1] == NULL) {
-//				static ObjectPool<Leaf>	leafPool;
-//				Leaf* leaf = (Leaf*)leafPool.New();
-//
-//				memset(leaf, 0, sizeof(*leaf));
-//				root_[i1] = leaf;
-//			}
-//
-//			// Advance key past whatever is covered by this leaf node
-//			key = ((key >> LEAF_BITS) + 1) << LEAF_BITS;
-//		}
-//		return true;
-//	}
-//
-//	// ǰÿռ䣬Ͱ2Mֱӿ
-//	void PreallocateMoreMemory() {
-//		// Allocate enough to keep track of all possible pages
-//		Ensure(0, 1 << BITS);
-//	}
-//};
-//
-//// Three-level radix tree
-//template <int BITS>
-//class TCMalloc_PageMap3 {
-//private:
-//	// How many bits should we consume at each interior level
-//	static const int INTERIOR_BITS = (BITS + 2) / 3; // Round-up
-//	static const int INTERIOR_LENGTH = 1 << INTERIOR_BITS;
-//
-//	// How many bits should we consume at leaf level
-//	static const int LEAF_BITS = BITS - 2 * INTERIOR_BITS;
-//	static const int LEAF_LENGTH = 1 << LEAF_BITS;
-//
-//	// Interior node
-//	struct Node {
-//		Node* ptrs[INTERIOR_LENGTH];
-//	};
-//
-//	// Leaf node
-//	struct Leaf {
-//		void* values[LEAF_LENGTH];
-//	};
-//
-//	Node* root_;                          // Root of radix tree
-//	void* (*allocator_)(size_t);          // Memory allocator
-//
-//	Node* NewNode() {
-//		Node* result = reinterpret_cast<Node*>((*allocator_)(sizeof(Node)));
-//		if (result != NULL) {
-//			memset(result, 0, sizeof(*result));
-//		}
-//		return result;
-//	}
-//
-//public:
-//	typedef uintptr_t Number;
-//
-//	explicit TCMalloc_PageMap3(void* (*allocator)(size_t)) {
-//		allocator_ = allocator;
-//		root_ = NewNode();
-//	}
-//
-//	void* get(Number k) const {
-//		const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
-//		const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
-//		const Number i3 = k & (LEAF_LENGTH - 1);
-//		if ((k >> BITS) > 0 ||
-//			root_->ptrs[i1] == NULL || root_->ptrs[i1]->ptrs[i2] == NULL) {
-//			return NULL;
-//		}
-//		return reinterpret_cast<Leaf*>(root_->ptrs[i1]->ptrs[i2])->values[i3];
-//	}
-//
-//	void set(Number k, void* v) {
-//		ASSERT(k >> BITS == 0);
-//		const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
-//		const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
-//		const Number i3 = k & (LEAF_LENGTH - 1);
-//		reinterpret_cast<Leaf*>(root_->ptrs[i1]->ptrs[i2])->values[i3] = v;
-//	}
-//
-//	bool Ensure(Number start, size_t n) {
-//		for (Number key = start; key <= start + n - 1;) {
-//			const Number i1 = key >> (LEAF_BITS + INTERIOR_BITS);
-//			const Number i2 = (key >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
-//
-//			// Check for overflow
-//			if (i1 >= INTERIOR_LENGTH || i2 >= INTERIOR_LENGTH)
-//				return false;
-//
-//			// Make 2nd level node if necessary
-//			if (root_->ptrs[i1] == NULL) {
-//				Node* n = NewNode();
-//				if (n == NULL) return false;
-//				root_->ptrs[i1] = n;
-//			}
-//
-//			// Make leaf node if necessary
-//			if (root_->ptrs[i1]->ptrs[i2] == NULL) {
-//				Leaf* leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
-//				if (leaf == NULL) return false;
-//				memset(leaf, 0, sizeof(*leaf));
-//				root_->ptrs[i1]->ptrs[i2] = reinterpret_cast<Node*>(leaf);
-//			}
-//
-//			// Advance key past whatever is covered by this leaf node
-//			key = ((key >> LEAF_BITS) + 1) << LEAF_BITS;
-//		}
-//		return true;
-//	}
-//
-//	void PreallocateMoreMemory() {
-//	}
-//};
\ No newline at end of file
+			// Make leaf node if necessary
+			if (node->ptrs[i2].load(std::memory_order_relaxed) == NULL) {
+				Leaf* leaf = leafPool_.New();
+				for (int i = 0; i < LEAF_LENGTH; ++i)
+					leaf->values[i].store(NULL, std::memory_order_relaxed);
+				node->ptrs[i2].store(leaf, std::memory_order_release);
+			}
+
+			// Advance key past whatever is covered by this leaf node
+			key = ((key >> LEAF_BITS) + 1) << LEAF_BITS;
+		}
+		return true;
+	}
+};
@@ -1,27 +1,222 @@
 #pragma once
 
 #include"Common.h"
+#include"AllocStats.h"
+
+/* tc的远程释放队列。原来ConcurrentFree总是把块放进调用线程自己的tc，生产者-消费者那种用法里，
+ 消费者的tc会攒满它自己根本不会再申请的块，生产者那边又得不停地找cc要新的。现在span记着最近从它切块的tc
+ (Span::_owner)，别的线程释放这种块的时候不进自己的tc，按桶挂到那个tc的这个队列上：
+ 只有释放的线程自己不怎么申请这个桶的块的时候才这样(没有tc，或者见MostlyReleases)，各个线程自己申请自己释放的时候，
+ 从中转站拿到的整批块的span记的可能是别的线程，这种块还是放进自己的tc，不然白白多了很多次CAS
+ 1. 挂上去是无锁的，CAS一下头插；拿下来的只有tc自己，每次整串换走，不会有ABA的问题
+ 2. tc在某个桶空了要找cc要块的时候，先看看这个桶的队列里有没有，有就整串拿回来用，内存留在原来的线程
+ 3. tc Scavenge的时候把所有队列里的都还给cc，免得一直不申请的桶卡在队列里
+ 4. tc退出的时候把队列关掉(头换成Closed)并且清空，这之后再来的就退回原来的路径。
+	队列对象从不释放，只在tc之间复用，所以span里记着的旧指针一直是能用的 */
+struct RemoteFreeList
+{
+	std::atomic<void*> _heads[FREE_LIST_NUM]; // 每个桶一串
+	std::atomic<size_t> _counts[FREE_LIST_NUM]; // 每串有几块，统计用
+	RemoteFreeList* _nextFree = nullptr; // 没有tc在用的时候串在ThreadCache::_sFreeRemotes上
+
+	RemoteFreeList()
+	{
+		for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+		{
+			_heads[i].store(nullptr, std::memory_order_relaxed);
+			_counts[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	// tc退出以后头换成这个，别的线程看到了就不往里挂了
+	static void* Closed()
+	{
+		return (void*)1;
+	}
+
+	// 别的线程把index号桶的obj挂上来，队列已经关了返回false
+	bool Push(void* obj, size_t index)
+	{
+		_counts[index].fetch_add(1, std::memory_order_relaxed);
+		void* head = _heads[index].load(std::memory_order_relaxed);
+		do
+		{
+			if (head == Closed())
+			{
+				_counts[index].fetch_sub(1, std::memory_order_relaxed);
+				return false;
+			}
+			ObjNext(obj) = head;
+		} while (!_heads[index].compare_exchange_weak(head, obj, std::memory_order_release, std::memory_order_relaxed));
+		return true;
+	}
+
+	// tc把index号桶的整串拿走，没有就返回空，end是串尾，n是拿了几块
+	void* TakeAll(size_t index, void*& end, size_t& n)
+	{
+		n = 0;
+		if (_heads[index].load(std::memory_order_relaxed) == nullptr)
+			return nullptr;
+		void* list = _heads[index].exchange(nullptr, std::memory_order_acquire);
+		for (end = list, n = 1; ObjNext(end); end = ObjNext(end))
+			++n;
+		_counts[index].fetch_sub(n, std::memory_order_relaxed);
+		return list;
+	}
+
+	// tc退出的时候关掉index号桶，返回里面剩下的
+	void* Close(size_t index)
+	{
+		void* list = _heads[index].exchange(Closed(), std::memory_order_acquire);
+		size_t n = 0;
+		for (void* obj = list; obj; obj = ObjNext(obj))
+			++n;
+		_counts[index].fetch_sub(n, std::memory_order_relaxed);
+		return list;
+	}
+
+	// 给新的tc用之前重新打开
+	void Open()
+	{
+		for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+			_heads[i].store(nullptr, std::memory_order_relaxed);
+	}
+};
 
 class ThreadCache
 {
 public:
-	// ߳sizeСĿռ
+	// 线程申请size大小的空间
 	void* Allocate(size_t size);
 
-	// ߳дСΪsizeobjռ
+	// 回收线程中大小为size的obj空间
 	void Deallocate(void* obj, size_t size);
 
-	// ThreadCacheпռ䲻ʱCentralCacheռĽӿ
+	// ThreadCache中空间不够时，向CentralCache申请空间的接口
 	void* FetchFromCentralCache(size_t index, size_t alignSize);
 
-	// tccc黹ռListͰеĿռ
+	// tc向cc归还空间List桶中的空间
 	void ListTooLong(FreeList& list, size_t size);
+
+	// 线程退出时把所有自由链表中剩下的空间都还给cc
+	void ReleaseAll();
+
+	// 所有线程的tc都从同一个定长内存池里拿，线程退出时再还回去给别的线程复用
+	static ThreadCache* Create();
+	static void Destroy(ThreadCache* tc);
+
+	// 所有tc加起来最多缓存多少字节，默认THREAD_CACHE_BUDGET_BYTES
+	static void SetBudget(size_t bytes);
+
+	// 所有tc的上限加起来现在一共是多少
+	static size_t ClaimedBytes();
+
+	// 所有tc的统计：每个桶缓存了多少块、向cc要了几次、还了几次，已经退出的线程的计数也算上
+	static void GetStats(AllocStats& stats);
+
+	// 这个tc的远程释放队列
+	RemoteFreeList* Remote()
+	{
+		return _remote;
+	}
+
+	// 这个桶还给cc的次数比找cc要的多出一倍以上，说明这个线程释放的主要是别的线程申请的块，放在自己这里也用不上。
+	// 大家都是自己申请自己释放的时候两个数差不多，块从中转站换了线程也还是放在自己这里，不去挂别人的队列
+	bool MostlyReleases(size_t index)
+	{
+		FreeList& list = _freeLists[index];
+		return list.Releases() > 2 * list.Fetches();
+	}
+
+	// 当前tc里缓存了多少字节、最多能缓存多少字节
+	size_t CachedBytes()
+	{
+		return _size;
+	}
+
+	size_t MaxBytes()
+	{
+		return _maxBytes.load(std::memory_order_relaxed);
+	}
+
+private:
+	// 缓存的字节数超过上限了，每个桶还一半给cc，然后看看能不能把上限调大一点
+	void Scavenge();
+
+	// 上限加THREAD_CACHE_STEAL_BYTES：总预算还有剩的就从预算里拿，没有就从最久没活动的tc那里偷
+	void IncreaseCacheLimit();
+
+	// 找最久没活动的、上限还有得偷的tc，要拿着_sListMtx调
+	static ThreadCache* FindVictim(ThreadCache* except);
+
+	// 别的线程还到index号桶远程释放队列里的块都拿回来放进自由链表，返回拿回来几块
+	size_t ReclaimRemote(size_t index);
+
+	// 所有远程释放队列里的块都还给cc
+	void ReleaseRemote();
+
+	// 标记一下当前tc刚活动过，偷上限的时候挑最久没活动的
+	void MarkActive()
+	{
+		_lastActive.store(_sActiveClock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+
 private:
-	FreeList _freeLists[FREE_LIST_NUM]; // ϣÿͰʾһ
+	FreeList _freeLists[FREE_LIST_NUM]; // 哈希，每个桶表示一个自由链表
+
+	size_t _size = 0; // 所有自由链表里一共缓存了多少字节，只有自己的线程会改
+	std::atomic<size_t> _maxBytes{ 0 }; // 最多能缓存多少字节，别的线程偷的时候会改
+	std::atomic<uint64_t> _lastActive{ 0 }; // 最近一次走慢路径的时间(_sActiveClock的值)
+
+	RemoteFreeList* _remote = nullptr; // 别的线程释放的属于这个tc的块挂在这里
+
+	ThreadCache* _prev = nullptr; // 所有活着的tc串成一个双向链表，偷上限的时候要遍历
+	ThreadCache* _next = nullptr;
+
+	static ObjectPool<ThreadCache> _tcPool; // 创建tc的对象池
+	static ObjectPool<RemoteFreeList> _remotePool; // 远程释放队列只从这里New，不Delete，_tcPool._poolMtx保护
+
+	// 下面这些都由_sListMtx保护
+	static ThreadCache* _sHead; // 活着的tc链表
+	static size_t _sBudget; // 总预算
+	static long long _sUnclaimed; // 总预算里还没分给tc的，调小预算之后可能是负的
+	static RemoteFreeList* _sFreeRemotes; // 退出了的tc留下的远程释放队列，新的tc先拿这里的
+	static std::mutex _sListMtx;
+
+	static size_t _sRetiredFetches[FREE_LIST_NUM]; // 退出了的tc每个桶向cc要过几次，_sListMtx保护
+	static size_t _sRetiredReleases[FREE_LIST_NUM]; // 退出了的tc每个桶还给cc几次
+
+	static std::atomic<uint64_t> _sActiveClock; // 每走一次慢路径加1，当成时间用
 };
 
-// TLSȫֶָ룬ÿ̶߳һȫֶ
-// static _declspec(thread) ThreadCache* pTLSThreadCache = nullptr; // ==> _declspec(thread)Windowsеģб֧
-//עҪstaticģȻ.cppļļʱᷢӴ
+// TLS的全局对象的指针，这样每个线程都能有一个独立的全局对象
+// static _declspec(thread) ThreadCache* pTLSThreadCache = nullptr; // ==> _declspec(thread)是Windows特有的，不是所有编译器都支持
+//注意要给成static的，不然当多个.cpp文件包含该文件的时候会发生链接错误
+
+static thread_local ThreadCache* pTLSThreadCache = nullptr; // thread_local是C++11提供的，能跨平台
+
+// 这个线程的tc已经回收了，线程退出的最后(别的thread_local对象析构的时候)还有申请的话不能再开tc，开了就没人回收了
+// 不能做成ThreadCacheReleaser的成员：析构函数里最后对成员的写，编译器会当成没用的删掉(对象已经没了)
+static thread_local bool tlsThreadCacheExited = false;
+
+// 线程退出时回收当前线程的tc，不然tc和它自由链表里的空间就永远丢在那了
+// thread_local对象的析构函数会在线程结束的时候自动调用
+class ThreadCacheReleaser
+{
+public:
+	~ThreadCacheReleaser()
+	{
+		if (pTLSThreadCache)
+		{
+			ThreadCache::Destroy(pTLSThreadCache);
+			pTLSThreadCache = nullptr;
+		}
+		tlsThreadCacheExited = true;
+	}
+
+	// thread_local对象是第一次用到的时候才注册析构函数的，所以创建tc之后要调用一下
+	void Enable()
+	{}
+};
 
-static thread_local ThreadCache* pTLSThreadCache = nullptr; // thread_localC++11ṩģܿƽ̨
\ No newline at end of file
+static thread_local ThreadCacheReleaser tlsThreadCacheReleaser;
\ No newline at end of file
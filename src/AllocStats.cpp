@@ -0,0 +1,132 @@
+#include"AllocStats.h"
+#include<cstdio>
+#include<cstdarg>
+
+// 往out后面按printf的格式追加一段
+static void Append(std::string& out, const char* fmt, ...)
+{
+	char buf[512];
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	if (n > 0)
+		out.append(buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+// 各层的数收上来之后，算每个桶正在用的块数和各项总数
+void SumStats(AllocStats& stats)
+{
+	for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+	{
+		ClassStats& cls = stats._classes[i];
+		cls._objSize = SizeClass::ClassSize(i);
+
+		// 各层不是在同一时刻读的，块在中间挪了地方的话缓存的可能比span里的还多，算成0
+		size_t cached = cls._centralObjs + cls._transferObjs + cls._threadObjs + cls._cpuObjs + cls._remoteObjs;
+		cls._inUseObjs = cls._spanObjs > cached ? cls._spanObjs - cached : 0;
+
+		stats._threadBytes += cls._threadObjs * cls._objSize;
+		stats._remoteBytes += cls._remoteObjs * cls._objSize;
+		stats._transferBytes += cls._transferObjs * cls._objSize;
+		stats._centralBytes += cls._centralObjs * cls._objSize;
+		stats._inUseBytes += cls._inUseObjs * cls._objSize;
+
+		stats._centralFetches += cls._centralFetches;
+		stats._centralReleases += cls._centralReleases;
+		stats._spanFetches += cls._spanFetches;
+		stats._spanReleases += cls._spanReleases;
+	}
+}
+
+// 按人看的格式输出，只列有东西的桶
+std::string StatsToText(const AllocStats& stats)
+{
+	std::string out;
+	const double MB = 1024.0 * 1024.0;
+
+	Append(out, "------------------------------------------------\n");
+	Append(out, "MALLOC: %14zu (%8.1f MiB) in use by application (small objects)\n", stats._inUseBytes, stats._inUseBytes / MB);
+	Append(out, "MALLOC: + %12zu (%8.1f MiB) in use by application (large spans, %zu)\n", stats._largeBytes, stats._largeBytes / MB, stats._largeSpans);
+	Append(out, "MALLOC: + %12zu (%8.1f MiB) in arenas\n", stats._arenaBytes, stats._arenaBytes / MB);
+	Append(out, "MALLOC: + %12zu (%8.1f MiB) in thread cache freelists (%zu caches)\n", stats._threadBytes, stats._threadBytes / MB, stats._threadCaches);
+	Append(out, "MALLOC: + %12zu (%8.1f MiB) in thread cache remote-free queues\n", stats._remoteBytes, stats._remoteBytes / MB);
+	Append(out, "MALLOC: + %12zu (%8.1f MiB) in per-cpu caches\n", stats._cpuBytes, stats._cpuBytes / MB);
+	Append(out, "MALLOC: + %12zu (%8.1f MiB) in central transfer caches\n", stats._transferBytes, stats._transferBytes / MB);
+	Append(out, "MALLOC: + %12zu (%8.1f MiB) in central spans\n", stats._centralBytes, stats._centralBytes / MB);
+	Append(out, "MALLOC: + %12zu (%8.1f MiB) in page heap freelists (%zu released to OS)\n",
+		stats._pageFreeBytes, stats._pageFreeBytes / MB, stats._releasedBytes);
+	Append(out, "MALLOC:   %12zu (%8.1f MiB) mapped from OS\n", stats._mappedBytes, stats._mappedBytes / MB);
+	Append(out, "MALLOC:   %12zu (%8.1f MiB) metadata (%zu spans)\n", stats._metadataBytes, stats._metadataBytes / MB, stats._spanObjects);
+	Append(out, "------------------------------------------------\n");
+	Append(out, "Slow path: central fetches %zu, central releases %zu, span fetches %zu, span releases %zu,\n",
+		stats._centralFetches, stats._centralReleases, stats._spanFetches, stats._spanReleases);
+	Append(out, "           page heap refills %zu, chunk reuses %zu, large allocs %zu, arena span fetches %zu\n",
+		stats._pageRefills, stats._chunkReuses, stats._largeAllocs, stats._arenaSpanFetches);
+
+	Append(out, "------------------------------------------------\n");
+	Append(out, "class   size   spans    in use   thread      cpu transfer  central  fetches  xfer hit/miss\n");
+	for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+	{
+		const ClassStats& cls = stats._classes[i];
+		if (cls._spans == 0 && cls._centralFetches == 0)
+			continue;
+
+		Append(out, "%5zu %6zu %7zu %9zu %8zu %8zu %8zu %8zu %8zu %7zu/%zu\n",
+			i, cls._objSize, cls._spans, cls._inUseObjs, cls._threadObjs, cls._cpuObjs,
+			cls._transferObjs, cls._centralObjs, cls._centralFetches, cls._transferHits, cls._transferMisses);
+	}
+
+	Append(out, "------------------------------------------------\n");
+	Append(out, "pages  free spans  released\n");
+	for (size_t k = 1; k < PAGE_NUM; ++k)
+	{
+		if (stats._pages[k]._spans == 0)
+			continue;
+		Append(out, "%5zu %11zu %9zu\n", k, stats._pages[k]._spans, stats._pages[k]._releasedSpans);
+	}
+
+	return out;
+}
+
+// 输出成JSON，所有桶都列出来
+std::string StatsToJson(const AllocStats& stats)
+{
+	std::string out = "{";
+
+	Append(out, "\"in_use_bytes\":%zu,\"large_bytes\":%zu,\"large_spans\":%zu,\"arena_bytes\":%zu,",
+		stats._inUseBytes, stats._largeBytes, stats._largeSpans, stats._arenaBytes);
+	Append(out, "\"thread_cache_bytes\":%zu,\"thread_caches\":%zu,\"remote_free_bytes\":%zu,\"cpu_cache_bytes\":%zu,",
+		stats._threadBytes, stats._threadCaches, stats._remoteBytes, stats._cpuBytes);
+	Append(out, "\"transfer_cache_bytes\":%zu,\"central_bytes\":%zu,\"page_free_bytes\":%zu,", stats._transferBytes, stats._centralBytes, stats._pageFreeBytes);
+	Append(out, "\"mapped_bytes\":%zu,\"released_bytes\":%zu,\"metadata_bytes\":%zu,\"span_objects\":%zu,",
+		stats._mappedBytes, stats._releasedBytes, stats._metadataBytes, stats._spanObjects);
+	Append(out, "\"central_fetches\":%zu,\"central_releases\":%zu,\"span_fetches\":%zu,\"span_releases\":%zu,",
+		stats._centralFetches, stats._centralReleases, stats._spanFetches, stats._spanReleases);
+	Append(out, "\"page_refills\":%zu,\"chunk_reuses\":%zu,\"large_allocs\":%zu,\"arena_span_fetches\":%zu,",
+		stats._pageRefills, stats._chunkReuses, stats._largeAllocs, stats._arenaSpanFetches);
+
+	out += "\"classes\":[";
+	for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+	{
+		const ClassStats& cls = stats._classes[i];
+		Append(out, "%s{\"size\":%zu,\"spans\":%zu,\"span_objs\":%zu,\"in_use_objs\":%zu,\"thread_objs\":%zu,\"remote_objs\":%zu,\"cpu_objs\":%zu,",
+			i == 0 ? "" : ",", cls._objSize, cls._spans, cls._spanObjs, cls._inUseObjs, cls._threadObjs, cls._remoteObjs, cls._cpuObjs);
+		Append(out, "\"transfer_objs\":%zu,\"central_objs\":%zu,\"central_fetches\":%zu,\"central_releases\":%zu,",
+			cls._transferObjs, cls._centralObjs, cls._centralFetches, cls._centralReleases);
+		Append(out, "\"transfer_hits\":%zu,\"transfer_misses\":%zu,\"span_fetches\":%zu,\"span_releases\":%zu}",
+			cls._transferHits, cls._transferMisses, cls._spanFetches, cls._spanReleases);
+	}
+
+	// 下标就是页数，0号没用也放着，免得读的人还要换算
+	out += "],\"page_buckets\":[";
+	for (size_t k = 0; k < PAGE_NUM; ++k)
+	{
+		Append(out, "%s{\"pages\":%zu,\"spans\":%zu,\"released_spans\":%zu}",
+			k == 0 ? "" : ",", k, stats._pages[k]._spans, stats._pages[k]._releasedSpans);
+	}
+	out += "]}";
+
+	return out;
+}
@@ -1,155 +1,333 @@
 #include"CentralCache.h"
 #include"PageCache.h"
 
-CentralCache CentralCache::_sInst; // CentralCacheĶ
+CentralCache CentralCache::_sInst; // CentralCache的饿汉对象
 
-// ccһռǿյspanóһbatchNumsizeСĿռ
-size_t CentralCache::FetchRangeObj(void*& start, void*& end, size_t batchNum, size_t size)
+// cc从一个管理空间非空的span中拿出一段batchNum个size大小的块空间
+size_t CentralCache::FetchRangeObj(void*& start, void*& end, size_t batchNum, size_t size, RemoteFreeList* owner)
 {
-	// ȡsizeӦһSpanList
+	// 获取到size对应哪一个SpanList
 	size_t index = SizeClass::Index(size);
+	size_t node = PageCache::GetInstance()->CurrentNode(); // 从当前线程所在节点的桶里拿
+	CentralNode* cn = GetNode(node);
+
+	// 要的正好是一整批的话，先看看中转站里有没有别的线程还回来的，有就直接拿走
+	if (batchNum == SizeClass::BatchSize(index)
+		&& cn->_transferCaches[index].Remove(start, end))
+	{
+		return batchNum;
+	}
 	
-	// ccеSpanListʱҪ
-	_spanLists[index]._mtx.lock();
+	// 对cc中的桶操作时要加锁
+	CentralBucket& bucket = cn->_buckets[index];
+	bucket._mtx.lock();
+
+	// 获取到一个管理空间非空的span
+	Span* span = GetOneSpan(bucket, size, node);
+	assert(span); // 断言一下span不为空
+	assert(span->use_count < SpanCapacity(index)); // 断言一下span管理的空间不能为空
+	span->_owner.store(owner, std::memory_order_relaxed); // 别的线程释放这些块的时候还给owner
+
+	size_t actualNum = 0; // 函数实际的返回值
+	start = end = nullptr;
+
+	// 先拿还回来的块
+	if (span->_freeList != nullptr)
+	{
+		// 起初都指向_freeList，让end不断往后走
+		start = end = span->_freeList;
+		actualNum = 1;
 
-	// ȡһռǿյspan
-	Span* span = GetOneSpan(_spanLists[index], size);
-	assert(span); // һspanΪ
-	assert(span->_freeList); // һspanĿռ䲻Ϊ
+		// 在end的next不为空的前提下，让end走batchNum - 1步
+		while (actualNum < batchNum && ObjNext(end) != nullptr)
+		{
+			end = ObjNext(end);
+			++actualNum; // 记录end走过了多少步
+		}
 
-	// ָ_freeListend
-	start = end = span->_freeList;
-	size_t actualNum = 1; // ʵʵķֵ
+		// 将[start, end]返回给ThreadCache后，调整Span的_freeList
+		span->_freeList = ObjNext(end);
+	}
 
-	// endnextΪյǰ£endbatchNum - 1
-	size_t i = 0;
-	while (i < batchNum - 1 && ObjNext(end) != nullptr)
+	// 还不够的话，从没切过的部分现切，要多少切多少，没给出去的页连碰都不碰
+	char* spanEnd = (char*)((span->_pageID + span->_n) << PAGE_SHIFT);
+	while (actualNum < batchNum && span->_bump + size <= spanEnd)
 	{
-		end = ObjNext(end);
-		++actualNum; // ¼end߹˶ٲ
-		++i; // 
+		if (start == nullptr)
+			start = span->_bump;
+		else
+			ObjNext(end) = span->_bump;
+		end = span->_bump;
+		span->_bump += size;
+		++actualNum;
 	}
 
-	// [start, end]ظThreadCache󣬵Span_freeList
-	span->_freeList = ObjNext(end);
-	span->use_count += actualNum; // tc˶پ͸useCountӶ
-	// һοռ䣬ҪԭSpan_freeListеĿ
+	size_t oldCount = span->use_count;
+	span->use_count += actualNum; // 给tc分了多少就给useCount加多少
+	// 返回一段空间，不要和原先Span的_freeList中的块相连
 	ObjNext(end) = nullptr; 
 
-	_spanLists[index]._mtx.unlock();
+	// 用掉的多了，可能要挪到更满的一档或者_full里
+	MoveSpan(bucket, span, oldCount, SpanCapacity(index));
+
+	bucket._mtx.unlock();
 
 	return actualNum;
 }
 
-// ȡһռǿյSpan
-Span* CentralCache::GetOneSpan(SpanList& list, size_t size)
+// 获取一个管理空间非空的Span
+Span* CentralCache::GetOneSpan(CentralBucket& bucket, size_t size, size_t node)
 {
-	// ccһûйռǿյspan
-	Span* it = list.Begin();
-	while (it != list.End())
+	// 先在cc中找一下有没有管理空间非空的span，_partial里的都是，从用得最满的那一档开始找
+	for (size_t i = CENTRAL_PARTIAL_BINS; i > 0; --i)
 	{
-		if (it->_freeList != nullptr) // ҵռǿյspan
-			return it;
-		else // ûҵ
-			it = it->_next;
+		if (!bucket._partial[i - 1].Empty())
+			return bucket._partial[i - 1].Begin();
 	}
 
-	// ͰccͰв߳õ
-	list._mtx.unlock();
+	// 解掉桶锁，让其他向该cc桶进行操作的线程能拿到锁
+	bucket._mtx.unlock();
 
-	// ߵccûҵռǿյspan
+	// 走到这就是cc中没有找到管理空间非空的span
 	
-	// sizeתƥҳԹpcṩһʵspan
-	size_t k = SizeClass::NumMovePage(size);
+	// 将size转换成匹配的页数，以供pc提供一个合适的span
+	size_t k = SizeClass::ClassPages(SizeClass::Index(size));
+
+	// 调用NewSpan获取一个全新span，pc的锁在NewSpan里面加，拿到的span已经标记成正在使用了。
+	// 线程可能已经换到别的节点的cpu上了，还是要桶所在节点的span，不然还回来的时候会找错桶
+	Span* span = PageCache::GetInstance()->NewSpan(k, node);
+
+	span->_objSize = size; // 记录span被切分的块有多大
+
+	/* 原来这里会把整个span一次切好串成链表，8字节的块一个span要循环一千多次，span的每一页都会被写一遍
+	 (都要缺页)。现在不切了，只记一下从哪开始，FetchRangeObj要多少块再从_bump往后切多少块，
+	 span的大小不一定是size的整数倍，最后放不下一整块的尾巴不会切出去。
+	 这里要强转一下，因为_pageID是PageID类型(size_t或者unsigned long long)的，不能直接赋值给指针 */
+	span->_freeList = nullptr;
+	span->_bump = (char*)(span->_pageID << PAGE_SHIFT);
+
+	// 切好span以后，需要把span挂到cc对应下标的桶里面去，一块都还没用，放在最空的那一档
+	bucket._mtx.lock(); // span挂上去之前加锁
+	bucket._partial[0].PushFront(span);
+	++bucket._spanFetches;
 
-	// ķڵNewSpanĵط
-	PageCache::GetInstance()->_pageMtx.lock();	// 
-	// NewSpanȡһȫspan
-	Span* span = PageCache::GetInstance()->NewSpan(k);
-	span->_isUse = true; // ccȡpcеspanĳʹ
-	PageCache::GetInstance()->_pageMtx.unlock(); // 
+	return span;
+}
+
+
+/* 将tc还回来的多块空间放到span中
+ 原来是一块一块地处理：每一块都要MapObjectToSpan(基数树叶子缺一次cache)，再去改span(又缺一次)，
+ 两次都是要等上一次的结果才能接着走的；span空了还要解桶锁、加pc的锁、再加回桶锁。现在：
+ 1. 取下一块的地址本身就要等内存，顺手把下一块的页号映射预取上，轮到它的时候就不用再等了
+ 2. 挨着的块是同一页的不用再查映射，是同一个span的先串成一串，换span的时候整串接到span上，
+	span只改一次。tc还回来的块大多是按申请的顺序挨着的，一串能有很多块；完全打乱了就是一块一串，和原来一样
+ 3. 空了的span不马上还，攒够CENTRAL_RELEASE_BATCH个或者走完了，解开桶锁一起交给pc，同一个页堆的只加一次锁
+ 4. 块按span记的节点还到那个节点的桶里，换到别的节点的span了才换桶锁，一串块基本都是同一个节点的
+ 本来想先不加锁整组分好再加锁改span，但块完全打乱的时候多走一趟反而慢了一倍，所以还是一趟走完 */
+void CentralCache::ReleaseListToSpans(void* start, size_t size)
+{
+	// 先通过size找到对应的桶在哪里，是哪个节点的桶要看span
+	size_t index = SizeClass::Index(size);
+	CentralBucket* bucket = nullptr; // 现在拿着锁的桶
+	size_t capacity = SpanCapacity(index);
+	PageCache* pc = PageCache::GetInstance();
 
-	/* Ҫǿתһ£Ϊ_pageIDPageID(size_t
-	 unsigned long long)ģֱӸֵָ*/
-	char* start = (char*)(span->_pageID << PAGE_SHIFT);
-	char* end = (char*)(start + (span->_n << PAGE_SHIFT));
+	Span* emptied[CENTRAL_RELEASE_BATCH]; // 空了的span攒在这里
+	size_t nempty = 0;
 
-	span->_objSize = size; // ¼spanзֵĿж
+	// 当前这一串：都是span的块，head到tail，一共n块
+	Span* span = nullptr;
+	void* head = nullptr;
+	void* tail = nullptr;
+	size_t n = 0;
 
-	// ʼзspanĿռ
+	// 把当前这一串接到span上，调用前要拿着桶锁
+	auto flush = [&]()
+	{
+		// 把这一串块整个接到span的_freeList前面
+		ObjNext(tail) = span->_freeList;
+		span->_freeList = head;
 
-	span->_freeList = start;// Ŀռŵspan->_freeList
+		// 还回了几块空间，对应span的useCount要减几
+		size_t oldCount = span->use_count;
+		span->use_count -= n;
+		if (span->use_count == 0) // 这个span管理的所有页都回来了
+		{ // 将这个span交给pc管理，先从cc中去掉，攒着一起还
+			ListFor(*bucket, oldCount, capacity).Erase(span);
+			span->_freeList = nullptr; // 一些清理工作
+			span->_bump = nullptr;
+			span->_owner.store(nullptr, std::memory_order_relaxed);
+			span->_next = nullptr;
+			span->_prev = nullptr;
+			emptied[nempty++] = span;
+			++bucket->_spanReleases;
 
-	void* tail = start; // tailָstart
-	start += size; // startһ飬ѭ
+			if (nempty == CENTRAL_RELEASE_BATCH)
+			{ // 攒满了，先还掉，pc的锁在里面加，还的时候不拿着桶锁
+				bucket->_mtx.unlock();
+				pc->ReleaseSpansToPageCache(emptied, nempty);
+				nempty = 0;
+				bucket->_mtx.lock();
+			}
+		}
+		else
+		{ // 用掉的少了，可能要挪到更空的一档
+			MoveSpan(*bucket, span, oldCount, capacity);
+		}
+		n = 0;
+	};
 
-	int i = 0;
-	// Ӹ
-	while (start < end)
+	PageID lastPage = 0;
+	while (start) // start为空时停止
 	{
-		++i;
-		ObjNext(tail) = start;
-		start += size;
-		tail = ObjNext(tail);
+		void* obj = start;
+		start = ObjNext(obj);
+
+		PageID page = (PageID)obj >> PAGE_SHIFT;
+		if (start && ((PageID)start >> PAGE_SHIFT) != page)
+			pc->PrefetchObjectSpan(start);
+
+		// 和上一块在同一页的话span也一样，不用再查
+		if (n == 0 || page != lastPage)
+		{
+			Span* cur = pc->MapObjectToSpan(obj);
+			lastPage = page;
+			if (cur != span)
+			{ // 换span了，上一串先接上去
+				if (n > 0)
+					flush();
+				span = cur;
+
+				// 下面要对cc中的span进行操作，所以要加上span所在节点的桶锁，和现在拿着的不是同一个就换过来
+				CentralBucket* curBucket = &BucketOf(span, index);
+				if (curBucket != bucket)
+				{
+					if (bucket != nullptr)
+						bucket->_mtx.unlock();
+					bucket = curBucket;
+					bucket->_mtx.lock();
+				}
+			}
+		}
+
+		// 头插到这一串里，第一块就是串尾
+		if (n == 0)
+		{
+			head = nullptr;
+			tail = obj;
+		}
+		ObjNext(obj) = head;
+		head = obj;
+		++n;
 	}
-	ObjNext(tail) = nullptr; // ǵҪһλÿ
+	if (n > 0)
+		flush();
 
-	// кspanԺҪspanҵccӦ±Ͱȥ	
-	list._mtx.lock(); // spanȥ֮ǰ
-	list.PushFront(span);
+	if (bucket != nullptr)
+		bucket->_mtx.unlock(); // 解桶锁
 
-	return span;
+	// 剩下的空span一起还给pc
+	if (nempty > 0)
+		pc->ReleaseSpansToPageCache(emptied, nempty);
 }
 
-
-// tcĶռŵspan
-void CentralCache::ReleaseListToSpans(void* start, size_t size)
+// tc还回来n块空间，正好是一整批的话先放到中转站，放不下了再还给span
+void CentralCache::InsertRange(void* start, void* end, size_t n, size_t size)
 {
-	// ͨsizeҵӦͰ
 	size_t index = SizeClass::Index(size);
 
-	// ҪccеspanвҪccͰ
-	_spanLists[index]._mtx.lock();
+	// 放到当前线程所在节点的中转站，不去查这一批是哪个节点的span
+	if (n == SizeClass::BatchSize(index)
+		&& GetNode(PageCache::GetInstance()->CurrentNode())->_transferCaches[index].Insert(start, end, size))
+	{
+		return;
+	}
+
+	ReleaseListToSpans(start, size);
+}
 
-	// startŵӦҳspan_freeList
-	while (start) // startΪʱֹͣ
+// 把中转站里存着的批都还给span
+size_t CentralCache::ReleaseTransferCaches(bool onlyIdle)
+{
+	size_t bytes = 0;
+	for (size_t node = 0; node < NUMA_MAX_NODES; ++node)
 	{
-		// ¼һstartһλ
-		void* next = ObjNext(start);
-		
-		// ҵӦspan
-		Span* span = PageCache::GetInstance()->MapObjectToSpan(start);
-
-		// ѵǰ뵽Ӧspan
-		ObjNext(start) = span->_freeList;
-		span->_freeList = start;
-
-		// һռ䣬ӦspanuseCountҪ1
-		span->use_count--;
-		if (span->use_count == 0) // spanҳ
-		{ // spanpc
-			
-			// Ƚspanccȥ
-			_spanLists[index].Erase(span);
-			span->_freeList = nullptr; // һЩ
-			span->_next = nullptr;
-			span->_prev = nullptr;
+		CentralNode* cn = _nodes[node].load(std::memory_order_acquire);
+		if (cn == nullptr)
+			continue;
 
-			// 黹spanǰͰ
-			_spanLists[index]._mtx.unlock();
+		for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+		{
+			size_t size = SizeClass::ClassSize(i);
+			size_t n = cn->_transferCaches[i].Drain(onlyIdle, [&](void* start) {
+				ReleaseListToSpans(start, size);
+			});
+			bytes += n * SizeClass::BatchSize(i) * size;
+		}
+	}
+	return bytes;
+}
+
+// cc这一层每个桶的统计，所有节点加起来
+void CentralCache::GetStats(AllocStats& stats)
+{
+	for (size_t node = 0; node < NUMA_MAX_NODES; ++node)
+	{
+		CentralNode* cn = _nodes[node].load(std::memory_order_acquire);
+		if (cn == nullptr)
+			continue;
+
+		for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+		{
+			ClassStats& cls = stats._classes[i];
+			CentralBucket& bucket = cn->_buckets[i];
+			size_t capacity = SpanCapacity(i);
 
-			// 黹spanpage
-			PageCache::GetInstance()->_pageMtx.lock();
-			PageCache::GetInstance()->ReleaseSpanToPageCache(span);
-			PageCache::GetInstance()->_pageMtx.unlock();
+			{
+				std::lock_guard<std::mutex> lock(bucket._mtx);
+				auto countList = [&](SpanList& list)
+				{
+					for (Span* span = list.Begin(); span != list.End(); span = span->_next)
+					{
+						++cls._spans;
+						cls._spanObjs += capacity;
+						cls._centralObjs += capacity - span->use_count;
+					}
+				};
+				for (auto& list : bucket._partial)
+					countList(list);
+				countList(bucket._full);
 
-			// 黹ϣټϵǰͰͰ
-			_spanLists[index]._mtx.lock();
+				cls._spanFetches += bucket._spanFetches;
+				cls._spanReleases += bucket._spanReleases;
+			}
+
+			size_t batches = 0;
+			size_t hits = 0;
+			size_t misses = 0;
+			cn->_transferCaches[i].GetStats(batches, hits, misses);
+			cls._transferObjs += batches * SizeClass::BatchSize(i);
+			cls._transferHits += hits;
+			cls._transferMisses += misses;
 		}
+	}
+}
 
-		// һ
-		start = next;
+// node号节点的桶，第一次用到的时候才开
+CentralNode* CentralCache::GetNode(size_t node)
+{
+	CentralNode* res = _nodes[node].load(std::memory_order_acquire);
+	if (res != nullptr)
+		return res;
+
+	std::lock_guard<std::mutex> lock(_nodeMtx);
+	res = _nodes[node].load(std::memory_order_relaxed);
+	if (res == nullptr)
+	{ // 不走malloc，第一次用到的一般就是这个节点上的线程，按首次访问分配，物理页也在这个节点上
+		size_t kpage = (sizeof(CentralNode) + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+		res = new(SystemAlloc(kpage)) CentralNode;
+		_nodes[node].store(res, std::memory_order_release);
 	}
 
-	_spanLists[index]._mtx.unlock(); // Ͱ
-}
\ No newline at end of file
+	return res;
+}
@@ -0,0 +1,161 @@
+#include"ConcurrentArena.h"
+#include"PageCache.h"
+
+static std::atomic<size_t> s_arenaBytes{ 0 }; // 所有arena手上的和线程留着的span一共多少字节
+static std::atomic<size_t> s_arenaSpanFetches{ 0 }; // 向pc要过几次span
+
+// 一次最多攒多少个span交给pc，攒满了先还一批
+static const size_t ARENA_RELEASE_BATCH = 64;
+
+// 一批span攒起来一起还给pc，128页以内的同一个页堆只加一次锁
+struct ArenaReleaser
+{
+	Span* _spans[ARENA_RELEASE_BATCH];
+	size_t _n = 0;
+
+	void Add(Span* span)
+	{
+		s_arenaBytes.fetch_sub(span->_n << PAGE_SHIFT, std::memory_order_relaxed);
+		if (span->_large)
+		{ // 向os要的大span直接还给os，不用攒
+			PageCache::GetInstance()->ReleaseSpanToPageCache(span);
+			return;
+		}
+
+		_spans[_n++] = span;
+		if (_n == ARENA_RELEASE_BATCH)
+			Flush();
+	}
+
+	void Flush()
+	{
+		if (_n > 0)
+			PageCache::GetInstance()->ReleaseSpansToPageCache(_spans, _n);
+		_n = 0;
+	}
+};
+
+// 每个线程留着的标准大小的span，线程退出的时候ArenaSpanCacheReleaser还给pc
+struct ArenaSpanCache
+{
+	Span* _spans[ARENA_CACHE_SPANS];
+	size_t _n = 0;
+	bool _exited = false; // 已经还过了，线程退出的最后还有arena Reset的话直接还给pc
+};
+
+static thread_local ArenaSpanCache t_arenaSpans;
+
+// 还的事情不放在ArenaSpanCache自己的析构函数里：析构函数里最后对成员的写(_n、_exited)，
+// 编译器会当成没用的删掉(对象已经没了)，后面的Reset就会把span放进一个已经还过的缓存里
+struct ArenaSpanCacheReleaser
+{
+	~ArenaSpanCacheReleaser()
+	{
+		ArenaSpanCache& cache = t_arenaSpans;
+		ArenaReleaser releaser;
+		for (size_t i = 0; i < cache._n; ++i)
+			releaser.Add(cache._spans[i]);
+		releaser.Flush();
+		cache._n = 0;
+		cache._exited = true;
+	}
+
+	// thread_local对象是第一次用到的时候才注册析构函数的，往缓存里放span之前要调用一下
+	void Enable()
+	{}
+};
+
+static thread_local ArenaSpanCacheReleaser t_arenaSpansReleaser;
+
+// 拿一个k页的span挂到_spans上，标准大小的先看当前线程有没有留着的
+Span* ConcurrentArena::NewSpan(size_t k)
+{
+	Span* span = nullptr;
+	if (k == ARENA_SPAN_PAGES && t_arenaSpans._n > 0)
+	{
+		span = t_arenaSpans._spans[--t_arenaSpans._n];
+	}
+	else
+	{
+		span = PageCache::GetInstance()->NewSpan(k);
+		span->_objSize = 0; // 不是切成一样大的块的，ConcurrentFree不认
+		s_arenaBytes.fetch_add(k << PAGE_SHIFT, std::memory_order_relaxed);
+		s_arenaSpanFetches.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	_spanBytes += k << PAGE_SHIFT;
+	return span;
+}
+
+// 当前span切不下了
+void* ConcurrentArena::AllocSlow(size_t size)
+{
+	if (size == 0)
+		size = 1; // 也要给一个能用的地址
+
+	// 大的单独要一个正好够的span，挂在正在切的span后面，正在切的接着切
+	const size_t spanBytes = ARENA_SPAN_PAGES << PAGE_SHIFT;
+	if (size > spanBytes / 4)
+	{
+		size_t k = (size + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT; // span按页对齐，align不超过一页，开头就是对齐的
+		Span* span = NewSpan(k);
+		if (_spans == nullptr)
+		{
+			_spans = span;
+			span->_next = nullptr;
+		}
+		else
+		{
+			span->_next = _spans->_next;
+			_spans->_next = span;
+		}
+		_usedBytes += size;
+		return (void*)(span->_pageID << PAGE_SHIFT);
+	}
+
+	// 换一个新的标准span来切，旧的剩下的就不要了
+	Span* span = NewSpan(ARENA_SPAN_PAGES);
+	span->_next = _spans;
+	_spans = span;
+
+	_usedBytes += _ptr - _begin;
+	_begin = _ptr = (char*)(span->_pageID << PAGE_SHIFT);
+	_end = _begin + spanBytes;
+
+	void* obj = _ptr;
+	_ptr += size;
+	return obj;
+}
+
+// 所有span还掉：标准大小的先留给当前线程，留不下的和大的攒起来一起还给pc
+void ConcurrentArena::Reset()
+{
+	ArenaReleaser releaser;
+	ArenaSpanCache& cache = t_arenaSpans;
+	while (_spans)
+	{
+		Span* span = _spans;
+		_spans = span->_next;
+		span->_next = nullptr;
+
+		if (span->_n == ARENA_SPAN_PAGES && cache._n < ARENA_CACHE_SPANS && !cache._exited)
+		{
+			t_arenaSpansReleaser.Enable();
+			cache._spans[cache._n++] = span;
+		}
+		else
+			releaser.Add(span);
+	}
+	releaser.Flush();
+
+	_begin = _ptr = _end = nullptr;
+	_usedBytes = 0;
+	_spanBytes = 0;
+}
+
+// 所有arena的统计
+void ConcurrentArena::GetStats(AllocStats& stats)
+{
+	stats._arenaBytes += s_arenaBytes.load(std::memory_order_relaxed);
+	stats._arenaSpanFetches += s_arenaSpanFetches.load(std::memory_order_relaxed);
+}
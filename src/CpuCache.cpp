@@ -0,0 +1,398 @@
+#include"CpuCache.h"
+#include"CentralCache.h"
+
+#if defined(__linux__) && defined(__x86_64__) && __has_include(<sys/rseq.h>)
+	#include<sys/rseq.h> // glibc 2.35以后提供__rseq_offset/__rseq_size
+	#include<unistd.h>
+	#define CMP_HAVE_RSEQ 1
+#endif
+
+CpuCache CpuCache::_sInst; // CpuCache的饿汉对象
+std::atomic<bool> CpuCache::_active{ false };
+
+#ifdef CMP_HAVE_RSEQ
+
+// 和glibc注册rseq时用的签名一致，abort处理入口前面必须紧跟着这4个字节，内核会检查
+#define CMP_RSEQ_SIG "0x53053053"
+
+/* 下面两个函数的写法参考的是librseq：
+ 1. 先在__rseq_cs段里放一个描述临界区的结构体(版本、标志、起始地址、长度、abort地址)
+ 2. 把这个结构体的地址写到当前线程rseq区域的rseq_cs字段，临界区就开始了
+ 3. 比较一下当前cpu是不是传进来的cpu，不是就说明已经被迁移了，直接走abort
+ 4. 临界区里最后一条写内存的指令就是提交，它前面的所有操作被打断都相当于没做过
+ 返回值：0成功，1桶满了(压栈)/桶空了(弹栈)，-1被打断了需要重试 */
+
+// 把obj压到slots这个栈里，top是栈顶下标，cap是栈的容量
+static inline int RseqPush(intptr_t* top, void** slots, intptr_t cap, void* obj, int cpu)
+{
+	__asm__ __volatile__ goto (
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0x0, 0x0\n\t"
+		".quad 1f, 2f - 1f, 4f\n\t"
+		".popsection\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %%fs:8(%[rseq_offset])\n\t"
+		"1:\n\t"
+		"cmpl %[cpu], %%fs:4(%[rseq_offset])\n\t"
+		"jnz 4f\n\t"
+		"movq %[top], %%rax\n\t"
+		"cmpq %[cap], %%rax\n\t"
+		"jae %l[full]\n\t"
+		"movq %[obj], (%[slots], %%rax, 8)\n\t"
+		"addq $1, %%rax\n\t"
+		"movq %%rax, %[top]\n\t" // 提交
+		"2:\n\t"
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long " CMP_RSEQ_SIG "\n\t"
+		"4:\n\t"
+		"jmp %l[abort]\n\t"
+		".popsection\n\t"
+		:
+		: [cpu] "r" (cpu),
+		  [rseq_offset] "r" (__rseq_offset),
+		  [top] "m" (*top),
+		  [cap] "r" (cap),
+		  [obj] "r" (obj),
+		  [slots] "r" (slots)
+		: "memory", "cc", "rax"
+		: abort, full
+	);
+	return 0;
+abort:
+	return -1;
+full:
+	return 1;
+}
+
+// 从slots这个栈里弹一块出来放到*out
+static inline int RseqPop(intptr_t* top, void** slots, void** out, int cpu)
+{
+	__asm__ __volatile__ goto (
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0x0, 0x0\n\t"
+		".quad 1f, 2f - 1f, 4f\n\t"
+		".popsection\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %%fs:8(%[rseq_offset])\n\t"
+		"1:\n\t"
+		"cmpl %[cpu], %%fs:4(%[rseq_offset])\n\t"
+		"jnz 4f\n\t"
+		"movq %[top], %%rax\n\t"
+		"testq %%rax, %%rax\n\t"
+		"jz %l[empty]\n\t"
+		"subq $1, %%rax\n\t"
+		"movq (%[slots], %%rax, 8), %%rcx\n\t"
+		"movq %%rcx, %[out]\n\t"
+		"movq %%rax, %[top]\n\t" // 提交
+		"2:\n\t"
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long " CMP_RSEQ_SIG "\n\t"
+		"4:\n\t"
+		"jmp %l[abort]\n\t"
+		".popsection\n\t"
+		:
+		: [cpu] "r" (cpu),
+		  [rseq_offset] "r" (__rseq_offset),
+		  [top] "m" (*top),
+		  [slots] "r" (slots),
+		  [out] "m" (*out)
+		: "memory", "cc", "rax", "rcx"
+		: abort, empty
+	);
+	return 0;
+abort:
+	return -1;
+empty:
+	return 1;
+}
+
+int CpuCache::CurrentCpu()
+{
+	if (__rseq_size == 0)
+		return -1; // glibc没有注册rseq
+
+	volatile struct rseq* rs = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+	return (int)rs->cpu_id; // 没注册成功的时候是负数
+}
+
+#else // 没有rseq的平台，per-cpu模式永远打不开
+
+static inline int RseqPush(intptr_t*, void**, intptr_t, void*, int)
+{
+	return -1;
+}
+
+static inline int RseqPop(intptr_t*, void**, void**, int)
+{
+	return -1;
+}
+
+int CpuCache::CurrentCpu()
+{
+	return -1;
+}
+
+#endif // CMP_HAVE_RSEQ
+
+bool CpuCache::Supported()
+{
+	return CurrentCpu() >= 0;
+}
+
+bool CpuCache::SetActive(bool active)
+{
+	if (active)
+	{
+		if (!Supported())
+			return false;
+		Init();
+	}
+
+	_active.store(active, std::memory_order_relaxed);
+	return active;
+}
+
+// 第一次用的时候把每个桶的块大小、容量、在缓存中的偏移算好
+void CpuCache::Init()
+{
+	if (_inited.load(std::memory_order_acquire))
+		return;
+
+	std::lock_guard<std::mutex> lock(_initMtx);
+	if (_inited.load(std::memory_order_relaxed))
+		return;
+
+	// 每个桶对齐后的块大小
+	for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+	{
+		_classSize[i] = SizeClass::ClassSize(i);
+	}
+
+	// 前面是FREE_LIST_NUM个栈顶，后面每个桶一个数组
+	size_t offset = FREE_LIST_NUM * sizeof(intptr_t);
+	for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+	{
+		// 一个桶在一个cpu上最多存CPU_CACHE_CLASS_BYTES字节，最多CPU_CACHE_MAX_SLOTS块，至少1块
+		size_t cap = CPU_CACHE_CLASS_BYTES / _classSize[i];
+		if (cap > CPU_CACHE_MAX_SLOTS)
+			cap = CPU_CACHE_MAX_SLOTS;
+		if (cap < 1)
+			cap = 1;
+
+		_capacity[i] = cap;
+		_slotOffset[i] = offset;
+		offset += cap * sizeof(void*);
+	}
+	_regionPages = (offset + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+
+#ifdef CMP_HAVE_RSEQ
+	_numCpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+#endif
+	if (_numCpus < 1)
+		_numCpus = 1;
+
+	// 每个cpu一个指针，具体的缓存等这个cpu第一次用到的时候再开
+	size_t bytes = _numCpus * sizeof(std::atomic<char*>);
+	_regions = (std::atomic<char*>*)SystemAlloc((bytes + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT);
+	for (int i = 0; i < _numCpus; ++i)
+		_regions[i].store(nullptr, std::memory_order_relaxed);
+
+	_inited.store(true, std::memory_order_release);
+}
+
+// 拿到cpu对应的那一块缓存，第一次用到的时候才去开
+char* CpuCache::GetRegion(int cpu)
+{
+	char* region = _regions[cpu].load(std::memory_order_acquire);
+	if (region != nullptr)
+		return region;
+
+	// 可能有几个线程同时在这个cpu上第一次用，谁先放上去就用谁的，没抢到的还回去
+	// SystemAlloc出来的空间本来就是全0的，栈顶都是0
+	char* fresh = (char*)SystemAlloc(_regionPages);
+	if (_regions[cpu].compare_exchange_strong(region, fresh, std::memory_order_acq_rel))
+		return fresh;
+
+	SystemFree(fresh, _regionPages);
+	return region;
+}
+
+// 从当前cpu的缓存中申请size大小的空间
+void* CpuCache::Allocate(size_t size)
+{
+	size_t index = SizeClass::Index(size);
+
+	while (true)
+	{
+		int cpu = CurrentCpu();
+		if (cpu < 0 || cpu >= _numCpus)
+		{ // 正常不会走到这里，万一有热插拔上来的cpu就直接找cc要一块
+			void* start = nullptr;
+			void* end = nullptr;
+			CentralCache::GetInstance()->FetchRangeObj(start, end, 1, SizeClass::RoundUp(size));
+			return start;
+		}
+
+		char* region = GetRegion(cpu);
+		void* obj = nullptr;
+		int ret = RseqPop(&Tops(region)[index], Slots(region, index), &obj, cpu);
+		if (ret == 0)
+			return obj;
+		if (ret > 0) // 桶空了，找cc要一批
+			return FetchFromCentralCache(index, cpu);
+		// 被打断了，可能已经换了cpu，重新来
+	}
+}
+
+// 把size大小的obj还到当前cpu的缓存中
+void CpuCache::Deallocate(void* obj, size_t size)
+{
+	assert(obj);
+	assert(size <= MAX_BYTES);
+
+	size_t index = SizeClass::Index(size);
+
+	while (true)
+	{
+		int cpu = CurrentCpu();
+		if (cpu < 0 || cpu >= _numCpus)
+		{
+			ObjNext(obj) = nullptr;
+			CentralCache::GetInstance()->ReleaseListToSpans(obj, _classSize[index]);
+			return;
+		}
+
+		char* region = GetRegion(cpu);
+		int ret = RseqPush(&Tops(region)[index], Slots(region, index), _capacity[index], obj, cpu);
+		if (ret == 0)
+			return;
+		if (ret > 0) // 桶满了，先倒一部分给cc再压
+			ReleaseToCentralCache(index, cpu);
+	}
+}
+
+// 当前cpu的桶空了，从cc拿一批上来，第一块直接返回，剩下的压到桶里
+void* CpuCache::FetchFromCentralCache(size_t index, int cpu)
+{
+	size_t alignSize = _classSize[index];
+	size_t batchNum = SizeClass::BatchSize(index);
+	if (batchNum > _capacity[index])
+		batchNum = _capacity[index];
+
+	void* start = nullptr;
+	void* end = nullptr;
+	size_t actualNum = CentralCache::GetInstance()->FetchRangeObj(start, end, batchNum, alignSize);
+	assert(actualNum >= 1);
+	(void)actualNum; // 只在assert里用
+
+	// 第一块直接给线程，剩下的一块一块压到桶里
+	void* cur = ObjNext(start);
+	while (cur)
+	{
+		// 要在压进去之前拿到下一块，压进去之后同一个cpu上的别的线程随时可能把它拿走用掉
+		void* next = ObjNext(cur);
+
+		char* region = GetRegion(cpu);
+		int ret = RseqPush(&Tops(region)[index], Slots(region, index), _capacity[index], cur, cpu);
+		if (ret < 0)
+		{ // 被打断了，换到现在所在的cpu上接着压
+			cpu = CurrentCpu();
+			if (cpu < 0 || cpu >= _numCpus)
+				break;
+			continue;
+		}
+		if (ret > 0) // 别的线程在这期间把桶填满了，剩下的还给cc
+			break;
+
+		cur = next;
+	}
+
+	if (cur)
+		CentralCache::GetInstance()->ReleaseListToSpans(cur, alignSize);
+
+	return start;
+}
+
+// 当前cpu的桶满了，弹出一半还给cc
+void CpuCache::ReleaseToCentralCache(size_t index, int cpu)
+{
+	size_t alignSize = _classSize[index];
+	size_t n = (_capacity[index] + 1) / 2;
+
+	char* region = GetRegion(cpu);
+	void* start = nullptr;
+	void* end = nullptr;
+	size_t actualNum = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		void* obj = nullptr;
+		if (RseqPop(&Tops(region)[index], Slots(region, index), &obj, cpu) != 0)
+			break; // 被打断或者被别的线程弹空了，有多少还多少
+
+		ObjNext(obj) = start;
+		start = obj;
+		if (end == nullptr)
+			end = obj;
+		++actualNum;
+	}
+
+	if (actualNum > 0)
+		CentralCache::GetInstance()->InsertRange(start, end, actualNum, alignSize);
+}
+
+// 所有cpu缓存中一共存了多少字节，只是个统计，不需要很精确
+size_t CpuCache::CachedBytes()
+{
+	if (!_inited.load(std::memory_order_acquire))
+		return 0;
+
+	size_t bytes = 0;
+	for (int cpu = 0; cpu < _numCpus; ++cpu)
+	{
+		char* region = _regions[cpu].load(std::memory_order_acquire);
+		if (region == nullptr)
+			continue;
+
+		for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+		{
+			intptr_t top = __atomic_load_n(&Tops(region)[i], __ATOMIC_RELAXED);
+			bytes += top * _classSize[i];
+		}
+	}
+	return bytes;
+}
+
+// 每个桶在所有cpu缓存中一共存了多少块，和CachedBytes一样不需要很精确
+void CpuCache::GetStats(AllocStats& stats)
+{
+	if (!_inited.load(std::memory_order_acquire))
+		return;
+
+	for (int cpu = 0; cpu < _numCpus; ++cpu)
+	{
+		char* region = _regions[cpu].load(std::memory_order_acquire);
+		if (region == nullptr)
+			continue;
+
+		for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+		{
+			intptr_t top = __atomic_load_n(&Tops(region)[i], __ATOMIC_RELAXED);
+			stats._classes[i]._cpuObjs += top;
+			stats._cpuBytes += top * _classSize[i];
+		}
+	}
+}
+
+// 环境变量CMP_PER_CPU_CACHE=1的时候一启动就打开per-cpu模式
+static bool s_perCpuFromEnv = []() {
+	const char* env = getenv("CMP_PER_CPU_CACHE");
+	if (env != nullptr && env[0] == '1')
+		return CpuCache::GetInstance()->SetActive(true);
+	return false;
+}();
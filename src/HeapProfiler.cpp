@@ -0,0 +1,246 @@
+#include"HeapProfiler.h"
+#include"PageCache.h"
+#include<cmath>
+#include<cstdio>
+#include<cstdlib>
+#include<fcntl.h>
+
+#ifdef _WIN32
+#include<io.h>
+#include<sys/stat.h>
+#else
+#include<unistd.h>
+#if __has_include(<execinfo.h>)
+#include<execinfo.h> // backtrace
+#define CMP_HAVE_BACKTRACE
+#endif
+#endif
+
+HeapProfiler HeapProfiler::_sInst; // 单例对象
+
+CMP_THREAD_LOCAL_POD intptr_t t_sampleBytesLeft = 0;
+
+// 当前线程的倒数是不是按采样间隔设的，不是的话就是没开采样的时候隔一段看一下开了没有
+static thread_local bool t_sampling = false;
+static thread_local uint64_t t_rand = 0; // 每个线程自己的随机数状态
+
+// 记一下当前的调用栈，返回有几层，最多max层
+static int CaptureStack(void** stack, int max)
+{
+#if defined(_WIN32)
+	return CaptureStackBackTrace(1, max, stack, nullptr);
+#elif defined(CMP_HAVE_BACKTRACE)
+	// 第一层是SampleAlloc自己，不要
+	void* frames[HEAP_SAMPLE_MAX_DEPTH + 1];
+	int n = backtrace(frames, max + 1);
+	if (n <= 1)
+		return 0;
+	memcpy(stack, frames + 1, (n - 1) * sizeof(void*));
+	return n - 1;
+#else
+	(void)stack;
+	(void)max;
+	return 0;
+#endif
+}
+
+// 写文件都用最底层的接口，不走stdio，写的时候拿着锁，不能再去malloc
+static int OpenForWrite(const char* path)
+{
+#ifdef _WIN32
+	return _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+}
+
+static bool WriteAll(int fd, const char* buf, size_t n)
+{
+	while (n > 0)
+	{
+#ifdef _WIN32
+		int ret = _write(fd, buf, (unsigned int)n);
+#else
+		ssize_t ret = write(fd, buf, n);
+#endif
+		if (ret <= 0)
+			return false;
+		buf += ret;
+		n -= ret;
+	}
+	return true;
+}
+
+static void CloseFile(int fd)
+{
+#ifdef _WIN32
+	_close(fd);
+#else
+	close(fd);
+#endif
+}
+
+// 按指数分布取下一次要倒数多少字节，平均是rate
+intptr_t HeapProfiler::NextInterval(size_t rate)
+{
+	if (t_rand == 0)
+		t_rand = ((uint64_t)(uintptr_t)&t_rand ^ (PageCache::NowMs() * 0x9E3779B97F4A7C15ULL)) | 1;
+
+	// xorshift64，取高53位当成(0,1]里的均匀分布
+	t_rand ^= t_rand << 13;
+	t_rand ^= t_rand >> 7;
+	t_rand ^= t_rand << 17;
+	double u = ((t_rand >> 11) + 1) * (1.0 / 9007199254740992.0);
+
+	double next = -std::log(u) * (double)rate;
+	if (next > (double)(INTPTR_MAX / 2))
+		next = (double)(INTPTR_MAX / 2);
+	return (intptr_t)next + 1;
+}
+
+// 线程的倒数减到负数了
+void* HeapProfiler::SampleAlloc(size_t size, intptr_t& bytesLeft)
+{
+	size_t rate = SampleRate();
+	if (rate == 0)
+	{ // 没开，过一段再来看
+		t_sampling = false;
+		bytesLeft = HEAP_SAMPLE_RECHECK_BYTES;
+		return nullptr;
+	}
+
+	bytesLeft = NextInterval(rate);
+	if (!t_sampling)
+	{ // 刚开(或者这个线程第一次申请)，从现在开始倒数，这一次不采
+		t_sampling = true;
+		return nullptr;
+	}
+
+	// 倒数已经设好了，记调用栈的时候里面再申请内存(比如backtrace第一次用的时候)会走正常的路径，不会又进来
+	void* stack[HEAP_SAMPLE_MAX_DEPTH];
+	int depth = CaptureStack(stack, HEAP_SAMPLE_MAX_DEPTH);
+
+	// 单独要一个span，块放在开头，ConcurrentFree看到_sampled就知道要来这里删记录
+	size_t k = (size + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+	Span* span = PageCache::GetInstance()->NewSpan(k);
+	span->_objSize = size > MAX_BYTES ? size : SizeClass::RoundUp(size); // 和没采到的时候一样，malloc_usable_size要用
+	span->_sampled = true;
+	void* ptr = (void*)(span->_pageID << PAGE_SHIFT);
+
+	std::lock_guard<std::mutex> lock(_mtx);
+	Sample* sample = _samplePool.New();
+	sample->_ptr = ptr;
+	sample->_size = size;
+	sample->_depth = depth;
+	memcpy(sample->_stack, stack, depth * sizeof(void*));
+
+	size_t b = Bucket(ptr);
+	sample->_next = _table[b];
+	_table[b] = sample;
+
+	++_liveSamples;
+	_liveBytes += size;
+	++_totalSamples;
+	_totalBytes += size;
+
+	return ptr;
+}
+
+// 释放采到的块
+void HeapProfiler::SampleFree(void* ptr, Span* span)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		Sample** pos = &_table[Bucket(ptr)];
+		while (*pos != nullptr && (*pos)->_ptr != ptr)
+			pos = &(*pos)->_next;
+
+		assert(*pos != nullptr); // 标了_sampled的span一定有记录
+		Sample* sample = *pos;
+		*pos = sample->_next;
+
+		--_liveSamples;
+		_liveBytes -= sample->_size;
+		_samplePool.Delete(sample);
+	}
+
+	span->_sampled = false;
+	PageCache::GetInstance()->ReleaseSpanToPageCache(span);
+}
+
+/* 写成gperftools的heap profile格式：
+	heap profile: 活着的个数: 活着的字节数 [一共采的个数: 一共采的字节数] @ heap_v2/采样间隔
+	1: 字节数 [1: 字节数] @ 调用栈地址...
+	...
+	MAPPED_LIBRARIES:
+	/proc/self/maps的内容
+ pprof会按采样间隔把采到的数换算回实际的量，同一个调用栈的行会自己加到一起 */
+bool HeapProfiler::DumpHeapProfile(const char* path)
+{
+	int fd = OpenForWrite(path);
+	if (fd < 0)
+		return false;
+
+	bool ok = true;
+	char buf[64 + HEAP_SAMPLE_MAX_DEPTH * 20];
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		int n = snprintf(buf, sizeof(buf), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+			_liveSamples, _liveBytes, _totalSamples, _totalBytes, SampleRate());
+		ok = WriteAll(fd, buf, n);
+
+		for (size_t i = 0; ok && i < HEAP_SAMPLE_BUCKETS; ++i)
+		{
+			for (Sample* sample = _table[i]; ok && sample; sample = sample->_next)
+			{
+				n = snprintf(buf, sizeof(buf), "1: %zu [1: %zu] @", sample->_size, sample->_size);
+				for (int d = 0; d < sample->_depth; ++d)
+					n += snprintf(buf + n, sizeof(buf) - n, " %p", sample->_stack[d]);
+				buf[n++] = '\n';
+				ok = WriteAll(fd, buf, n);
+			}
+		}
+	}
+
+#ifdef __linux__
+	// pprof要靠这一段把地址对到动态库上
+	if (ok)
+	{
+		const char* title = "\nMAPPED_LIBRARIES:\n";
+		ok = WriteAll(fd, title, strlen(title));
+
+		int maps = open("/proc/self/maps", O_RDONLY);
+		if (maps >= 0)
+		{
+			ssize_t r;
+			while (ok && (r = read(maps, buf, sizeof(buf))) > 0)
+				ok = WriteAll(fd, buf, r);
+			close(maps);
+		}
+	}
+#endif
+
+	CloseFile(fd);
+	return ok;
+}
+
+size_t HeapProfiler::LiveSamples()
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	return _liveSamples;
+}
+
+size_t HeapProfiler::LiveBytes()
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	return _liveBytes;
+}
+
+// 环境变量CMP_HEAP_SAMPLE_RATE=bytes的时候一启动就打开堆采样
+static bool s_sampleFromEnv = []() {
+	const char* rate = getenv("CMP_HEAP_SAMPLE_RATE");
+	if (rate == nullptr || atoll(rate) <= 0)
+		return false;
+	HeapProfiler::GetInstance()->SetSampleRate((size_t)atoll(rate));
+	return true;
+}();
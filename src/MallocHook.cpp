@@ -0,0 +1,305 @@
+#include"ConcurrentAlloc.h"
+#include<new>
+#include<cerrno>
+
+/* 把ConcurrentAlloc/ConcurrentFree包成标准库的malloc系列接口和全局的operator new/delete，
+ 编成libcmpmalloc.so之后不用改代码，LD_PRELOAD=libcmpmalloc.so就能直接替换掉glibc的malloc。
+
+ 这些函数在main之前就会被调到(动态链接器、libstdc++的全局构造函数里都会malloc)，
+ 所以pc、cc这些单例都是编译期初始化好的，不依赖全局构造的顺序，这里也不能用到任何会再去调malloc的东西 */
+
+namespace
+{
+	// malloc要保证返回的地址按16字节(max_align_t)对齐，[1,128]这一段是按8字节对齐的，
+	// 所以先按16字节向上取整，拿到的块大小就都是16的倍数，span又是按页对齐的，每一块就都是16字节对齐的
+	// 大小是0的时候也要返回一个能free的指针，就给最小的一块
+	inline size_t MallocSize(size_t size)
+	{
+		if (size == 0)
+			return 16;
+		return (size + 15) & ~(size_t)15;
+	}
+
+	inline void* DoMalloc(size_t size)
+	{
+		if (size > SIZE_MAX - ((size_t)1 << PAGE_SHIFT))
+		{ // 大得离谱的不去找os要了，对齐的时候还会溢出
+			errno = ENOMEM;
+			return nullptr;
+		}
+
+		try
+		{
+			return ConcurrentAlloc(MallocSize(size));
+		}
+		catch (const std::bad_alloc&)
+		{ // 向os要不到内存的时候会抛异常，malloc不能抛，要返回空
+			errno = ENOMEM;
+			return nullptr;
+		}
+	}
+
+	// 按align对齐申请size大小的空间，align必须是2的幂，怎么对齐的见ConcurrentAlignedAlloc
+	// 块大小先按16字节取整，sized delete的时候按同样的规则算回去
+	inline void* DoMemalign(size_t align, size_t size)
+	{
+		if (align <= 16)
+			return DoMalloc(size);
+
+		if (size > SIZE_MAX - align - ((size_t)1 << PAGE_SHIFT))
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+
+		try
+		{
+			return ConcurrentAlignedAlloc(MallocSize(size), align);
+		}
+		catch (const std::bad_alloc&)
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+	}
+
+	inline bool IsPowerOfTwo(size_t n)
+	{
+		return n != 0 && (n & (n - 1)) == 0;
+	}
+
+	// sized delete，size要和申请时一样先按16字节取整，才能落到同一个桶里
+	inline void DoFreeSized(void* ptr, size_t size)
+	{
+		if (ptr == nullptr)
+			return;
+		ConcurrentFree(ptr, MallocSize(size));
+	}
+
+	inline void DoFreeAligned(void* ptr, size_t align, size_t size)
+	{
+		if (ptr == nullptr)
+			return;
+		if (align <= 16)
+			ConcurrentFree(ptr, MallocSize(size));
+		else
+			ConcurrentAlignedFree(ptr, MallocSize(size), align);
+	}
+
+	// ptr实际能用多少字节，小于256KB的是桶里块的大小，大块是当初申请的大小
+	inline size_t UsableSize(void* ptr)
+	{
+		return PageCache::GetInstance()->MapObjectToSpan(ptr)->_objSize;
+	}
+}
+
+extern "C"
+{
+	void* malloc(size_t size) noexcept
+	{
+		return DoMalloc(size);
+	}
+
+	void free(void* ptr) noexcept
+	{
+		if (ptr == nullptr)
+			return;
+		ConcurrentFree(ptr);
+	}
+
+	void* calloc(size_t n, size_t size) noexcept
+	{
+		if (size != 0 && n > SIZE_MAX / size)
+		{ // n * size溢出了
+			errno = ENOMEM;
+			return nullptr;
+		}
+
+		// 还回来的块里可能有脏数据，要清零
+		void* ptr = DoMalloc(n * size);
+		if (ptr)
+			memset(ptr, 0, n * size);
+		return ptr;
+	}
+
+	void* realloc(void* ptr, size_t size) noexcept
+	{
+		if (ptr == nullptr)
+			return DoMalloc(size);
+
+		if (size == 0)
+		{ // 和glibc一样，realloc(ptr, 0)相当于free
+			ConcurrentFree(ptr);
+			return nullptr;
+		}
+
+		if (size > SIZE_MAX - ((size_t)1 << PAGE_SHIFT))
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+
+		// 还在同一个桶里、大块能原地扩的都不用拷贝，和malloc一样先按16字节取整
+		try
+		{
+			return ConcurrentRealloc(ptr, MallocSize(size));
+		}
+		catch (const std::bad_alloc&)
+		{ // 失败了原来的那块不动
+			errno = ENOMEM;
+			return nullptr;
+		}
+	}
+
+	void* memalign(size_t align, size_t size) noexcept
+	{
+		if (!IsPowerOfTwo(align))
+		{
+			errno = EINVAL;
+			return nullptr;
+		}
+		return DoMemalign(align, size);
+	}
+
+	void* aligned_alloc(size_t align, size_t size) noexcept
+	{
+		return memalign(align, size);
+	}
+
+	int posix_memalign(void** memptr, size_t align, size_t size) noexcept
+	{
+		if (!IsPowerOfTwo(align) || align % sizeof(void*) != 0)
+			return EINVAL;
+
+		void* ptr = DoMemalign(align, size);
+		if (ptr == nullptr)
+			return ENOMEM;
+
+		*memptr = ptr;
+		return 0;
+	}
+
+	void* valloc(size_t size) noexcept
+	{
+		return DoMemalign(4096, size);
+	}
+
+	void* pvalloc(size_t size) noexcept
+	{
+		return DoMemalign(4096, (size + 4095) & ~(size_t)4095);
+	}
+
+	size_t malloc_usable_size(void* ptr) noexcept
+	{
+		if (ptr == nullptr)
+			return 0;
+		return UsableSize(ptr);
+	}
+}
+
+// 全局的operator new/delete也换掉，new失败要抛bad_alloc，nothrow版本返回空
+void* operator new(size_t size)
+{
+	void* ptr = DoMalloc(size);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void* operator new[](size_t size)
+{
+	void* ptr = DoMalloc(size);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return DoMalloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return DoMalloc(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	free(ptr);
+}
+
+// C++14的sized delete，编译器会把对象大小传进来，不用再去查span
+void operator delete(void* ptr, size_t size) noexcept
+{
+	DoFreeSized(ptr, size);
+}
+
+void operator delete[](void* ptr, size_t size) noexcept
+{
+	DoFreeSized(ptr, size);
+}
+
+#if __cpp_aligned_new
+// C++17带对齐的new/delete
+void* operator new(size_t size, std::align_val_t align)
+{
+	void* ptr = DoMemalign((size_t)align, size);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void* operator new[](size_t size, std::align_val_t align)
+{
+	void* ptr = DoMemalign((size_t)align, size);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	return DoMemalign((size_t)align, size);
+}
+
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	return DoMemalign((size_t)align, size);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void* ptr, size_t size, std::align_val_t align) noexcept
+{
+	DoFreeAligned(ptr, (size_t)align, size);
+}
+
+void operator delete[](void* ptr, size_t size, std::align_val_t align) noexcept
+{
+	DoFreeAligned(ptr, (size_t)align, size);
+}
+#endif
@@ -1,8 +1,18 @@
 #include"PageCache.h"
+#include"CentralCache.h"
+#include<chrono>
 
-PageCache PageCache::_sInst; // 
+#ifdef __linux__
+#include<sched.h> // sched_getcpu
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/syscall.h> // mbind没有glibc的包装(在libnuma里)，直接走系统调用
+#include<linux/mempolicy.h>
+#endif
 
-// ķһõݹ
+PageCache PageCache::_sInst; // 单例对象
+
+// 解决死锁的方法二，方法一是用递归锁
 //Span* PageCache::NewSpan(size_t k)
 //{
 //	_pageMtx.lock();
@@ -12,40 +22,149 @@ PageCache PageCache::_sInst; // 
 //	return res;
 //}
 
-// pc_spanListsóһkҳspan
-Span* PageCache::NewSpan(size_t k)
+// 当前线程用每段里的哪一个页堆，第一次用的时候轮流分
+static thread_local size_t t_heapStripe = PAGE_HEAP_STRIPES;
+static std::atomic<size_t> s_nextHeapStripe{ 0 };
+
+// 当前线程固定用的NUMA节点，-1就是看当前在哪个cpu上
+static thread_local int t_numaNode = -1;
+
+// node号节点上k页的申请该去哪个页堆
+size_t PageCache::HeapIndex(size_t k, size_t node)
+{
+	// 页数分段：[1,4]、[5,16]、[17,64]、[65,128]，每段是前一段的4倍。
+	// 小块的cc补span基本都在前两段，大于256KB的申请都在后两段
+	static_assert(PAGE_HEAP_RANGES == 4, "HeapIndex中的分段要跟着改");
+	size_t range = k <= 4 ? 0 : k <= 16 ? 1 : k <= 64 ? 2 : 3;
+
+	if (t_heapStripe >= PAGE_HEAP_STRIPES)
+		t_heapStripe = s_nextHeapStripe.fetch_add(1, std::memory_order_relaxed) % PAGE_HEAP_STRIPES;
+
+	return node * PAGE_HEAP_NUM + range * PAGE_HEAP_STRIPES + t_heapStripe;
+}
+
+// 从node号节点拿出来一个k页的span
+Span* PageCache::NewSpan(size_t k, size_t node)
 {
-	// ԭȵassertѾˣһ
-	//// ҳһ[1, PAGE_NUM - 1]Χڵ
+	// 这里原先的assert已经错了，改一下
+	//// 申请页数一定是在[1, PAGE_NUM - 1]这个范围内的
 	//assert(k > 0 && k < PAGE_NUM);
 	assert(k > 0);
 
-	// ҳ128ҳʱҪos룬ûг128ҳĻpc
+	// 如果单次申请的页数超过128页时才需要向os申请，如果没有超过128页的还可以向页堆申请
 	if (k > PAGE_NUM - 1) 
 	{
-		void* ptr = SystemAlloc(k); // ֱos
-		//Span* span = new Span; // һµspanµĿռ
-		Span* span = _spanPool.New(); // öڴؿռ
-		
-		span->_pageID = ((PageID)ptr >> PAGE_SHIFT); // ռĶӦҳ
-		span->_n = k; // ˶ҳ
-		
-		// spanҳӳ䵽ϣУɾspanʱҵ
-		//_idSpanMap[span->_pageID] = span;
-		_idSpanMap.set(span->_pageID, span);
-		// ҪspanpcpcֻܹС128ҳspan
+		return NewLargeSpan(k, 1, node);
+	}
 
-		return span;
+	size_t id = HeapIndex(k, node);
+	std::lock_guard<std::mutex> lock(Heap(id)._mtx);
+
+	Span* span = HeapNewSpan(id, k);
+	// 拿出去的span要在锁里面标记成在用，不然同一个页堆里别的线程还相邻的span的时候会把它当成空闲的合并掉
+	span->_isUse = true;
+	return span;
+}
+
+// 拿一个首页按alignPages页对齐的k页span
+Span* PageCache::NewAlignedSpan(size_t k, size_t alignPages)
+{
+	assert(k > 0 && alignPages > 0 && (alignPages & (alignPages - 1)) == 0);
+	if (alignPages == 1)
+		return NewSpan(k);
+
+	// 多拿alignPages - 1页，里面一定有一段对齐的k页。页堆里的span最多128页，放不下的直接向os要正好k页，
+	// os那边可以直接按对齐要，不用多拿
+	size_t n = k + alignPages - 1;
+	if (n > PAGE_NUM - 1)
+		return NewLargeSpan(k, alignPages, CurrentNode());
+
+	size_t id = HeapIndex(n, CurrentNode());
+	PageHeap& heap = Heap(id);
+	std::lock_guard<std::mutex> lock(heap._mtx);
+
+	Span* span = HeapNewSpan(id, n);
+	span->_isUse = true; // 先标成在用，下面还前后多出来的部分的时候不会和它合并
+
+	// 前面多出来的几页
+	PageID begin = (span->_pageID + alignPages - 1) & ~(PageID)(alignPages - 1);
+	if (begin != span->_pageID)
+	{
+		Span* head = heap._spanPool.New();
+		head->_pageID = span->_pageID;
+		head->_n = begin - span->_pageID;
+		head->_heap = (uint16_t)id;
+		span->_pageID = begin;
+		span->_n -= head->_n;
+		HeapReleaseSpan(id, head);
+	}
+
+	// 后面多出来的几页
+	if (span->_n > k)
+	{
+		Span* tail = heap._spanPool.New();
+		tail->_pageID = span->_pageID + k;
+		tail->_n = span->_n - k;
+		tail->_heap = (uint16_t)id;
+		span->_n = k;
+		HeapReleaseSpan(id, tail);
+	}
+
+	// 留下的这一段的页原来就映射到span上，首页变了，再设一下
+	_idSpanMap.set(span->_pageID, span);
+	return span;
+}
+
+// 直接向os要
+Span* PageCache::NewLargeSpan(size_t k, size_t alignPages, size_t node)
+{
+	void* ptr = SystemAlloc(k, alignPages); // 直接向os申请，不用加页堆的锁
+	if (!_idSpanMap.Ensure((PageID)ptr >> PAGE_SHIFT, k))
+	{ // 基数树的节点开不出来(或者地址超出了基数树能管的范围)，这段地址没法映射，当成申请失败
+		SystemFree(ptr, k);
+		throw std::bad_alloc();
 	}
+	BindToNode(ptr, k, node);
+	//Span* span = new Span; // 开一个新的span，用来管理新的空间
+	Span* span = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(_largeMtx); // 只有span对象池和统计要加锁
+		span = _largeSpanPool.New(); // 用定长内存池开空间
+		++_largeSpans;
+		_largePages += k;
+		++_largeAllocs;
+	}
+	
+	span->_pageID = ((PageID)ptr >> PAGE_SHIFT); // 申请空间的对应页号
+	span->_n = k; // 申请了多少页
+	span->_isUse = true;
+	span->_large = true;
+	span->_heap = (uint16_t)(node * PAGE_HEAP_NUM); // 不属于页堆，只记一下是哪个节点的
+	
+	// 把这个span管理的首页映射到哈希中，后面在删除这个span的时候能找到就行
+	//_idSpanMap[span->_pageID] = span;
+	_idSpanMap.set(span->_pageID, span);
+	// 不需要把这个span让页堆管理，页堆只能管小于128页的span
 
-	//  kͰspan
-	if (!_spanLists[k].Empty())
-	{ // ֱӷظͰеĵһspan
-		Span* span = _spanLists[k].PopFront();
+	return span;
+}
 
-		// ¼ȥspanҳźַӳϵ
-		for (PageID i = 0; i < span->_n; ++i) // עiҪPageIDͣȻ64λº_pageIDӻᱨ
-		{ // nҳĿռȫӳ䶼spanַ
+// 从id号页堆中拿一个k页的span
+Span* PageCache::HeapNewSpan(size_t id, size_t k)
+{
+	NumaNode* node = GetNode(id / PAGE_HEAP_NUM);
+	PageHeap& heap = node->_heaps[id % PAGE_HEAP_NUM];
+
+	// ① k号桶中有span
+	if (!heap._spanLists[k].Empty())
+	{ // 直接返回该桶中的第一个span
+		Span* span = heap._spanLists[k].PopFront();
+		CommitPages(heap, span, span->_n); // 之前还给os的话这里重新要回来
+		span->_isReleased = false;
+
+		// 记录分配出去的span管理的页号和其地址的映射关系
+		for (PageID i = 0; i < span->_n; ++i) // 注意i要PageID类型，不然在64位下和_pageID相加会报警告
+		{ // n页的空间全部映射都是span地址
 			//_idSpanMap[span->_pageID + i] = span;
 			_idSpanMap.set(span->_pageID + i, span);
 		}
@@ -53,41 +172,43 @@ Span* PageCache::NewSpan(size_t k)
 		return span;
 	}
 
-	//  kͰûspanͰspan
-	for (int i = k + 1; i < PAGE_NUM; ++i)
-	{ // [k+1, PAGE_NUM - 1]Ͱûspan
-		if (!_spanLists[i].Empty())
-		{ // iͰspanԸspanз
+	// ② k号桶没有span，但后面的桶中有span
+	for (size_t i = k + 1; i < PAGE_NUM; ++i)
+	{ // [k+1, PAGE_NUM - 1]号桶中有没有span
+		if (!heap._spanLists[i].Empty())
+		{ // i号桶中有span，对该span进行切分
 			
-			// ȡͰеspanͽnSpan
-			Span* nSpan = _spanLists[i].PopFront();
+			// 获取到该桶中的span，起名就叫nSpan
+			Span* nSpan = heap._spanLists[i].PopFront();
 
-			// spanзֳһkҳĺһn-kҳspan
+			// 将这个span切分成一个k页的和一个n-k页的span
 			
-			// SpanĿռҪ½ģõǰڴеĿռ
+			// Span的空间是需要新建的，而不是用当前内存池中的空间
 			//Span* kSpan = new Span;
-			Span* kSpan = _spanPool.New(); // öڴؿռ
+			Span* kSpan = heap._spanPool.New(); // 用定长内存池开空间
 
-			// һkҳspan
+			// 分一个k页的span，nSpan已经还给os的话，前k页要重新要回来，剩下的还是还掉的状态
+			CommitPages(heap, nSpan, k);
 			kSpan->_pageID = nSpan->_pageID;
 			kSpan->_n = k;
+			kSpan->_heap = (uint16_t)id;
 
-			// һ n - k ҳspan
+			// 和一个 n - k 页的span
 			nSpan->_pageID += k;
 			nSpan->_n -= k;
 
-			// n - kҳķŻضӦϣͰ
-			_spanLists[nSpan->_n].PushFront(nSpan);
+			// n - k页的放回对应哈希桶中
+			heap._spanLists[nSpan->_n].PushFront(nSpan);
 
-			// ٰn-kҳspanԵҳӳһ£ϲ
+			// 再把n-k页的span边缘页映射一下，方便后续合并
 			//_idSpanMap[nSpan->_pageID] = nSpan;
 			//_idSpanMap[nSpan->_pageID + nSpan->_n - 1] = nSpan;
 			_idSpanMap.set(nSpan->_pageID, nSpan);
 			_idSpanMap.set(nSpan->_pageID + nSpan->_n - 1, nSpan);
 
-			// ¼ȥkSpanҳźַӳϵ
-			for (PageID i = 0; i < kSpan->_n; ++i) // עiҪPageIDͣȻ64λº_pageIDӻᱨ
-			{ // nҳĿռȫӳ䶼kSpanַ
+			// 记录分配出去的kSpan管理的页号和其地址的映射关系
+			for (PageID i = 0; i < kSpan->_n; ++i) // 注意i要PageID类型，不然在64位下和_pageID相加会报警告
+			{ // n页的空间全部映射都是kSpan地址
 				//_idSpanMap[kSpan->_pageID + i] = kSpan;
 				_idSpanMap.set(kSpan->_pageID + i, kSpan);
 			}
@@ -96,43 +217,92 @@ Span* PageCache::NewSpan(size_t k)
 		}
 	}
 
-	//  kͰͺͰжûspan
+	// ③ k号桶和后面的桶中都没有span
 
-	// ֱϵͳ128ҳspan
-	void* ptr = SystemAlloc(PAGE_NUM - 1); // PAGE_NUMΪ129
-	//cout << ptr << endl;
-	// һµspanάռ
-	//Span* bigSpan = new Span;
-	Span* bigSpan = _spanPool.New(); // öڴؿռ
+	// 先去这个节点的公共池子里拿一整块，别的页堆用不上还回来的
+	Span* bigSpan = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(node->_chunkMtx);
+		if (!node->_chunks.Empty())
+		{
+			bigSpan = node->_chunks.PopFront();
+			++heap._chunkReuses;
+			if (bigSpan->_isReleased)
+			{ // 还给os的页数跟着这一块记到页堆里
+				node->_chunkReleasedPages -= bigSpan->_n;
+				heap._releasedPages += bigSpan->_n;
+			}
+		}
+	}
 
-	/* ֻҪ޸_pageID_n,
-	ϵͳýӿռʱһܱ֤ĿռǶ */
-	bigSpan->_pageID = ((PageID)ptr) >> PAGE_SHIFT;
-	bigSpan->_n = PAGE_NUM - 1;
+	if (bigSpan == nullptr)
+	{ // 池子里也没有，直接向系统申请128页的span
+		// 按整块的大小对齐，这样通过页号就知道在哪一块里，合并的时候不会合到别的页堆的块里去
+		void* ptr = SystemAlloc(PAGE_NUM - 1, PAGE_NUM - 1); // PAGE_NUM为129
+#ifdef _WIN32
+		size_t mappedPages = PAGE_NUM - 1;
+#else
+		size_t mappedPages = SystemMapLength(PAGE_NUM - 1) >> PAGE_SHIFT; // 用显式大页的时候会补齐到整个大页
+#endif
+		// 这些页后面切出来的span都要做映射，所以在这里一次性把基数树的节点开好，开不出来就当成申请失败
+		if (!_idSpanMap.Ensure((PageID)ptr >> PAGE_SHIFT, mappedPages))
+		{
+			SystemFree(ptr, PAGE_NUM - 1);
+			throw std::bad_alloc();
+		}
+		BindToNode(ptr, mappedPages, id / PAGE_HEAP_NUM); // 还没碰过，绑完之后第一次写的时候就会从这个节点分物理页
+		//cout << ptr << endl;
+		// 开一个新的span用来维护这块空间
+		//Span* bigSpan = new Span;
+		bigSpan = heap._spanPool.New(); // 用定长内存池开空间
+
+		/* 只需要修改_pageID和_n即可,
+		系统调用接口申请空间的时候一定能保证申请的空间是对齐的 */
+		bigSpan->_pageID = ((PageID)ptr) >> PAGE_SHIFT;
+		bigSpan->_n = PAGE_NUM - 1;
+		bigSpan->_idleSince = NowMs();
+		++heap._refills;
+
+		heap._mappedPages += mappedPages;
+
+		// 用显式大页的时候一次映射的是整个大页(2MB)，后面多出来的每128页也当成一整块放进这个节点的池子里，
+		// 不然大页的后半截一直空着，vm.nr_hugepages要配成实际用量的两倍
+		for (size_t off = PAGE_NUM - 1; off + PAGE_NUM - 1 <= mappedPages; off += PAGE_NUM - 1)
+		{
+			Span* extra = heap._spanPool.New();
+			extra->_pageID = bigSpan->_pageID + off;
+			extra->_n = PAGE_NUM - 1;
+			extra->_idleSince = bigSpan->_idleSince;
+
+			std::lock_guard<std::mutex> lock(node->_chunkMtx);
+			node->_chunks.PushFront(extra);
+		}
+	}
 
-	// spanŵӦϣͰ
-	_spanLists[PAGE_NUM - 1].PushFront(bigSpan);
+	// 将这个span放到对应哈希桶中
+	bigSpan->_heap = (uint16_t)id;
+	heap._spanLists[PAGE_NUM - 1].PushFront(bigSpan);
 
-	// ݹٴkҳspanεݹһߢڵ߼
-	return NewSpan(k);  // ô
+	// 递归再次申请k页的span，这次递归一定会走①或者②的逻辑
+	return HeapNewSpan(id, k);  // 复用代码
 }
 
-// ͨҳַҵspan
+// 通过页地址找到span
 Span* PageCache::MapObjectToSpan(void* obj)
-{ // ҳspan
+{ // 页号找span
 	
-  // ַͨҵҳ
+  // 通过块地址找到页号
 	PageID id = (((PageID)obj) >> PAGE_SHIFT);
 
-	// һͬѧԿǰĲ
-	//std::unique_lock<std::mutex> lc(_pageMtx); // Ҫ
-	// ͨϣҵҳŶӦspan
+	// 这里用了一下智能锁，不懂的同学可以看我前面的博客
+	//std::unique_lock<std::mutex> lc(_pageMtx); // 不需要加锁了
+	// 通过哈希找到页号对应span
 	//auto ret = _idSpanMap.find(id);
 	auto ret = _idSpanMap.get(id);
-	// ߼һַܱ֤ͨҵһspanģûҵͳ
+	// 这里的逻辑是一定能保证通过块地址找到一个span的，如果没找到就出错了
 	//if (ret != _idSpanMap.end())
 	if (ret != nullptr)
-	{ // retһ
+	{ // 这里ret是一个迭代器
 		return (Span*)ret;
 	}
 	else
@@ -142,97 +312,606 @@ Span* PageCache::MapObjectToSpan(void* obj)
 	}
 }
 
-// ccspan
+// 管理cc还回来的span
 void PageCache::ReleaseSpanToPageCache(Span* span)
 {
-	// ͨspanжͷŵĿռҳǷ128ҳ128ҳֱӻos
-	if (span->_n > PAGE_NUM - 1)
+	// 直接向os要的span(大于128页的都是)直接还给os
+	if (span->_large)
 	{
-		void* ptr = (void*)(span->_pageID << PAGE_SHIFT); // ȡҪͷŵĵַ
-		SystemFree(ptr); // ֱӵϵͳӿͷſռ
-		//delete span; // ͷŵspan
-		_spanPool.Delete(span); // öڴɾspan
+		void* ptr = (void*)(span->_pageID << PAGE_SHIFT); // 获取到要释放的地址
+		// 映射要在还给os之前清掉：还了之后这段地址马上可能被别的线程重新申请到并且建好映射，再清就把人家的清掉了
+		_idSpanMap.set(span->_pageID, nullptr);
+		SystemFree(ptr, span->_n); // 直接调用系统接口释放空间
+		//delete span; // 释放掉span
+		std::lock_guard<std::mutex> lock(_largeMtx);
+		--_largeSpans;
+		_largePages -= span->_n;
+		_largeSpanPool.Delete(span); // 用定长内存池删除span
 
 		return;
 	}
 
-	/**************ĶԭȵĴ룬ҲҳСڵ128ҳspan**************/
-	// 󲻶Ϻϲ
+	// 还回它所属的页堆(可能是别的NUMA节点的)，span还在用，_heap不会变，加锁之前读没问题
+	size_t id = span->_heap;
+	std::lock_guard<std::mutex> lock(Heap(id)._mtx);
+	HeapReleaseSpan(id, span);
+}
+
+// 在用的span扩成k页
+bool PageCache::GrowSpan(Span* span, size_t k)
+{
+	assert(span->_isUse && k > span->_n);
+
+	if (span->_large)
+	{ // 向os要的大span，基数树的节点都要在改映射之前开好，开不出来就不扩，原来的内存不动
+		void* old = (void*)(span->_pageID << PAGE_SHIFT);
+		void* ptr = old;
+		if (!_idSpanMap.Ensure(span->_pageID, k) || !SystemExtend(old, span->_n, k))
+		{ // 原地扩不了，整段挪过去
+			ptr = SystemReserve(k);
+			if (ptr == nullptr)
+				return false;
+			if (!_idSpanMap.Ensure((PageID)ptr >> PAGE_SHIFT, k))
+			{
+				SystemUnreserve(ptr, k);
+				return false;
+			}
+
+			// 只映射了首页，挪地方之前先把映射清掉，理由和ReleaseSpanToPageCache一样
+			_idSpanMap.set(span->_pageID, nullptr);
+			if (!SystemMove(old, span->_n, k, ptr))
+			{
+				SystemUnreserve(ptr, k);
+				_idSpanMap.set(span->_pageID, span);
+				return false;
+			}
+		}
+
+		BindToNode((char*)ptr + (span->_n << PAGE_SHIFT), k - span->_n, span->_heap / PAGE_HEAP_NUM);
+		{
+			std::lock_guard<std::mutex> lock(_largeMtx);
+			_largePages += k - span->_n;
+		}
+		span->_pageID = (PageID)ptr >> PAGE_SHIFT;
+		span->_n = k;
+		_idSpanMap.set(span->_pageID, span);
+		return true;
+	}
+
+	if (k > PAGE_NUM - 1)
+		return false; // 页堆里的span最多128页，再大只能换成向os要的
+
+	size_t id = span->_heap;
+	PageHeap& heap = Heap(id);
+	std::lock_guard<std::mutex> lock(heap._mtx);
+
+	// 和HeapReleaseSpan向右合并的条件一样：不能跨出这一整块，右边的span要是空闲的
+	PageID rightID = span->_pageID + span->_n;
+	if (rightID % (PAGE_NUM - 1) == 0)
+		return false;
+
+	Span* rightSpan = (Span*)_idSpanMap.get(rightID);
+	if (rightSpan == nullptr || rightSpan->_isUse || span->_n + rightSpan->_n < k)
+		return false;
+
+	// 右边的span前面切extra页给span，剩下的放回对应的桶
+	size_t extra = k - span->_n;
+	heap._spanLists[rightSpan->_n].Erase(rightSpan);
+	CommitPages(heap, rightSpan, extra);
+	if (rightSpan->_n > extra)
+	{
+		rightSpan->_pageID += extra;
+		rightSpan->_n -= extra;
+		heap._spanLists[rightSpan->_n].PushFront(rightSpan);
+		_idSpanMap.set(rightSpan->_pageID, rightSpan);
+		_idSpanMap.set(rightSpan->_pageID + rightSpan->_n - 1, rightSpan);
+	}
+	else
+	{
+		heap._spanPool.Delete(rightSpan);
+	}
+
+	for (PageID i = span->_n; i < k; ++i)
+	{ // 新拿过来的页也都映射到span
+		_idSpanMap.set(span->_pageID + i, span);
+	}
+	span->_n = k;
+	return true;
+}
+
+// 一次还好几个span
+void PageCache::ReleaseSpansToPageCache(Span** spans, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (spans[i] == nullptr)
+			continue; // 前面跟着别的span一起还掉了
+
+		// 拿一次页堆的锁，把后面所有属于这个页堆的span一起还掉
+		size_t id = spans[i]->_heap;
+		std::lock_guard<std::mutex> lock(Heap(id)._mtx);
+		for (size_t j = i; j < n; ++j)
+		{
+			if (spans[j] != nullptr && spans[j]->_heap == id)
+			{
+				assert(!spans[j]->_large);
+				HeapReleaseSpan(id, spans[j]);
+				spans[j] = nullptr;
+			}
+		}
+	}
+}
+
+// 把span还到id号页堆
+void PageCache::HeapReleaseSpan(size_t id, Span* span)
+{
+	NumaNode* node = GetNode(id / PAGE_HEAP_NUM);
+	PageHeap& heap = node->_heaps[id % PAGE_HEAP_NUM];
+
+	// span所在的那一整块的页号范围[chunkBegin, chunkEnd)，整块是按128页对齐的，合并不能跨出这一块
+	PageID chunkBegin = span->_pageID / (PAGE_NUM - 1) * (PAGE_NUM - 1);
+	PageID chunkEnd = chunkBegin + PAGE_NUM - 1;
+
+	// 向左不断合并
 	while (1)
 	{
-		PageID leftID = span->_pageID - 1; // õҳ
-		auto ret = _idSpanMap.get(leftID); // ͨҳӳӦspan
+		// 已经到这一块的最左边了，再往左是别的块(可能属于别的页堆)，停止合并
+		if (span->_pageID == chunkBegin)
+		{
+			break;
+		}
+
+		PageID leftID = span->_pageID - 1; // 拿到左边相邻页
+		auto ret = _idSpanMap.get(leftID); // 通过相邻页映射出对应span
 		
-		// ûspanֹͣϲ
+		// 没有相邻span，停止合并
 		if (ret == nullptr)
 		{
 			break;
 		}
 
-		Span* leftSpan = (Span*)ret; // span
-		// spanccУֹͣϲ
+		Span* leftSpan = (Span*)ret; // 相邻span
+		// 相邻span在cc中，停止合并
 		if (leftSpan->_isUse == true)
 		{
 			break;
 		}
 
-		// span뵱ǰspanϲ󳬹128ҳֹͣϲ
+		// 相邻span与当前span合并后超过128页，停止合并
 		if (leftSpan->_n + span->_n > PAGE_NUM - 1)
 		{
 			break;
 		}
 
-		// ǰspanspanкϲ
+		// 当前span与相邻span进行合并，合并之后的span算是没还给os的，相邻span已经还掉的那部分要重新要回来
+		// (Linux下什么都不用做)，之后闲够了会被再还一次
+		CommitPages(heap, leftSpan, leftSpan->_n);
 		span->_pageID = leftSpan->_pageID;
 		span->_n += leftSpan->_n;
 
-		_spanLists[leftSpan->_n].Erase(leftSpan);// spanͰɾ
-		//delete leftSpan;// ɾspan
-		_spanPool.Delete(leftSpan); // öڴɾspan
+		heap._spanLists[leftSpan->_n].Erase(leftSpan);// 将相邻span对象从桶中删掉
+		//delete leftSpan;// 删除掉相邻span对象
+		heap._spanPool.Delete(leftSpan); // 用定长内存池删除span
 	}
 
-	// ҲϺϲ
+	// 向右不断合并
 	while (1)
 	{
-		PageID rightID = span->_pageID + span->_n; // ұߵҳ
-		auto it = _idSpanMap.get(rightID); // ͨҳҵӦspanӳϵ
+		PageID rightID = span->_pageID + span->_n; // 右边的相邻页
 
-		// ûspanֹͣϲ
+		// 已经到这一块的最右边了，停止合并
+		if (rightID == chunkEnd)
+		{
+			break;
+		}
+
+		auto it = _idSpanMap.get(rightID); // 通过相邻页找到对应span映射关系
+
+		// 没有相邻span，停止合并
 		if (it == nullptr)
 		{
 			break;
 		}
 
-		Span* rightSpan = (Span*)it; // ұߵspan
-		// spanccУֹͣϲ
+		Span* rightSpan = (Span*)it; // 右边的span
+		// 相邻span在cc中，停止合并
 		if (rightSpan->_isUse == true)
 		{
 			break;
 		}
 
-		// span뵱ǰspanϲ󳬹128ҳֹͣϲ
+		// 相邻span与当前span合并后超过128页，停止合并
 		if (rightSpan->_n + span->_n > PAGE_NUM - 1)
 		{
 			break;
 		}
 
-		// ǰspanspanкϲ
-		span->_n += rightSpan->_n; // ұߺϲʱҪspan->_pageID
-								   // ұߵĻֱƴspan
+		// 当前span与相邻span进行合并
+		CommitPages(heap, rightSpan, rightSpan->_n);
+		span->_n += rightSpan->_n; // 往右边合并时不需要改span->_pageID，
+								   // 右边的会直接拼在span后面
 
-		// Ͱspanɾ
-		_spanLists[rightSpan->_n].Erase(rightSpan);
-		//delete rightSpan; // ɾұspanĿռ
-		_spanPool.Delete(rightSpan); // öڴɾspan
+		// 把桶里面的span删掉
+		heap._spanLists[rightSpan->_n].Erase(rightSpan);
+		//delete rightSpan; // 删掉右边span对象的空间
+		heap._spanPool.Delete(rightSpan); // 用定长内存池删除span
 	}
 
-	// ϲϣǰspanҵӦͰ
-	_spanLists[span->_n].PushFront(span);
-	span->_isUse = false; // ccصpcisUseĳfalse
+	span->_isUse = false; // 从cc返回到pc，isUse改成false
+	span->_isReleased = false;
+	span->_idleSince = NowMs(); // 从现在开始算闲置时间
 
-	// ӳ䵱ǰspanıԵҳԶspanϲ
+	// 映射当前span的边缘页，后续还可以对这个span合并
 	/*_idSpanMap[span->_pageID] = span; 
 	_idSpanMap[span->_pageID + span->_n - 1] = span;*/
 	_idSpanMap.set(span->_pageID, span);
 	_idSpanMap.set(span->_pageID + span->_n - 1, span);
+
+	// 整块都合并回来了，页堆里已经留了一块备用的话，这一块交给这个节点的公共池子给别的页堆用
+	if (span->_n == PAGE_NUM - 1 && !heap._spanLists[PAGE_NUM - 1].Empty())
+	{
+		std::lock_guard<std::mutex> lock(node->_chunkMtx);
+		node->_chunks.PushFront(span);
+		return;
+	}
+
+	// 合并完毕，将当前span挂到对应桶中
+	heap._spanLists[span->_n].PushFront(span);
 }
+
+// 单调时钟，ms
+uint64_t PageCache::NowMs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 把pc中闲了至少minIdleMs毫秒的span的物理内存还给os
+size_t PageCache::ReleaseIdleSpans(size_t bytes, uint64_t minIdleMs)
+{
+	uint64_t now = NowMs();
+	size_t released = 0;
+
+	for (size_t n = 0; n < NUMA_MAX_NODES && released < bytes; ++n)
+	{
+		NumaNode* node = _nodes[n].load(std::memory_order_acquire);
+		if (node == nullptr)
+			continue;
+
+		// 先还公共池子里的整块，这些是暂时没有页堆要的
+		{
+			std::lock_guard<std::mutex> lock(node->_chunkMtx);
+			released += ReleaseIdleList(node->_chunks, bytes - released, minIdleMs, now, node->_chunkReleasedPages);
+		}
+
+		// 再一个一个页堆地还，每次只拿一个页堆的锁
+		for (size_t h = 0; h < PAGE_HEAP_NUM && released < bytes; ++h)
+		{
+			PageHeap& heap = node->_heaps[h];
+			std::lock_guard<std::mutex> lock(heap._mtx);
+
+			// 从大的span开始还，一次madvise能还得多，也不容易被马上拿去用
+			for (size_t i = PAGE_NUM - 1; i > 0 && released < bytes; --i)
+				released += ReleaseIdleList(heap._spanLists[i], bytes - released, minIdleMs, now, heap._releasedPages);
+		}
+	}
+
+	return released;
+}
+
+// 把list中闲了至少minIdleMs毫秒的span还给os
+size_t PageCache::ReleaseIdleList(SpanList& list, size_t bytes, uint64_t minIdleMs, uint64_t now, size_t& releasedPages)
+{
+	size_t released = 0;
+	for (Span* span = list.Begin(); span != list.End() && released < bytes; span = span->_next)
+	{
+		if (span->_isReleased || now - span->_idleSince < minIdleMs)
+			continue;
+
+		if (!SystemRelease((void*)(span->_pageID << PAGE_SHIFT), span->_n))
+			continue; // 没还掉，还是算占着物理内存
+		span->_isReleased = true;
+		releasedPages += span->_n;
+		released += span->_n << PAGE_SHIFT;
+	}
+
+	return released;
+}
+
+// 现在有多少字节已经还给os了
+size_t PageCache::ReleasedBytes()
+{
+	size_t pages = 0;
+	for (auto& slot : _nodes)
+	{
+		NumaNode* node = slot.load(std::memory_order_acquire);
+		if (node == nullptr)
+			continue;
+
+		{
+			std::lock_guard<std::mutex> lock(node->_chunkMtx);
+			pages += node->_chunkReleasedPages;
+		}
+
+		for (auto& heap : node->_heaps)
+		{
+			std::lock_guard<std::mutex> lock(heap._mtx);
+			pages += heap._releasedPages;
+		}
+	}
+
+	return pages << PAGE_SHIFT;
+}
+
+// pc这一层的统计
+void PageCache::GetStats(AllocStats& stats)
+{
+	// 一个SpanList里的span都数一遍，已经还给os的单独记
+	auto countList = [&stats](SpanList& list)
+	{
+		for (Span* span = list.Begin(); span != list.End(); span = span->_next)
+		{
+			++stats._pages[span->_n]._spans;
+			stats._pageFreeBytes += span->_n << PAGE_SHIFT;
+			if (span->_isReleased)
+				++stats._pages[span->_n]._releasedSpans;
+		}
+	};
+
+	size_t mappedPages = 0;
+	size_t releasedPages = 0;
+	for (size_t i = 0; i < NUMA_MAX_NODES; ++i)
+	{
+		NumaNode* node = _nodes[i].load(std::memory_order_acquire);
+		if (node == nullptr)
+			continue;
+
+		if (node != &_node0) // 别的节点的页堆是单独向os要的
+			stats._metadataBytes += ((sizeof(NumaNode) + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT) << PAGE_SHIFT;
+
+		for (auto& heap : node->_heaps)
+		{
+			std::lock_guard<std::mutex> lock(heap._mtx);
+			for (size_t k = 1; k < PAGE_NUM; ++k)
+				countList(heap._spanLists[k]);
+
+			mappedPages += heap._mappedPages;
+			releasedPages += heap._releasedPages;
+			stats._pageRefills += heap._refills;
+			stats._chunkReuses += heap._chunkReuses;
+			stats._metadataBytes += heap._spanPool.ReservedBytes();
+			stats._spanObjects += heap._spanPool.InUse();
+		}
+
+		std::lock_guard<std::mutex> lock(node->_chunkMtx);
+		countList(node->_chunks);
+		releasedPages += node->_chunkReleasedPages;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_largeMtx);
+		stats._largeSpans += _largeSpans;
+		stats._largeBytes += _largePages << PAGE_SHIFT;
+		stats._largeAllocs += _largeAllocs;
+		mappedPages += _largePages;
+		stats._metadataBytes += _largeSpanPool.ReservedBytes();
+		stats._spanObjects += _largeSpanPool.InUse();
+	}
+
+	stats._mappedBytes += mappedPages << PAGE_SHIFT;
+	stats._releasedBytes += releasedPages << PAGE_SHIFT;
+}
+
+// node号节点的页堆
+NumaNode* PageCache::GetNode(size_t node)
+{
+	NumaNode* res = _nodes[node].load(std::memory_order_acquire);
+	if (res != nullptr)
+		return res;
+
+	std::lock_guard<std::mutex> lock(_nodeMtx);
+	res = _nodes[node].load(std::memory_order_relaxed);
+	if (res == nullptr)
+	{ // 页堆本身也在这个节点的内存上，不走malloc
+		size_t kpage = (sizeof(NumaNode) + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+		void* ptr = SystemAlloc(kpage);
+		BindToNode(ptr, kpage, node);
+		res = new(ptr) NumaNode;
+		_nodes[node].store(res, std::memory_order_release);
+	}
+
+	return res;
+}
+
+// 现在有几个NUMA节点
+size_t PageCache::NumaNodes()
+{
+	if (!_numaInited.load(std::memory_order_acquire))
+		InitNuma();
+	return _numNodes.load(std::memory_order_relaxed);
+}
+
+// 假装有n个NUMA节点
+void PageCache::FakeNumaNodes(size_t n)
+{
+	if (!_numaInited.load(std::memory_order_acquire))
+		InitNuma();
+
+	std::lock_guard<std::mutex> lock(_nodeMtx);
+	if (n > 1)
+	{
+		_numaFake.store(true, std::memory_order_relaxed);
+		_numNodes.store(n < NUMA_MAX_NODES ? n : NUMA_MAX_NODES, std::memory_order_relaxed);
+	}
+	else
+	{
+		_numaFake.store(false, std::memory_order_relaxed);
+		_numNodes.store(_sysNodes, std::memory_order_relaxed);
+	}
+}
+
+// 当前线程固定从node号节点拿内存
+void PageCache::SetThreadNumaNode(int node)
+{
+	t_numaNode = node < (int)NUMA_MAX_NODES ? node : (int)NUMA_MAX_NODES - 1;
+}
+
+// 当前线程在哪个NUMA节点上
+size_t PageCache::CurrentNode()
+{
+	if (t_numaNode >= 0)
+		return (size_t)t_numaNode;
+
+	size_t nodes = NumaNodes();
+	if (nodes == 1)
+		return 0; // 不是NUMA的机器，和原来一样只有一组页堆
+
+#ifdef __linux__
+	// 线程随时可能被换到别的cpu上，所以每次都重新看一下，sched_getcpu走vdso，很便宜
+	int cpu = sched_getcpu();
+	if (cpu < 0)
+		return 0;
+	if (_numaFake.load(std::memory_order_relaxed))
+		return (size_t)cpu % nodes;
+	return (size_t)cpu < NUMA_MAX_CPUS ? _cpuToNode[cpu] : 0;
+#else
+	return 0;
+#endif
+}
+
+#ifdef __linux__
+// 把sysfs里的一个小文件读到buf里，这里可能是在malloc里面调过来的，不能用fopen(它自己会malloc)
+static bool ReadSysFile(const char* path, char* buf, size_t len)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	ssize_t n = read(fd, buf, len - 1);
+	close(fd);
+	if (n <= 0)
+		return false;
+	buf[n] = '\0';
+	return true;
+}
+
+// 解析"0-3,8-11"这种格式的编号列表，每个编号调一次f
+template<class F>
+static void ParseIdList(const char* s, F f)
+{
+	while (*s >= '0' && *s <= '9')
+	{
+		size_t first = strtoul(s, (char**)&s, 10);
+		size_t last = first;
+		if (*s == '-')
+			last = strtoul(s + 1, (char**)&s, 10);
+		for (size_t i = first; i <= last; ++i)
+			f(i);
+		if (*s == ',')
+			++s;
+	}
+}
+#endif
+
+// 第一次用的时候读一下机器的NUMA拓扑
+void PageCache::InitNuma()
+{
+	std::lock_guard<std::mutex> lock(_nodeMtx);
+	if (_numaInited.load(std::memory_order_relaxed))
+		return;
+
+#ifdef __linux__
+	// /sys/devices/system/node/online里是在线的节点，每个节点的cpulist是它上面的cpu，读不到就当成只有一个节点
+	char buf[4096];
+	size_t nodes = 1;
+	if (ReadSysFile("/sys/devices/system/node/online", buf, sizeof(buf)))
+	{
+		ParseIdList(buf, [&](size_t node) {
+			if (node < NUMA_MAX_NODES && node + 1 > nodes)
+				nodes = node + 1;
+		});
+	}
+
+	for (size_t node = 0; node < nodes && nodes > 1; ++node)
+	{
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist", node);
+		if (!ReadSysFile(path, buf, sizeof(buf)))
+			continue;
+		ParseIdList(buf, [&](size_t cpu) {
+			if (cpu < NUMA_MAX_CPUS)
+				_cpuToNode[cpu] = (uint8_t)node;
+		});
+	}
+	_sysNodes = nodes;
+	_numNodes.store(nodes, std::memory_order_relaxed);
+#endif
+
+	// 没有NUMA的机器上假装有好几个节点，测试用
+	const char* fake = getenv("CMP_NUMA_FAKE_NODES");
+	if (fake != nullptr && atoi(fake) > 1)
+	{
+		size_t n = (size_t)atoi(fake);
+		_numaFake.store(true, std::memory_order_relaxed);
+		_numNodes.store(n < NUMA_MAX_NODES ? n : NUMA_MAX_NODES, std::memory_order_relaxed);
+	}
+
+	_numaInited.store(true, std::memory_order_release);
+}
+
+// 把刚向os要的kpage页绑到node号节点上
+void PageCache::BindToNode(void* ptr, size_t kpage, size_t node)
+{
+#ifdef __linux__
+	// 假装的节点和单节点的机器不用绑，真实的节点用MPOL_PREFERRED：优先从这个节点分，
+	// 这个节点的内存用完了还可以去别的节点要，不会像MPOL_BIND那样直接OOM
+	if (_numaFake.load(std::memory_order_relaxed) || node >= _sysNodes || _sysNodes == 1)
+		return;
+
+	unsigned long mask = 1UL << node;
+	syscall(SYS_mbind, ptr, kpage << PAGE_SHIFT, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0); // 失败了也只是没绑上
+#else
+	(void)ptr;
+	(void)kpage;
+	(void)node;
+#endif
+}
+
+// 设置后台回收的速度，第一次打开的时候起线程
+void PageCache::SetBackgroundRelease(size_t bytesPerSec, uint64_t minIdleMs)
+{
+	_releaseAge.store(minIdleMs, std::memory_order_relaxed);
+	_releaseRate.store(bytesPerSec, std::memory_order_relaxed);
+
+	// 线程起来之后就一直在，速度为0的时候只是空转，分离掉不用管它退出
+	if (bytesPerSec != 0 && !_releaseThreadStarted.exchange(true))
+		std::thread([this]() { BackgroundReleaseLoop(); }).detach();
+}
+
+// 后台回收线程，每秒醒一次
+void PageCache::BackgroundReleaseLoop()
+{
+	while (true)
+	{
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+
+		size_t rate = _releaseRate.load(std::memory_order_relaxed);
+		if (rate != 0)
+		{
+			// 中转站里一秒都没人碰的批先还给span，空出来的span在pc里闲够了再还给os
+			CentralCache::GetInstance()->ReleaseTransferCaches(true);
+			ReleaseIdleSpans(rate, _releaseAge.load(std::memory_order_relaxed));
+		}
+	}
+}
+
+// 环境变量CMP_RELEASE_RATE=每秒还多少字节的时候一启动就打开后台回收，
+// CMP_RELEASE_AGE_MS是闲了多久才还，默认10秒
+static bool s_releaseFromEnv = []() {
+	const char* rate = getenv("CMP_RELEASE_RATE");
+	if (rate == nullptr || atoll(rate) <= 0)
+		return false;
+
+	const char* age = getenv("CMP_RELEASE_AGE_MS");
+	PageCache::GetInstance()->SetBackgroundRelease((size_t)atoll(rate), age ? (uint64_t)atoll(age) : 10000);
+	return true;
+}();
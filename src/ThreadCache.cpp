@@ -1,96 +1,394 @@
 #include"ThreadCache.h"
 #include"CentralCache.h"
+#include"PageCache.h"
 
-// ߳tcsizeСĿռ
+ObjectPool<ThreadCache> ThreadCache::_tcPool; // tc的对象池
+ObjectPool<RemoteFreeList> ThreadCache::_remotePool; // 远程释放队列的对象池
+RemoteFreeList* ThreadCache::_sFreeRemotes = nullptr;
+ThreadCache* ThreadCache::_sHead = nullptr;
+size_t ThreadCache::_sBudget = THREAD_CACHE_BUDGET_BYTES;
+long long ThreadCache::_sUnclaimed = THREAD_CACHE_BUDGET_BYTES;
+std::mutex ThreadCache::_sListMtx;
+size_t ThreadCache::_sRetiredFetches[FREE_LIST_NUM] = { 0 };
+size_t ThreadCache::_sRetiredReleases[FREE_LIST_NUM] = { 0 };
+std::atomic<uint64_t> ThreadCache::_sActiveClock{ 0 };
+
+// 线程向tc申请size大小的空间
 void* ThreadCache::Allocate(size_t size)
 {
-	assert(size <= MAX_BYTES); // tcеֻ벻256KBĿռ
+	assert(size <= MAX_BYTES); // tc中单次只能申请不超过256KB的空间
 
-	size_t alignSize = SizeClass::RoundUp(size); // sizeֽ
-	size_t index = SizeClass::Index(size); // sizeӦڹϣеĸͰ
+	size_t index = SizeClass::Index(size); // size对应在哈希表中的哪个桶
+	size_t alignSize = SizeClass::ClassSize(index); // size对齐后的字节数，桶的下标查出来了直接按下标拿
 
 	if (!_freeLists[index].Empty())
-	{ // вΪգֱӴлȡռ
+	{ // 自由链表中不为空，可以直接从自由链表中获取空间
+		_size -= alignSize;
 		return _freeLists[index].Pop();
 	}
 	else
-	{ // ΪգҪ ThreadCache  CentralCache ռ
-		return FetchFromCentralCache(index, alignSize); // Ϊɶὲ
+	{ // 自由链表为空，得要让 ThreadCache 向 CentralCache 申请空间
+		return FetchFromCentralCache(index, alignSize); // 至于为啥是这两个参数后面会讲到
 	}
 }
 
-// ߳дСΪsizeobjռ
+// 回收线程中大小为size的obj空间
 void ThreadCache::Deallocate(void* obj, size_t size)
 {
-	assert(obj); // տռ䲻Ϊ
-	assert(size <= MAX_BYTES); // տռСܳ256KB
+	assert(obj); // 回收空间不能为空
+	assert(size <= MAX_BYTES); // 回收空间大小不能超过256KB
 
-	size_t index = SizeClass::Index(size); // ҵsizeӦ
-	_freeLists[index].Push(obj); // öӦտռ
+	size_t index = SizeClass::Index(size); // 找到size对应的自由链表
+	_freeLists[index].Push(obj); // 用对应自由链表回收空间
+	_size += SizeClass::ClassSize(index);
 
-	// ǰͰеĿڵڵʱ黹ռ
+	// 当前桶中的块数大于等于单批次申请块数的时候归还空间
 	if (_freeLists[index].Size() >= _freeLists[index].MaxSize())
 	{
 		ListTooLong(_freeLists[index], size);
 	}
+
+	// 整个tc缓存的太多了
+	if (_size > _maxBytes.load(std::memory_order_relaxed))
+	{
+		Scavenge();
+	}
 }
 
-// ThreadCacheпռ䲻ʱCentralCacheռĽӿ
+// ThreadCache中空间不够时，向CentralCache申请空间的接口
 void* ThreadCache::FetchFromCentralCache(size_t index, size_t alignSize)
 {
+	MarkActive(); // 走慢路径的时候顺便记一下活动时间，快路径上不做
+
+	// 别的线程还回来的先拿回来用，有的话这次就不用找cc了
+	if (ReclaimRemote(index) > 0)
+	{
+		_size -= alignSize;
+		return _freeLists[index].Pop();
+	}
+
+	_freeLists[index].CountFetch();
+
 #ifdef WIN32
-	// ͨMaxSizeNumMoveSieƵǰtcṩٿalignSizeСĿռ
-	size_t batchNum = min(_freeLists[index].MaxSize(), SizeClass::NumMoveSize(alignSize));
-		/*MaxSizeʾindexλõδʱܹռǶ*/
-		/*NumMoveSizeʾtcccalignSizeСĿռǶ*/
-		/*ȡСõľǱҪtcṩٿalignSizeСĿռ*/
-		/*˵alignSizeΪ8BMaxSizeΪ1NumMoveSizeΪ512ǾҪһ8BĿռ*/
-		/*Ҳû޾͸MaxSize޾͸޵NumMoveSize*/
+	// 通过MaxSize和NumMoveSie来控制当前给tc提供多少块alignSize大小的空间
+	size_t batchNum = min(_freeLists[index].MaxSize(), SizeClass::BatchSize(index));
+		/*MaxSize表示index位置的自由链表单次申请未到上限时，能够申请的最大块空间是多少*/
+		/*NumMoveSize表示tc单次向cc申请alignSize大小的空间块的最多块数是多少*/
+		/*二者取小，得到的就是本次要给tc提供多少块alignSize大小的空间*/
+		/*比如说alignSize为8B，MaxSize为1，NumMoveSize为512，那就要给一块8B的空间*/
+		/*也就是没到上限就给MaxSize，到了上限就给上限的NumMoveSize*/
 #else
-	// ϵͳеstd
-	size_t batchNum = std::min(_freeLists[index].MaxSize(), SizeClass::NumMoveSize(alignSize));
+	// 其他系统中的用std
+	size_t batchNum = std::min(_freeLists[index].MaxSize(), SizeClass::BatchSize(index));
 #endif // WIN32
 
 	if (batchNum == _freeLists[index].MaxSize())
-	{ //ûеޣ´ռʱԶһ
-		_freeLists[index].MaxSize()++; // ´ζһ
-		// ʼڵĺ
+	{ //如果没有到达上限，那下次再申请这块空间的时候可以多申请一块
+		_freeLists[index].MaxSize()++; // 下次多给一块
+		// 这里就是慢开始反馈调节的核心
 	}
 
-	/*ʼ㷨*/
+	/*上面就是慢开始反馈调节算法*/
 
-	// Ͳ֮ĽtcҪĿռ
+	// 输出型参数，返回之后的结果就是tc想要的空间
 	void* start = nullptr;
 	void* end = nullptr;
 
-	// ֵΪʵʻȡĿ
-	size_t actulNum = CentralCache::GetInstance()->FetchRangeObj(start, end, batchNum, alignSize);
+	// 返回值为实际获取到的块数
+	size_t actulNum = CentralCache::GetInstance()->FetchRangeObj(start, end, batchNum, alignSize, _remote);
 	
-	assert(actulNum >= 1); //actualNumһǴڵ1ģFetchRangeObjܱ֤
+	assert(actulNum >= 1); //actualNum一定是大于等于1的，这是FetchRangeObj能保证的
 
 	if (actulNum == 1)
-	{ // actulNum1ֱӽstartظ߳
+	{ // 如果actulNum等于1，就直接将start返回给线程
 		assert(start == end);
 		return start;
 	}
 	else
-	{ // actulNum1ͻҪtcӦλò[ObjNext(start), end]Ŀռ
+	{ // 如果actulNum大于1，就还要给tc对应位置插入[ObjNext(start), end]的空间
 		_freeLists[index].PushRange(ObjNext(start), end, actulNum - 1);
+		_size += (actulNum - 1) * alignSize;
 
-		// ̷߳startָռ
+		// 给线程返回start所指空间
 		return start;
 	}
 }
 
-// tccc黹ռ
+// 别的线程还到index号桶远程释放队列里的块都拿回来放进自由链表
+size_t ThreadCache::ReclaimRemote(size_t index)
+{
+	void* end = nullptr;
+	size_t n = 0;
+	void* start = _remote->TakeAll(index, end, n);
+	if (start == nullptr)
+		return 0;
+
+	_freeLists[index].PushRange(start, end, n);
+	_size += n * SizeClass::ClassSize(index);
+	return n;
+}
+
+// 所有远程释放队列里的块都还给cc
+void ThreadCache::ReleaseRemote()
+{
+	for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+	{
+		void* end = nullptr;
+		size_t n = 0;
+		void* start = _remote->TakeAll(i, end, n);
+		if (start)
+			CentralCache::GetInstance()->ReleaseListToSpans(start, SizeClass::ClassSize(i));
+	}
+}
+
+// tc向cc归还空间
 void ThreadCache::ListTooLong(FreeList& list, size_t size)
 { 
 	void* start = nullptr;
 	void* end = nullptr;
 
-	// ȡMaxSizeռ
-	list.PopRange(start, end, list.MaxSize());
+	// 一次最多还一整批(NumMoveSize块)，这样还回去的正好能放进cc的中转站，
+	// 别的线程来要的时候可以整批拿走。注意这里要和FetchFromCentralCache一样按对齐后的大小算
+	size_t index = SizeClass::Index(size);
+	size_t alignSize = SizeClass::ClassSize(index);
+#ifdef WIN32
+	size_t n = min(list.MaxSize(), SizeClass::BatchSize(index));
+#else
+	size_t n = std::min(list.MaxSize(), SizeClass::BatchSize(index));
+#endif // WIN32
+	list.PopRange(start, end, n);
+	_size -= n * alignSize;
+	list.CountRelease();
+
+	// 归还空间
+	CentralCache::GetInstance()->InsertRange(start, end, n, alignSize);
+}
+
+// 缓存的字节数超过上限了，每个桶还一半给cc
+void ThreadCache::Scavenge()
+{
+	MarkActive();
+	ReleaseRemote(); // 已经缓存得太多了，别的线程还回来的不要了
+
+	for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+	{
+		FreeList& list = _freeLists[i];
+		if (list.Empty())
+			continue;
+
+		size_t n = (list.Size() + 1) / 2;
+		size_t alignSize = SizeClass::ClassSize(i);
+		void* start = nullptr;
+		void* end = nullptr;
+		list.PopRange(start, end, n);
+		_size -= n * alignSize;
+		list.CountRelease();
+		CentralCache::GetInstance()->InsertRange(start, end, n, alignSize);
+
+		// 慢开始的上限也减半，不然马上又会涨回去
+		if (list.MaxSize() > 1)
+			list.MaxSize() /= 2;
+	}
+
+	IncreaseCacheLimit();
+}
+
+// 上限加THREAD_CACHE_STEAL_BYTES：总预算还有剩的就从预算里拿，没有就从最久没活动的tc那里偷
+void ThreadCache::IncreaseCacheLimit()
+{
+	std::lock_guard<std::mutex> lock(_sListMtx);
+
+	size_t maxBytes = _maxBytes.load(std::memory_order_relaxed);
+	if (_sUnclaimed < 0)
+	{ // 预算被调小了，先把自己多出来的还回去
+		if (maxBytes >= THREAD_CACHE_MIN_BYTES + THREAD_CACHE_STEAL_BYTES)
+		{
+			_maxBytes.store(maxBytes - THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed);
+			_sUnclaimed += THREAD_CACHE_STEAL_BYTES;
+		}
+		return;
+	}
+
+	if (maxBytes + THREAD_CACHE_STEAL_BYTES > THREAD_CACHE_MAX_BYTES)
+		return; // 已经到单个tc的上限了
+
+	if (_sUnclaimed >= (long long)THREAD_CACHE_STEAL_BYTES)
+	{
+		_sUnclaimed -= THREAD_CACHE_STEAL_BYTES;
+		_maxBytes.store(maxBytes + THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed);
+		return;
+	}
+
+	// 预算用完了，找最久没活动的、还有得偷的tc
+	ThreadCache* victim = FindVictim(this);
+	if (victim == nullptr || victim->_lastActive.load(std::memory_order_relaxed) >= _lastActive.load(std::memory_order_relaxed))
+		return; // 别的tc都比自己活跃，不偷
+
+	// 只改它的上限，它自己的空间等它下次Deallocate发现超了再自己还(别的线程不能碰它的自由链表)
+	victim->_maxBytes.fetch_sub(THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed);
+	_maxBytes.store(maxBytes + THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed);
+}
+
+// 找最久没活动的、上限还有得偷的tc
+ThreadCache* ThreadCache::FindVictim(ThreadCache* except)
+{
+	ThreadCache* victim = nullptr;
+	for (ThreadCache* tc = _sHead; tc; tc = tc->_next)
+	{
+		if (tc == except || tc->_maxBytes.load(std::memory_order_relaxed) < THREAD_CACHE_MIN_BYTES + THREAD_CACHE_STEAL_BYTES)
+			continue;
+		if (victim == nullptr || tc->_lastActive.load(std::memory_order_relaxed) < victim->_lastActive.load(std::memory_order_relaxed))
+			victim = tc;
+	}
+	return victim;
+}
+
+// 线程退出时把所有自由链表中剩下的空间都还给cc
+void ThreadCache::ReleaseAll()
+{
+	// 先把远程释放队列关掉，之后别的线程就不会再往里挂了
+	for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+	{
+		void* start = _remote->Close(i);
+		if (start)
+			CentralCache::GetInstance()->ReleaseListToSpans(start, SizeClass::ClassSize(i));
+	}
+
+	for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+	{
+		FreeList& list = _freeLists[i];
+		if (list.Empty())
+			continue;
+
+		void* start = nullptr;
+		void* end = nullptr;
+		list.PopRange(start, end, list.Size());
+
+		// 桶里的块都是同一个大小，随便找一块对应的span就知道块大小了
+		size_t size = PageCache::GetInstance()->MapObjectToSpan(start)->_objSize;
+		CentralCache::GetInstance()->ReleaseListToSpans(start, size);
+	}
+	_size = 0;
+}
+
+// 从对象池中拿一个tc
+ThreadCache* ThreadCache::Create()
+{
+	_tcPool._poolMtx.lock();
+	ThreadCache* tc = _tcPool.New();
+	_tcPool._poolMtx.unlock();
+
+	// 挂到活着的tc链表上，从预算里拿最少的那一份。预算不够就先从最久没活动的tc那里把多出来的额度收回来，
+	// 大家都只剩最少的那一份了也还是要给(这时候最多超出线程数 * THREAD_CACHE_MIN_BYTES)
+	std::lock_guard<std::mutex> lock(_sListMtx);
+	while (_sUnclaimed < (long long)THREAD_CACHE_MIN_BYTES)
+	{
+		ThreadCache* victim = FindVictim(nullptr);
+		if (victim == nullptr)
+			break;
+		victim->_maxBytes.fetch_sub(THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed);
+		_sUnclaimed += THREAD_CACHE_STEAL_BYTES;
+	}
+
+	// 远程释放队列先用退出了的tc留下的，重新打开；没有再新开一个
+	if (_sFreeRemotes)
+	{
+		tc->_remote = _sFreeRemotes;
+		_sFreeRemotes = _sFreeRemotes->_nextFree;
+		tc->_remote->Open();
+	}
+	else
+	{
+		_tcPool._poolMtx.lock();
+		tc->_remote = _remotePool.New();
+		_tcPool._poolMtx.unlock();
+	}
+
+	tc->_maxBytes.store(THREAD_CACHE_MIN_BYTES, std::memory_order_relaxed);
+	_sUnclaimed -= THREAD_CACHE_MIN_BYTES;
+	tc->MarkActive();
+
+	tc->_next = _sHead;
+	if (_sHead)
+		_sHead->_prev = tc;
+	_sHead = tc;
+
+	return tc;
+}
+
+// 把tc中的空间还给cc，再把tc还给对象池
+void ThreadCache::Destroy(ThreadCache* tc)
+{
+	tc->ReleaseAll(); // 先在锁外面把空间还给cc
+
+	// 从活着的tc链表上摘下来，上限还给预算
+	{
+		std::lock_guard<std::mutex> lock(_sListMtx);
+		_sUnclaimed += tc->_maxBytes.load(std::memory_order_relaxed);
+
+		// 计数留下来，统计的时候还要算上
+		for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+		{
+			_sRetiredFetches[i] += tc->_freeLists[i].Fetches();
+			_sRetiredReleases[i] += tc->_freeLists[i].Releases();
+		}
+
+		// 队列已经关了，留给下一个tc用
+		tc->_remote->_nextFree = _sFreeRemotes;
+		_sFreeRemotes = tc->_remote;
+
+		if (tc->_prev)
+			tc->_prev->_next = tc->_next;
+		else
+			_sHead = tc->_next;
+		if (tc->_next)
+			tc->_next->_prev = tc->_prev;
+	}
+
+	_tcPool._poolMtx.lock();
+	_tcPool.Delete(tc);
+	_tcPool._poolMtx.unlock();
+}
+
+// 调整所有tc加起来的预算，调小了的话各个tc超出的部分会在它们下次Scavenge的时候慢慢还回来
+void ThreadCache::SetBudget(size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(_sListMtx);
+	_sUnclaimed += (long long)bytes - (long long)_sBudget;
+	_sBudget = bytes;
+}
+
+// 所有tc的上限加起来现在一共是多少
+size_t ThreadCache::ClaimedBytes()
+{
+	std::lock_guard<std::mutex> lock(_sListMtx);
+	return (size_t)((long long)_sBudget - _sUnclaimed);
+}
+
+// 所有tc的统计，别的线程的自由链表只读块数和计数，不碰链表本身
+void ThreadCache::GetStats(AllocStats& stats)
+{
+	std::lock_guard<std::mutex> lock(_sListMtx);
+	for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+	{
+		stats._classes[i]._centralFetches += _sRetiredFetches[i];
+		stats._classes[i]._centralReleases += _sRetiredReleases[i];
+	}
+
+	for (ThreadCache* tc = _sHead; tc; tc = tc->_next)
+	{
+		++stats._threadCaches;
+		for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+		{
+			FreeList& list = tc->_freeLists[i];
+			stats._classes[i]._threadObjs += list.Size();
+			stats._classes[i]._remoteObjs += tc->_remote->_counts[i].load(std::memory_order_relaxed);
+			stats._classes[i]._centralFetches += list.Fetches();
+			stats._classes[i]._centralReleases += list.Releases();
+		}
+	}
 
-	// 黹ռ
-	CentralCache::GetInstance()->ReleaseListToSpans(start, size);
+	_tcPool._poolMtx.lock();
+	stats._metadataBytes += _tcPool.ReservedBytes() + _remotePool.ReservedBytes();
+	_tcPool._poolMtx.unlock();
 }
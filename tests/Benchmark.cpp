@@ -1,7 +1,7 @@
 //#include"ConcurrentAlloc.h"
 //
-//// ntimes һͷڴĴ
-//// rounds ִ
+//// ntimes 一轮申请和释放内存的次数
+//// rounds 轮次
 //void BenchmarkMalloc(size_t ntimes, size_t nworks, size_t rounds)
 //{
 //	std::vector<std::thread> vthread(nworks);
@@ -43,18 +43,18 @@
 //		t.join();
 //	}
 //
-//	printf("%uִ̲߳%uִΣÿִmalloc %u: ѣ",
+//	printf("%u个线程并发执行%u轮次，每轮次malloc %u次: 花费：",
 //		nworks, rounds, ntimes); cout << malloc_costtime << "ms" << endl;
 //
-//	printf("%uִ̲߳%uִΣÿִfree %u: ѣ",
+//	printf("%u个线程并发执行%u轮次，每轮次free %u次: 花费：",
 //		nworks, rounds, ntimes); cout << free_costtime << "ms" << endl;
 //
-//	printf("%u̲߳malloc&free %uΣܼƻѣ",
+//	printf("%u个线程并发malloc&free %u次，总计花费：",
 //		nworks, nworks * rounds * ntimes); cout << malloc_costtime + free_costtime << "ms" << endl;
 //}
 //
 //
-//// ִͷŴ ߳ ִ
+//// 单轮次申请释放次数 线程数 轮次
 //void BenchmarkConcurrentMalloc(size_t ntimes, size_t nworks, size_t rounds)
 //{
 //	std::vector<std::thread> vthread(nworks);
@@ -96,13 +96,13 @@
 //		t.join();
 //	}
 //
-//	printf("%uִ̲߳%uִΣÿִmalloc %u: ѣ",
+//	printf("%u个线程并发执行%u轮次，每轮次malloc %u次: 花费：",
 //		nworks, rounds, ntimes); cout << malloc_costtime << "ms" << endl;
 //
-//	printf("%uִ̲߳%uִΣÿִfree %u: ѣ",
+//	printf("%u个线程并发执行%u轮次，每轮次free %u次: 花费：",
 //		nworks, rounds, ntimes); cout << free_costtime << "ms" << endl;
 //
-//	printf("%u̲߳malloc&free %uΣܼƻѣ",
+//	printf("%u个线程并发malloc&free %u次，总计花费：",
 //		nworks, nworks * rounds * ntimes); cout << malloc_costtime + free_costtime << "ms" << endl;
 //}
 //
@@ -119,43 +119,238 @@
 //	return 0;
 //}
 #include"ConcurrentAlloc.h"
+#include"ConcurrentAllocator.h"
+#include<condition_variable>
+#include<map>
+#include<unordered_map>
+#include<chrono>
+#include<random>
+#include<algorithm>
+#include<string>
+#include<cmath>
+#if defined(__x86_64__) || defined(_M_X64)
+#ifdef _MSC_VER
+#include<intrin.h>
+#else
+#include<x86intrin.h>
+#endif
+#define CMP_BENCH_TSC
+#endif
 
-// ntimes һͷڴĴ
-// rounds ִ
-void BenchmarkMalloc(size_t ntimes, size_t nworks, size_t rounds)
+/* 申请释放的基准测试，编出来是bin/bench。
+ 原来的测试用clock()计时，那是进程的cpu时间，多线程的时候是所有线程加起来的，线程越多看起来越慢；
+ 而且只测了4个线程、固定16字节。现在：
+ 1. 线程数和申请大小的分布都可以扫一遍，大小分布有fixed(固定16B)、uniform(1~8KB均匀)、
+	lognormal(中位数64B左右的对数正态，和一般程序差不多)、mixed(大部分小块，夹着5%大于256KB的大块)
+ 2. 每个线程手上一直拿着一圈块，每一步释放最老的那块再申请一块新的，吞吐按墙上时间算
+ 3. 每隔几次申请释放单独计一次时，x86-64上用TSC，别的平台用steady_clock，算出分位数
+ 4. 同一次运行里用同样的大小序列再跑一遍glibc的malloc/free做对比(这个程序没有LD_PRELOAD的话malloc就是glibc的)
+ 5. 结果可以输出成CSV或者JSON，方便存下来看变化
+
+ 用法：bench [--threads 1,2,4,8] [--dists fixed,uniform,lognormal,mixed] [--ops 每个线程的次数]
+			[--live 每个线程手上拿着的块数] [--format text|csv|json] [--out 文件] [--legacy] [--object-pool] [--containers]
+ --legacy会在后面接着跑原来那几个专项测试(前端对比、SizeClass、pc大块)
+ --object-pool按--threads的线程数对比并发定长内存池、加锁的ObjectPool和new/delete
+ --containers按--threads的线程数对比map、unordered_map、pmr::map用ConcurrentAllocator和用标准库默认分配器的增删 */
+
+// 计时：x86-64上用TSC，开始的时候对着steady_clock校准一下每个tick多少ns
+struct BenchClock
 {
-	std::vector<std::thread> vthread(nworks);
-	std::atomic<size_t> malloc_costtime = 0;
-	std::atomic<size_t> free_costtime = 0;
+	double _nsPerTick = 1.0;
+	double _overheadNs = 0; // 计一次时本身要多久，算延迟的时候减掉
+
+	static uint64_t Now()
+	{
+#ifdef CMP_BENCH_TSC
+		return __rdtsc();
+#else
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	void Calibrate()
+	{
+#ifdef CMP_BENCH_TSC
+		auto begin = std::chrono::steady_clock::now();
+		uint64_t t0 = Now();
+		while (std::chrono::steady_clock::now() - begin < std::chrono::milliseconds(50))
+		{}
+		uint64_t t1 = Now();
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+		_nsPerTick = ns / (double)(t1 - t0);
+#endif
+		// 连着计两次时的差，取最小的那次
+		double best = 1e9;
+		for (int i = 0; i < 1000; ++i)
+		{
+			uint64_t a = Now();
+			uint64_t b = Now();
+			best = std::min(best, (double)(b - a) * _nsPerTick);
+		}
+		_overheadNs = best;
+	}
+};
+
+static BenchClock s_clock;
+
+// 申请大小的分布
+enum class SizeDist
+{
+	Fixed,
+	Uniform,
+	LogNormal,
+	Mixed,
+};
+
+static const char* DistName(SizeDist dist)
+{
+	switch (dist)
+	{
+	case SizeDist::Fixed: return "fixed";
+	case SizeDist::Uniform: return "uniform";
+	case SizeDist::LogNormal: return "lognormal";
+	default: return "mixed";
+	}
+}
+
+// 按分布生成n个申请大小，两种分配器用同一组
+static std::vector<size_t> GenSizes(SizeDist dist, size_t n, size_t seed)
+{
+	std::mt19937_64 rng(seed);
+	std::uniform_int_distribution<size_t> uniform(1, 8 * 1024);
+	std::lognormal_distribution<double> lognormal(4.0, 1.5); // e^4大概是55B
+	std::uniform_int_distribution<size_t> small(1, 1024);
+	std::uniform_int_distribution<size_t> large(MAX_BYTES + 1, 4 * MAX_BYTES);
+	std::uniform_int_distribution<int> percent(0, 99);
+
+	std::vector<size_t> sizes(n);
+	for (auto& size : sizes)
+	{
+		switch (dist)
+		{
+		case SizeDist::Fixed:
+			size = 16;
+			break;
+		case SizeDist::Uniform:
+			size = uniform(rng);
+			break;
+		case SizeDist::LogNormal:
+			size = std::min((size_t)lognormal(rng) + 1, MAX_BYTES);
+			break;
+		case SizeDist::Mixed:
+			size = percent(rng) < 5 ? large(rng) : small(rng);
+			break;
+		}
+	}
+	return sizes;
+}
+
+// 被测的分配器
+struct BenchAllocator
+{
+	const char* _name;
+	void* (*_alloc)(size_t);
+	void (*_free)(void*);
+};
+
+static void* CmpAlloc(size_t size) { return ConcurrentAlloc(size); }
+static void CmpFree(void* ptr) { ConcurrentFree(ptr); }
+static void* SysAlloc(size_t size) { return malloc(size); }
+static void SysFree(void* ptr) { free(ptr); }
 
+static const BenchAllocator s_allocators[] = {
+	{ "cmp", CmpAlloc, CmpFree },
+	{ "glibc", SysAlloc, SysFree },
+};
+
+// 一次测试的结果
+struct BenchResult
+{
+	std::string _allocator;
+	std::string _dist;
+	size_t _threads = 0;
+	size_t _ops = 0; // 所有线程一共多少次申请+释放
+	double _seconds = 0;
+	double _mops = 0; // 每秒百万次
+	double _alloc[4] = {}; // 申请延迟的p50、p90、p99、p99.9，ns
+	double _free[4] = {}; // 释放延迟的分位数
+};
+
+static const size_t BENCH_SAMPLE_EVERY = 16; // 每多少次单独计一次时
+static const double BENCH_PERCENTILES[4] = { 0.50, 0.90, 0.99, 0.999 };
+
+// 排好序的延迟里取分位数，ns
+static void Percentiles(std::vector<uint32_t>& ticks, double out[4])
+{
+	if (ticks.empty())
+		return;
+	std::sort(ticks.begin(), ticks.end());
+	for (int i = 0; i < 4; ++i)
+	{
+		size_t pos = std::min((size_t)(BENCH_PERCENTILES[i] * ticks.size()), ticks.size() - 1);
+		out[i] = std::max(0.0, ticks[pos] * s_clock._nsPerTick - s_clock._overheadNs);
+	}
+}
+
+// nworks个线程用alloc跑ops次申请+释放，每个线程手上一直拿着live块
+static BenchResult RunBench(const BenchAllocator& alloc, SizeDist dist, size_t nworks, size_t ops, size_t live)
+{
+	std::vector<std::vector<size_t>> sizes(nworks);
+	for (size_t k = 0; k < nworks; ++k)
+		sizes[k] = GenSizes(dist, ops, k + 1);
+
+	std::vector<std::vector<uint32_t>> allocTicks(nworks), freeTicks(nworks);
+	std::vector<std::chrono::steady_clock::time_point> begins(nworks), ends(nworks);
+	std::atomic<size_t> ready{ 0 };
+
+	std::vector<std::thread> vthread(nworks);
 	for (size_t k = 0; k < nworks; ++k)
 	{
-		vthread[k] = std::thread([&]() {
-			std::vector<void*> v;
-			v.reserve(ntimes);
+		vthread[k] = std::thread([&, k]() {
+			const std::vector<size_t>& mySizes = sizes[k];
+			std::vector<void*> ring(live, nullptr);
+			allocTicks[k].reserve(ops / BENCH_SAMPLE_EVERY + 1);
+			freeTicks[k].reserve(ops / BENCH_SAMPLE_EVERY + 1);
 
-			for (size_t j = 0; j < rounds; ++j)
+			// 所有线程都准备好了再一起开始
+			ready.fetch_add(1);
+			while (ready.load() < nworks)
+				std::this_thread::yield();
+
+			begins[k] = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < ops; ++i)
 			{
-				size_t begin1 = clock();
-				for (size_t i = 0; i < ntimes; i++)
+				void*& slot = ring[i % live];
+				if (i % BENCH_SAMPLE_EVERY == 0)
 				{
-					v.push_back(malloc(16));
-					//v.push_back(malloc((16 + i) % 8192 + 1));
+					if (slot)
+					{
+						uint64_t t0 = BenchClock::Now();
+						alloc._free(slot);
+						uint64_t t1 = BenchClock::Now();
+						freeTicks[k].push_back((uint32_t)std::min<uint64_t>(t1 - t0, UINT32_MAX));
+					}
+					uint64_t t0 = BenchClock::Now();
+					slot = alloc._alloc(mySizes[i]);
+					uint64_t t1 = BenchClock::Now();
+					allocTicks[k].push_back((uint32_t)std::min<uint64_t>(t1 - t0, UINT32_MAX));
 				}
-				size_t end1 = clock();
-
-				size_t begin2 = clock();
-				for (size_t i = 0; i < ntimes; i++)
+				else
 				{
-					free(v[i]);
+					if (slot)
+						alloc._free(slot);
+					slot = alloc._alloc(mySizes[i]);
 				}
-				size_t end2 = clock();
-				v.clear();
-
-				malloc_costtime += (end1 - begin1);
-				free_costtime += (end2 - begin2);
+				*(char*)slot = (char)i; // 碰一下，免得申请了不用
+			}
+			for (auto e : ring)
+			{
+				if (e)
+					alloc._free(e);
 			}
-			});
+			ends[k] = std::chrono::steady_clock::now();
+		});
 	}
 
 	for (auto& t : vthread)
@@ -163,78 +358,584 @@ void BenchmarkMalloc(size_t ntimes, size_t nworks, size_t rounds)
 		t.join();
 	}
 
-	printf("%uִ̲߳%uִΣÿִmalloc %u: ѣ%u ms\n",
-		nworks, rounds, ntimes, malloc_costtime.load());
+	BenchResult res;
+	res._allocator = alloc._name;
+	res._dist = DistName(dist);
+	res._threads = nworks;
+	res._ops = 2 * nworks * ops;
+	res._seconds = std::chrono::duration<double>(*std::max_element(ends.begin(), ends.end())
+		- *std::min_element(begins.begin(), begins.end())).count();
+	res._mops = res._ops / res._seconds / 1e6;
 
-	printf("%uִ̲߳%uִΣÿִfree %u: ѣ%u ms\n",
-		nworks, rounds, ntimes, free_costtime.load());
+	std::vector<uint32_t> all;
+	for (auto& v : allocTicks)
+		all.insert(all.end(), v.begin(), v.end());
+	Percentiles(all, res._alloc);
+	all.clear();
+	for (auto& v : freeTicks)
+		all.insert(all.end(), v.begin(), v.end());
+	Percentiles(all, res._free);
 
-	printf("%u̲߳malloc&free %uΣܼƻѣ%u ms\n",
-		nworks, nworks * rounds * ntimes, malloc_costtime.load() + free_costtime.load());
+	return res;
 }
 
+// 结果按格式输出成字符串
+static std::string FormatResults(const std::vector<BenchResult>& results, const std::string& format)
+{
+	std::string out;
+	char buf[512];
 
-// ִͷŴ ߳ ִ
-void BenchmarkConcurrentMalloc(size_t ntimes, size_t nworks, size_t rounds)
+	if (format == "csv")
+	{
+		out = "allocator,dist,threads,ops,seconds,mops,alloc_p50_ns,alloc_p90_ns,alloc_p99_ns,alloc_p999_ns,"
+			"free_p50_ns,free_p90_ns,free_p99_ns,free_p999_ns\n";
+		for (auto& r : results)
+		{
+			snprintf(buf, sizeof(buf), "%s,%s,%zu,%zu,%.6f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+				r._allocator.c_str(), r._dist.c_str(), r._threads, r._ops, r._seconds, r._mops,
+				r._alloc[0], r._alloc[1], r._alloc[2], r._alloc[3], r._free[0], r._free[1], r._free[2], r._free[3]);
+			out += buf;
+		}
+	}
+	else if (format == "json")
+	{
+		snprintf(buf, sizeof(buf), "{\"ns_per_tick\":%.6f,\"timer_overhead_ns\":%.1f,\"results\":[",
+			s_clock._nsPerTick, s_clock._overheadNs);
+		out = buf;
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			auto& r = results[i];
+			snprintf(buf, sizeof(buf), "%s{\"allocator\":\"%s\",\"dist\":\"%s\",\"threads\":%zu,\"ops\":%zu,\"seconds\":%.6f,\"mops\":%.3f,"
+				"\"alloc_ns\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f},"
+				"\"free_ns\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f}}",
+				i == 0 ? "" : ",", r._allocator.c_str(), r._dist.c_str(), r._threads, r._ops, r._seconds, r._mops,
+				r._alloc[0], r._alloc[1], r._alloc[2], r._alloc[3], r._free[0], r._free[1], r._free[2], r._free[3]);
+			out += buf;
+		}
+		out += "]}\n";
+	}
+	else
+	{
+		out = "allocator  dist       threads      Mops/s   alloc p50/p99/p99.9 ns     free p50/p99/p99.9 ns\n";
+		for (auto& r : results)
+		{
+			snprintf(buf, sizeof(buf), "%-10s %-10s %7zu %11.2f   %6.0f %7.0f %8.0f     %6.0f %7.0f %8.0f\n",
+				r._allocator.c_str(), r._dist.c_str(), r._threads, r._mops,
+				r._alloc[0], r._alloc[2], r._alloc[3], r._free[0], r._free[2], r._free[3]);
+			out += buf;
+		}
+	}
+	return out;
+}
+
+// "1,2,4"这样的拆开
+static std::vector<std::string> SplitList(const std::string& s)
 {
-	std::vector<std::thread> vthread(nworks);
-	std::atomic<size_t> malloc_costtime = 0;
-	std::atomic<size_t> free_costtime = 0;
+	std::vector<std::string> res;
+	size_t begin = 0;
+	while (begin <= s.size())
+	{
+		size_t end = s.find(',', begin);
+		if (end == std::string::npos)
+			end = s.size();
+		if (end > begin)
+			res.push_back(s.substr(begin, end - begin));
+		begin = end + 1;
+	}
+	return res;
+}
 
+// 当前进程的常驻内存(RSS)有多少字节
+static size_t CurrentRSS()
+{
+#ifdef _WIN32
+	return 0;
+#else
+	size_t pages = 0, rss = 0;
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (fp == nullptr)
+		return 0;
+	if (fscanf(fp, "%zu %zu", &pages, &rss) != 2)
+		rss = 0;
+	fclose(fp);
+	return rss * 4096;
+#endif
+}
+
+// 对比per-thread(tc)和per-cpu两种前端：nworks个线程各自申请释放ntimes次之后都停下来闲着，
+// 这时看一下进程的内存，线程越多tc模式下囤在各个线程缓存里的内存就越多
+void BenchmarkFrontEnd(size_t ntimes, size_t nworks, size_t rounds, bool perCpu)
+{
+	if (ConcurrentSetPerCpuCache(perCpu) != perCpu)
+	{
+		printf("per-cpu模式不可用\n");
+		return;
+	}
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	size_t finished = 0; // 跑完的线程数
+	bool exit = false; // 主线程看完内存之后通知线程退出
+
+	size_t rssBegin = CurrentRSS();
+	auto begin = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> vthread(nworks);
 	for (size_t k = 0; k < nworks; ++k)
 	{
 		vthread[k] = std::thread([&]() {
 			std::vector<void*> v;
 			v.reserve(ntimes);
-
 			for (size_t j = 0; j < rounds; ++j)
 			{
-				size_t begin1 = clock();
 				for (size_t i = 0; i < ntimes; i++)
 				{
-					v.push_back(ConcurrentAlloc(16));
-					//v.push_back(ConcurrentAlloc((16 + i) % 8192 + 1));
+					v.push_back(ConcurrentAlloc((16 + i) % 1024 + 1));
 				}
-				size_t end1 = clock();
-
-				size_t begin2 = clock();
 				for (size_t i = 0; i < ntimes; i++)
 				{
 					ConcurrentFree(v[i]);
 				}
-				size_t end2 = clock();
 				v.clear();
+			}
+
+			// 跑完了就闲着，缓存里的东西还留着
+			std::unique_lock<std::mutex> lock(mtx);
+			++finished;
+			cv.notify_all();
+			cv.wait(lock, [&]() { return exit; });
+		});
+	}
+
+	std::unique_lock<std::mutex> lock(mtx);
+	cv.wait(lock, [&]() { return finished == nworks; });
+	auto end = std::chrono::steady_clock::now();
+	size_t rssEnd = CurrentRSS();
+	size_t cpuCached = CpuCache::GetInstance()->CachedBytes();
+	exit = true;
+	cv.notify_all();
+	lock.unlock();
+
+	for (auto& t : vthread)
+	{
+		t.join();
+	}
+
+	double ms = std::chrono::duration<double, std::milli>(end - begin).count();
+	double ops = 2.0 * nworks * rounds * ntimes / (ms / 1000);
+	printf("%s %zu个线程: 耗时%.1f ms, %.2f Mops/s, RSS增长%.1f MB, cpu缓存%.1f MB\n",
+		perCpu ? "per-cpu   " : "per-thread", nworks, ms, ops / 1e6,
+		(double)(rssEnd - rssBegin) / (1 << 20), (double)cpuCached / (1 << 20));
+
+	ConcurrentSetPerCpuCache(false);
+}
+
+// 原来SizeClass里区间比较的写法，留一份在这里和查表的对比
+struct OldSizeClass
+{
+	static inline size_t _Index(size_t size, size_t align_shift)
+	{
+		return ((size + (1 << align_shift) - 1) >> align_shift) - 1;
+	}
+
+	static size_t RoundUp(size_t size)
+	{
+		if (size <= 128)
+			return SizeClass::_RoundUp(size, 8);
+		else if (size <= 1024)
+			return SizeClass::_RoundUp(size, 16);
+		else if (size <= 8 * 1024)
+			return SizeClass::_RoundUp(size, 128);
+		else if (size <= 64 * 1024)
+			return SizeClass::_RoundUp(size, 1024);
+		else
+			return SizeClass::_RoundUp(size, 8 * 1024);
+	}
+
+	static size_t Index(size_t size)
+	{
+		static int group_array[4] = { 16, 56, 56, 56 };
+		if (size <= 128)
+			return _Index(size, 3);
+		else if (size <= 1024)
+			return _Index(size - 128, 4) + group_array[0];
+		else if (size <= 8 * 1024)
+			return _Index(size - 1024, 7) + group_array[1] + group_array[0];
+		else if (size <= 64 * 1024)
+			return _Index(size - 8 * 1024, 10) + group_array[2] + group_array[1] + group_array[0];
+		else
+			return _Index(size - 64 * 1024, PAGE_SHIFT) + group_array[3] + group_array[2] + group_array[1] + group_array[0];
+	}
+};
+
+// RoundUp+Index单次调用的耗时，tc每次Allocate都要算这两个
+// size是随机的，小块多大块少，区间比较的写法分支预测会经常猜错
+void BenchmarkSizeClass(size_t ntimes)
+{
+	std::vector<size_t> sizes(4096);
+	size_t seed = 1;
+	for (auto& size : sizes)
+	{
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		size_t r = seed >> 33;
+		size = r % 4 == 0 ? r % MAX_BYTES + 1 : r % 1024 + 1;
+#ifndef CMP_SIZE_CLASS_HEADER // 用生成的表的时候桶就不一样了
+		assert(SizeClass::Index(size) == OldSizeClass::Index(size));
+		assert(SizeClass::RoundUp(size) == OldSizeClass::RoundUp(size));
+#endif
+	}
+
+	volatile size_t sink = 0;
+
+	auto begin1 = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < ntimes; ++i)
+	{
+		size_t size = sizes[i & 4095];
+		sink = sink + OldSizeClass::RoundUp(size) + OldSizeClass::Index(size);
+	}
+	auto end1 = std::chrono::steady_clock::now();
+
+	auto begin2 = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < ntimes; ++i)
+	{
+		size_t size = sizes[i & 4095];
+		size_t index = SizeClass::Index(size);
+		sink = sink + SizeClass::ClassSize(index) + index;
+	}
+	auto end2 = std::chrono::steady_clock::now();
+
+	double ns1 = std::chrono::duration<double, std::nano>(end1 - begin1).count() / ntimes;
+	double ns2 = std::chrono::duration<double, std::nano>(end2 - begin2).count() / ntimes;
+	printf("SizeClass RoundUp+Index %zu次: 区间比较 %.2f ns/次, 查表 %.2f ns/次\n", ntimes, ns1, ns2);
+}
+
+// 大块申请为主的负载下pc的扩展性：nworks个线程各自反复申请释放(256KB, 1MB]的大块，
+// 这些都是直接找pc要的，每次申请释放都要拿一次pc的锁。顺便夹一些小块，让cc也会去pc补span
+void BenchmarkPageCache(size_t ntimes, size_t nworks)
+{
+	auto begin = std::chrono::steady_clock::now();
 
-				malloc_costtime += (end1 - begin1);
-				free_costtime += (end2 - begin2);
+	std::vector<std::thread> vthread(nworks);
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread[k] = std::thread([&, k]() {
+			size_t seed = k + 1;
+			std::vector<void*> v;
+			for (size_t i = 0; i < ntimes; ++i)
+			{
+				seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+				size_t r = seed >> 33;
+				size_t size = r % 8 == 0 ? r % 4096 + 1 : MAX_BYTES + 1 + r % (3 * MAX_BYTES);
+				v.push_back(ConcurrentAlloc(size));
+				if (v.size() >= 8)
+				{ // 手上最多留8块
+					ConcurrentFree(v[r % v.size()]);
+					v[r % v.size()] = v.back();
+					v.pop_back();
+				}
 			}
-			});
+			for (auto e : v)
+				ConcurrentFree(e);
+		});
+	}
+
+	for (auto& t : vthread)
+	{
+		t.join();
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	double ms = std::chrono::duration<double, std::milli>(end - begin).count();
+	printf("pc大块申请释放 %zu个线程: 耗时%.1f ms, %.2f Mops/s\n",
+		nworks, ms, 2.0 * nworks * ntimes / (ms / 1000) / 1e6);
+}
+
+// 定长对象的三种拿法对比：并发定长内存池、外面包一把锁的ObjectPool、new/delete
+// 每个线程手上一直拿着一圈节点，每一步还掉最老的再拿一个新的，隔几步把一个节点交给下一个线程去还
+struct BenchNode
+{
+	size_t _val = 0;
+	BenchNode* _left = nullptr;
+	BenchNode* _right = nullptr;
+};
+
+static ObjectPool<BenchNode> s_lockedPool;
+
+template<class NewFn, class DeleteFn>
+static double RunObjectPool(size_t ntimes, size_t nworks, NewFn newNode, DeleteFn deleteNode)
+{
+	const size_t live = 256;
+	std::vector<std::vector<BenchNode*>> handoff(nworks); // 交给下一个线程还的
+	std::vector<std::mutex> handoffMtx(nworks);
+
+	auto begin = std::chrono::steady_clock::now();
+	std::vector<std::thread> vthread(nworks);
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread[k] = std::thread([&, k]() {
+			std::vector<BenchNode*> ring(live, nullptr);
+			for (size_t i = 0; i < ntimes; ++i)
+			{
+				BenchNode*& slot = ring[i % live];
+				if (slot)
+				{
+					if (i % 64 == 0)
+					{
+						std::lock_guard<std::mutex> lock(handoffMtx[(k + 1) % nworks]);
+						handoff[(k + 1) % nworks].push_back(slot);
+					}
+					else
+						deleteNode(slot);
+				}
+				slot = newNode();
+				slot->_val = i;
+			}
+			for (auto e : ring)
+				deleteNode(e);
+		});
+	}
+	for (auto& t : vthread)
+	{
+		t.join();
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	for (auto& v : handoff)
+		for (auto e : v)
+			deleteNode(e);
+
+	return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+void BenchmarkObjectPool(size_t ntimes, size_t nworks)
+{
+	double ms1 = RunObjectPool(ntimes, nworks,
+		[]() { return ConcurrentObjectPool<BenchNode>::New(); },
+		[](BenchNode* node) { ConcurrentObjectPool<BenchNode>::Delete(node); });
+	double ms2 = RunObjectPool(ntimes, nworks,
+		[]() { std::lock_guard<std::mutex> lock(s_lockedPool._poolMtx); return s_lockedPool.New(); },
+		[](BenchNode* node) { std::lock_guard<std::mutex> lock(s_lockedPool._poolMtx); s_lockedPool.Delete(node); });
+	double ms3 = RunObjectPool(ntimes, nworks,
+		[]() { return new BenchNode; },
+		[](BenchNode* node) { delete node; });
+
+	double ops = 2.0 * nworks * ntimes / 1e6;
+	printf("定长对象 %zu个线程: 并发定长内存池%.1f ms(%.2f Mops/s), 加锁的ObjectPool %.1f ms(%.2f Mops/s), new/delete %.1f ms(%.2f Mops/s)\n",
+		nworks, ms1, ops / (ms1 / 1000), ms2, ops / (ms2 / 1000), ms3, ops / (ms3 / 1000));
+}
+
+// 容器用的分配器只把释放换成不带size的ConcurrentFree，看带size释放省掉的那次查span值多少
+template<class T>
+struct UnsizedAllocator : public ConcurrentAllocator<T>
+{
+	template<class U>
+	struct rebind
+	{
+		typedef UnsizedAllocator<U> other;
+	};
+
+	UnsizedAllocator() noexcept
+	{}
+
+	template<class U>
+	UnsizedAllocator(const UnsizedAllocator<U>&) noexcept
+	{}
+
+	void deallocate(T* p, size_t) noexcept
+	{
+		ConcurrentFree(p);
 	}
+};
+
+// 每个线程一个容器，key在一个范围里随机，有就删、没有就插，容器大小稳定在范围的一半左右，一直在申请释放节点
+template<class MakeMap>
+static double RunContainerChurn(size_t ntimes, size_t nworks, MakeMap makeMap)
+{
+	const int keyRange = 100000;
 
+	auto begin = std::chrono::steady_clock::now();
+	std::vector<std::thread> vthread(nworks);
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread[k] = std::thread([&, k]() {
+			auto m = makeMap();
+			std::mt19937 rng((unsigned)k + 1);
+			for (size_t i = 0; i < ntimes; ++i)
+			{
+				int key = (int)(rng() % keyRange);
+				auto it = m.find(key);
+				if (it == m.end())
+					m.emplace(key, i);
+				else
+					m.erase(it);
+			}
+		});
+	}
 	for (auto& t : vthread)
 	{
 		t.join();
 	}
+	auto end = std::chrono::steady_clock::now();
 
-	printf("%uִ̲߳%uִΣÿִconcurrent alloc %u: ѣ%u ms\n",
-		nworks, rounds, ntimes, malloc_costtime.load());
+	return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+template<class Alloc>
+using BenchMap = std::map<int, size_t, std::less<int>, Alloc>;
+template<class Alloc>
+using BenchHashMap = std::unordered_map<int, size_t, std::hash<int>, std::equal_to<int>, Alloc>;
+
+void BenchmarkContainers(size_t ntimes, size_t nworks)
+{
+	typedef std::pair<const int, size_t> Value;
+	double ops = nworks * ntimes / 1e6;
 
-	printf("%uִ̲߳%uִΣÿִconcurrent dealloc %u: ѣ%u ms\n",
-		nworks, rounds, ntimes, free_costtime.load());
+	double ms1 = RunContainerChurn(ntimes, nworks, []() { return BenchMap<std::allocator<Value>>(); });
+	double ms2 = RunContainerChurn(ntimes, nworks, []() { return BenchMap<ConcurrentAllocator<Value>>(); });
+	double ms3 = RunContainerChurn(ntimes, nworks, []() { return BenchMap<UnsizedAllocator<Value>>(); });
+	printf("map增删 %zu个线程: std::allocator %.1f ms(%.2f Mops/s), ConcurrentAllocator %.1f ms(%.2f Mops/s), 不带size释放 %.1f ms(%.2f Mops/s)\n",
+		nworks, ms1, ops / (ms1 / 1000), ms2, ops / (ms2 / 1000), ms3, ops / (ms3 / 1000));
 
-	printf("%u̲߳concurrent alloc&dealloc %uΣܼƻѣ%u ms\n",
-		nworks, nworks * rounds * ntimes, malloc_costtime.load() + free_costtime.load());
+	ms1 = RunContainerChurn(ntimes, nworks, []() { return BenchHashMap<std::allocator<Value>>(); });
+	ms2 = RunContainerChurn(ntimes, nworks, []() { return BenchHashMap<ConcurrentAllocator<Value>>(); });
+	ms3 = RunContainerChurn(ntimes, nworks, []() { return BenchHashMap<UnsizedAllocator<Value>>(); });
+	printf("unordered_map增删 %zu个线程: std::allocator %.1f ms(%.2f Mops/s), ConcurrentAllocator %.1f ms(%.2f Mops/s), 不带size释放 %.1f ms(%.2f Mops/s)\n",
+		nworks, ms1, ops / (ms1 / 1000), ms2, ops / (ms2 / 1000), ms3, ops / (ms3 / 1000));
+
+#ifdef CMP_HAVE_MEMORY_RESOURCE
+	ms1 = RunContainerChurn(ntimes, nworks, []() { return std::pmr::map<int, size_t>(std::pmr::new_delete_resource()); });
+	ms2 = RunContainerChurn(ntimes, nworks, []() { return std::pmr::map<int, size_t>(ConcurrentGetMemoryResource()); });
+	printf("pmr::map增删 %zu个线程: new_delete_resource %.1f ms(%.2f Mops/s), ConcurrentMemoryResource %.1f ms(%.2f Mops/s)\n",
+		nworks, ms1, ops / (ms1 / 1000), ms2, ops / (ms2 / 1000));
+#endif
 }
 
-int main()
+int main(int argc, char* argv[])
 {
-	size_t n = 10000;
+	std::vector<size_t> threads = { 1, 2, 4, 8 };
+	std::vector<SizeDist> dists = { SizeDist::Fixed, SizeDist::Uniform, SizeDist::LogNormal, SizeDist::Mixed };
+	size_t ops = 1000000;
+	size_t live = 1024;
+	std::string format = "text";
+	std::string outPath;
+	bool legacy = false;
+	bool objectPool = false;
+	bool containers = false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		std::string val = i + 1 < argc ? argv[i + 1] : "";
+		if (arg == "--threads")
+		{
+			threads.clear();
+			for (auto& t : SplitList(val))
+				threads.push_back(std::max(1, atoi(t.c_str())));
+			++i;
+		}
+		else if (arg == "--dists")
+		{
+			dists.clear();
+			for (auto& d : SplitList(val))
+			{
+				if (d == "fixed") dists.push_back(SizeDist::Fixed);
+				else if (d == "uniform") dists.push_back(SizeDist::Uniform);
+				else if (d == "lognormal") dists.push_back(SizeDist::LogNormal);
+				else if (d == "mixed") dists.push_back(SizeDist::Mixed);
+				else
+				{
+					fprintf(stderr, "不认识的分布: %s\n", d.c_str());
+					return 1;
+				}
+			}
+			++i;
+		}
+		else if (arg == "--ops")
+			ops = std::max(1LL, atoll(val.c_str())), ++i;
+		else if (arg == "--live")
+			live = std::max(1LL, atoll(val.c_str())), ++i;
+		else if (arg == "--format")
+			format = val, ++i;
+		else if (arg == "--out")
+			outPath = val, ++i;
+		else if (arg == "--legacy")
+			legacy = true;
+		else if (arg == "--object-pool")
+			objectPool = true;
+		else if (arg == "--containers")
+			containers = true;
+		else
+		{
+			fprintf(stderr, "用法: %s [--threads 1,2,4,8] [--dists fixed,uniform,lognormal,mixed] [--ops N] [--live N]"
+				" [--format text|csv|json] [--out 文件] [--legacy] [--object-pool] [--containers]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	s_clock.Calibrate();
+
+	std::vector<BenchResult> results;
+	for (auto dist : dists)
+	{
+		for (size_t nworks : threads)
+		{
+			for (auto& alloc : s_allocators)
+			{
+				results.push_back(RunBench(alloc, dist, nworks, ops, live));
+				if (format == "text" && outPath.empty())
+					fprintf(stderr, "."); // 跑得久的时候看得出来在动
+			}
+		}
+	}
+	if (format == "text" && outPath.empty())
+		fprintf(stderr, "\n");
+
+	std::string out = FormatResults(results, format);
+	if (outPath.empty())
+		fputs(out.c_str(), stdout);
+	else
+	{
+		FILE* fp = fopen(outPath.c_str(), "w");
+		if (fp == nullptr)
+		{
+			fprintf(stderr, "打不开%s\n", outPath.c_str());
+			return 1;
+		}
+		fputs(out.c_str(), fp);
+		fclose(fp);
+	}
+
+	if (objectPool)
+	{
+		for (size_t nworks : threads)
+			BenchmarkObjectPool(2000000, nworks);
+	}
+
+	if (containers)
+	{
+		for (size_t nworks : threads)
+			BenchmarkContainers(2000000, nworks);
+	}
+
+	if (!legacy)
+		return 0;
+
+	cout << "==========================================================" << endl;
+	// 线程数远多于cpu数的时候两种前端的内存和吞吐
+	for (size_t nworks : { 64, 256 })
+	{
+		BenchmarkFrontEnd(2000, nworks, 10, false);
+		BenchmarkFrontEnd(2000, nworks, 10, true);
+	}
 	cout << "==========================================================" << endl;
-	BenchmarkConcurrentMalloc(n, 4, 10);
-	cout << endl << endl;
 
-	BenchmarkMalloc(n, 4, 10);
+	BenchmarkSizeClass(100000000);
+	cout << "==========================================================" << endl;
+
+	// 大块为主的时候线程数越多pc的锁越抢
+	for (size_t nworks : { 1, 2, 4, 8, 16 })
+		BenchmarkPageCache(200000, nworks);
 	cout << "==========================================================" << endl;
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -1,17 +1,22 @@
 #include"ConcurrentAlloc.h"
+#include"ConcurrentAllocator.h"
+#include<map>
+#include<list>
+#include<condition_variable>
+#include<algorithm>
 
-// ߳1ִз
+// 线程1执行方法
 void Alloc1()
-{// ̵߳ConncurrentAllocͨ
+{// 两个线程调用ConncurrentAlloc测试能跑通不
 	for (int i = 0; i < 5; ++i)
 	{
 		ConcurrentAlloc(6);
 	}
 }
 
-// ߳2ִз
+// 线程2执行方法
 void Alloc2()
-{// ̵߳ConncurrentAllocͨ
+{// 两个线程调用ConncurrentAlloc测试能跑通不
 	for (int i = 0; i < 5; ++i)
 	{
 		ConcurrentAlloc(7);
@@ -114,10 +119,10 @@ void TestMultiThread()
 
 void TestAddressShift()
 {
-	// ҳ
+	// 两个页号
 	PageID id1 = 2000;
 	PageID id2 = 2001;
-	// ͨҳid1ҳҳƫ
+	// 通过页号找id1页的页内偏移
 	char* p1 = (char*)(id1 << PAGE_SHIFT);
 	char* p2 = (char*)(id2 << PAGE_SHIFT);
 	while (p1 < p2)
@@ -136,8 +141,917 @@ void BigAlloc()
 	ConcurrentFree(p2);
 }
 
+// 64位下多线程随机大小申请释放，顺便检查一下有没有块之间互相踩内存
+void TestRandomAllocFree()
+{
+	std::vector<std::thread> vthread;
+	for (int k = 0; k < 4; ++k)
+	{
+		vthread.emplace_back([k]() {
+			std::vector<std::pair<char*, size_t>> v;
+			size_t seed = k + 1;
+			for (int i = 0; i < 20000; ++i)
+			{
+				seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+				size_t r = seed >> 33;
+				// 小块、大于256KB但小于128页的、超过128页的都要覆盖到
+				size_t size = r % 3 == 0 ? r % (300 * 1024) + 1 : r % 1024 + 1;
+				if (r % 64 == 0)
+					size = 2 * 1024 * 1024;
+
+				char* ptr = (char*)ConcurrentAlloc(size);
+				memset(ptr, k, size);
+				v.push_back({ ptr, size });
+
+				if (v.size() > 200)
+				{
+					size_t j = r % v.size();
+					for (size_t n = 0; n < v[j].second; n += 97)
+						assert(v[j].first[n] == (char)k); // 被别的块踩了
+					ConcurrentFree(v[j].first);
+					v[j] = v.back();
+					v.pop_back();
+				}
+			}
+
+			for (auto& e : v)
+			{
+				ConcurrentFree(e.first);
+			}
+		});
+	}
+
+	for (auto& t : vthread)
+	{
+		t.join();
+	}
+}
+
+// 线程退出后它的tc要被回收，下一个线程能复用到同一个tc
+// 测tc本身的用例在per-cpu模式下(比如CMP_PER_CPU_CACHE=1跑的时候)根本不走tc，先关掉，测完再恢复
+struct ThreadCacheMode
+{
+	bool _perCpu = CpuCache::IsActive();
+
+	ThreadCacheMode()
+	{
+		ConcurrentSetPerCpuCache(false);
+	}
+
+	~ThreadCacheMode()
+	{
+		ConcurrentSetPerCpuCache(_perCpu);
+	}
+};
+
+void TestThreadCacheRecycle()
+{
+	ThreadCacheMode mode;
+
+	ThreadCache* tc1 = nullptr;
+	ThreadCache* tc2 = nullptr;
+
+	std::thread t1([&tc1]() {
+		std::vector<void*> v;
+		for (int i = 0; i < 1000; ++i)
+			v.push_back(ConcurrentAlloc(16));
+		for (auto e : v)
+			ConcurrentFree(e); // 这些块都留在了t1的tc里
+		tc1 = pTLSThreadCache;
+	});
+	t1.join();
+
+	std::thread t2([&tc2]() {
+		ConcurrentFree(ConcurrentAlloc(16));
+		tc2 = pTLSThreadCache;
+	});
+	t2.join();
+
+	assert(tc1 != nullptr);
+	assert(tc1 == tc2); // 对象池是头插头删的，t1还回去的tc会被t2拿到
+
+	// tc回收之后别的thread_local对象析构的时候还在申请，不能再开一个没人回收的tc
+	static ThreadCache* lateTc = tc1;
+	struct LateAlloc
+	{
+		~LateAlloc()
+		{
+			void* p = ConcurrentAlloc(16);
+			lateTc = pTLSThreadCache;
+			ConcurrentFree(p);
+		}
+	};
+	std::thread t3([]() {
+		thread_local LateAlloc late; // 比tlsThreadCacheReleaser先构造，就在它之后析构
+		(void)late;
+		ConcurrentFree(ConcurrentAlloc(16));
+	});
+	t3.join();
+	assert(lateTc == nullptr);
+	(void)lateTc;
+}
+
+// 带size的释放不查span，块要回到和申请时同一个桶里
+void TestSizedFree()
+{
+	for (size_t size = 1; size <= 4096; size += 7)
+	{
+		void* p1 = ConcurrentAlloc(size);
+		ConcurrentFree(p1, size);
+		void* p2 = ConcurrentAlloc(size); // tc的自由链表是头插头删的，刚还回去的会被马上拿到
+		assert(p1 == p2);
+		ConcurrentFree(p2, size);
+	}
+
+	void* big = ConcurrentAlloc(300 * 1024); // 大块还是走span
+	ConcurrentFree(big, 300 * 1024);
+}
+
+// 所有tc加起来的额度不能超过预算，单个tc缓存的字节数不能超过它的上限
+void TestThreadCacheBudget()
+{
+	ThreadCacheMode mode;
+	const size_t nworks = 8;
+	const size_t budget = nworks * THREAD_CACHE_MIN_BYTES + 1024 * 1024;
+	ConcurrentSetThreadCacheBudget(budget);
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	size_t finished = 0;
+
+	std::vector<std::thread> vthread;
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread.emplace_back([&, k]() {
+			// 前一半线程一直很忙，后一半只申请一点就闲着了，忙的线程会把闲的线程的额度偷过来
+			size_t rounds = k < nworks / 2 ? 50 : 1;
+			std::vector<void*> v;
+			for (size_t j = 0; j < rounds; ++j)
+			{
+				for (size_t i = 0; i < 2000; ++i)
+					v.push_back(ConcurrentAlloc(i % 2048 + 1));
+				for (auto e : v)
+					ConcurrentFree(e);
+				v.clear();
+
+				assert(pTLSThreadCache->CachedBytes() <= pTLSThreadCache->MaxBytes());
+				assert(pTLSThreadCache->MaxBytes() <= THREAD_CACHE_MAX_BYTES);
+			}
+
+			// 大家都跑完了再一起退出，退出之前tc都还活着
+			std::unique_lock<std::mutex> lock(mtx);
+			++finished;
+			cv.notify_all();
+			cv.wait(lock, [&]() { return finished >= nworks + 1; });
+		});
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		cv.wait(lock, [&]() { return finished == nworks; });
+		assert(ThreadCache::ClaimedBytes() <= budget);
+		++finished;
+		cv.notify_all();
+	}
+
+	for (auto& t : vthread)
+	{
+		t.join();
+	}
+
+	ConcurrentSetThreadCacheBudget(THREAD_CACHE_BUDGET_BYTES);
+}
+
+void TestReleaseFreeMemory()
+{
+	// 大于256KB的直接找pc要，还回来之后就闲在pc里
+	const size_t size = 64 * 8 * 1024;
+	std::vector<void*> v;
+	for (size_t i = 0; i < 64; ++i)
+	{
+		v.push_back(ConcurrentAlloc(size));
+		memset(v.back(), 1, size);
+	}
+	for (auto e : v)
+		ConcurrentFree(e);
+	v.clear();
+
+	size_t released = ConcurrentReleaseFreeMemory();
+	assert(released >= 64 * size);
+	assert(PageCache::GetInstance()->ReleasedBytes() >= released);
+
+	// 已经还掉的span再拿出来用，要能正常读写，记的数也要跟着减
+	for (size_t i = 0; i < 64; ++i)
+	{
+		v.push_back(ConcurrentAlloc(size));
+		memset(v.back(), 2, size);
+	}
+	assert(PageCache::GetInstance()->ReleasedBytes() + 64 * size <= released);
+	(void)released;
+	for (auto e : v)
+		ConcurrentFree(e);
+
+	// 刚还回来的span还没闲够，不会被还掉
+	assert(PageCache::GetInstance()->ReleaseIdleSpans(SIZE_MAX, 60 * 1000) == 0);
+	// 小块释放之后整批整批地囤在cc的中转站里，也要能还回pc、还给os(线程退出的时候tc整批还给cc)
+	ThreadCacheMode mode;
+	const size_t small = 16 * 1024; // 一批16块，攒得满一整批
+	std::thread([&]() {
+		std::vector<void*> objs;
+		for (size_t i = 0; i < 1000; ++i)
+			objs.push_back(ConcurrentAlloc(small));
+		for (auto e : objs)
+			ConcurrentFree(e);
+	}).join();
+
+	size_t index = SizeClass::Index(small);
+	assert(ConcurrentGetStats()._classes[index]._transferObjs > 0);
+	size_t before = PageCache::GetInstance()->ReleasedBytes();
+	ConcurrentReleaseFreeMemory();
+	AllocStats stats = ConcurrentGetStats();
+	assert(stats._classes[index]._transferObjs == 0 && stats._transferBytes == 0);
+	assert(PageCache::GetInstance()->ReleasedBytes() >= before + 500 * small); // 块都还回来了，span都空了
+	(void)index;
+	(void)before;
+	(void)stats;
+}
+
+void TestNumaHeaps()
+{
+	// 单节点的机器上假装有两个节点
+	PageCache* pc = PageCache::GetInstance();
+	pc->FakeNumaNodes(2);
+	assert(pc->NumaNodes() == 2);
+
+	void* big = nullptr;
+	std::thread t([&]() {
+		PageCache::SetThreadNumaNode(1); // 这个线程在1号节点上
+		big = ConcurrentAlloc(MAX_BYTES + 1); // 直接找pc要的
+		assert(pc->NumaNodeOf(big) == 1);
+	});
+	t.join();
+
+	// 0号节点上申请的是0号节点的，1号节点的在这里释放也要还回1号节点的页堆
+	PageCache::SetThreadNumaNode(0);
+	void* local = ConcurrentAlloc(MAX_BYTES + 1);
+	assert(pc->NumaNodeOf(local) == 0);
+	ConcurrentFree(big);
+	ConcurrentFree(local);
+
+	std::thread([&]() {
+		PageCache::SetThreadNumaNode(1);
+		void* again = ConcurrentAlloc(MAX_BYTES + 1);
+		assert(pc->NumaNodeOf(again) == 1);
+		ConcurrentFree(again);
+	}).join();
+
+	// 小块也一样：cc按节点分桶，哪个节点的线程拿到的都是自己节点的span切出来的。
+	// per-cpu缓存是按真实的cpu分的，假装的节点是按线程指定的，两边对不上，这里只测tc
+	ThreadCacheMode mode;
+	const size_t small = 200;
+	std::vector<void*> remote;
+	std::thread([&]() {
+		PageCache::SetThreadNumaNode(1);
+		for (size_t i = 0; i < 2000; ++i)
+		{
+			remote.push_back(ConcurrentAlloc(small));
+			assert(pc->NumaNodeOf(remote.back()) == 1);
+		}
+	}).join();
+
+	// 在0号节点上还，块要回到1号节点的span上(线程退出的时候tc还给cc)
+	std::thread([&]() {
+		PageCache::SetThreadNumaNode(0);
+		std::vector<void*> local;
+		for (size_t i = 0; i < 2000; ++i)
+		{
+			local.push_back(ConcurrentAlloc(small));
+			assert(pc->NumaNodeOf(local.back()) == 0);
+		}
+		for (size_t i = 0; i < 2000; ++i)
+		{
+			ConcurrentFree(remote[i], small);
+			ConcurrentFree(local[i], small);
+		}
+	}).join();
+	AllocStats stats = ConcurrentGetStats();
+	const ClassStats& cls = stats._classes[SizeClass::Index(small)];
+	assert(cls._spanObjs == cls._inUseObjs + cls._threadObjs + cls._remoteObjs + cls._cpuObjs + cls._transferObjs + cls._centralObjs);
+	(void)cls;
+
+	std::thread([&]() {
+		PageCache::SetThreadNumaNode(1);
+		std::vector<void*> again;
+		for (size_t i = 0; i < 2000; ++i)
+		{
+			again.push_back(ConcurrentAlloc(small));
+			assert(pc->NumaNodeOf(again.back()) == 1);
+		}
+		for (auto p : again)
+			ConcurrentFree(p, small);
+	}).join();
+
+	PageCache::SetThreadNumaNode(-1);
+	pc->FakeNumaNodes(1);
+}
+
+void TestStats()
+{
+	ThreadCacheMode mode; // _centralFetches是tc向cc要的次数
+	AllocStats before = ConcurrentGetStats();
+
+	// 申请一批64字节的块，它们要算在正在用的里面
+	const size_t n = 1000;
+	size_t index = SizeClass::Index(64);
+	std::vector<void*> v;
+	for (size_t i = 0; i < n; ++i)
+		v.push_back(ConcurrentAlloc(64));
+	void* big = ConcurrentAlloc(2 * 1024 * 1024); // 大于128页的
+
+	AllocStats stats = ConcurrentGetStats();
+	const ClassStats& cls = stats._classes[index];
+	assert(cls._objSize == 64);
+	assert(cls._inUseObjs >= n);
+	assert(cls._centralFetches > before._classes[index]._centralFetches);
+	assert(cls._spanObjs == cls._inUseObjs + cls._threadObjs + cls._remoteObjs + cls._cpuObjs + cls._transferObjs + cls._centralObjs);
+	assert(stats._largeSpans == before._largeSpans + 1);
+	assert(stats._largeAllocs == before._largeAllocs + 1);
+	assert(stats._mappedBytes >= stats._inUseBytes + stats._largeBytes);
+	assert(stats._metadataBytes > 0 && stats._spanObjects > 0);
+
+	// 还回去之后正在用的少了，缓存或者pc里的多了
+	for (auto e : v)
+		ConcurrentFree(e);
+	ConcurrentFree(big);
+	AllocStats after = ConcurrentGetStats();
+	assert(after._classes[index]._inUseObjs + n <= cls._inUseObjs);
+	assert(after._largeSpans == before._largeSpans);
+	(void)before;
+	(void)cls;
+
+	// 两种格式都能输出
+	std::string text = StatsToText(after);
+	std::string json = StatsToJson(after);
+	assert(text.find("mapped from OS") != std::string::npos);
+	assert(json.front() == '{' && json.back() == '}');
+	assert(json.find("\"page_buckets\"") != std::string::npos);
+}
+
+void TestHeapProfile()
+{
+	HeapProfiler* hp = HeapProfiler::GetInstance();
+	size_t live = hp->LiveSamples();
+
+	// 间隔给得很小，基本上每一块都会被采到
+	ConcurrentSetHeapSampleRate(1);
+	std::vector<void*> v;
+	for (size_t i = 0; i < 100; ++i)
+	{
+		v.push_back(ConcurrentAlloc(100));
+		memset(v.back(), 1, 100);
+	}
+	void* big = ConcurrentAlloc(300 * 1024);
+	ConcurrentSetHeapSampleRate(0);
+	assert(hp->LiveSamples() > live + 50);
+
+	const char* path = "heap_profile_test.prof";
+	bool dumped = ConcurrentDumpHeapProfile(path); // 有副作用的调用不能放在assert里，Release下assert是空的
+	assert(dumped);
+	(void)dumped;
+	FILE* fp = fopen(path, "r");
+	assert(fp);
+	char line[256] = { 0 };
+	char* got = fgets(line, sizeof(line), fp);
+	assert(got != nullptr);
+	assert(strncmp(line, "heap profile:", 13) == 0);
+	assert(strstr(line, "heap_v2/") != nullptr);
+	(void)got;
+	fclose(fp);
+	remove(path);
+
+	// 采到的块释放的时候记录要跟着删掉，带size的释放也一样
+	for (size_t i = 0; i < v.size(); ++i)
+	{
+		if (i % 2)
+			ConcurrentFree(v[i]);
+		else
+			ConcurrentFree(v[i], 100);
+	}
+	ConcurrentFree(big);
+	assert(hp->LiveSamples() == live);
+	(void)live;
+}
+
+// 生产者申请、消费者释放，消费者释放的块挂到生产者的远程释放队列上，生产者再申请的时候拿回来用
+void TestRemoteFree()
+{
+	ThreadCacheMode mode;
+	const size_t n = 500;
+	const size_t size = 3000;
+	size_t index = SizeClass::Index(size);
+	std::vector<void*> v;
+	std::atomic<int> step{ 0 };
+
+	std::thread producer([&]() {
+		for (size_t i = 0; i < n; ++i)
+			v.push_back(ConcurrentAlloc(size));
+		step = 1;
+		while (step != 2)
+			std::this_thread::yield();
+
+		// 消费者释放的都还挂在队列上，没有进谁的tc
+		assert(ConcurrentGetStats()._classes[index]._remoteObjs >= n / 2);
+
+		std::vector<void*> again;
+		size_t reused = 0;
+		for (size_t i = 0; i < n; ++i)
+		{
+			again.push_back(ConcurrentAlloc(size));
+			if (std::find(v.begin(), v.end(), again.back()) != v.end())
+				++reused;
+		}
+		assert(reused > 0);
+		for (auto e : again)
+			ConcurrentFree(e);
+	});
+
+	// 消费者从来没申请过，也就没有tc
+	std::thread consumer([&]() {
+		while (step != 1)
+			std::this_thread::yield();
+		for (auto e : v)
+			ConcurrentFree(e);
+		assert(pTLSThreadCache == nullptr);
+		step = 2;
+	});
+
+	producer.join();
+	consumer.join();
+	(void)index;
+}
+
+// 多个线程同时从并发定长内存池拿对象，一半在别的线程还回去，拿到的对象不能重复
+void TestConcurrentObjectPool()
+{
+	struct Node
+	{
+		size_t _val = 7;
+		Node* _left = nullptr;
+		Node* _right = nullptr;
+	};
+
+	const size_t nworks = 4;
+	const size_t n = 20000;
+	std::vector<std::vector<Node*>> nodes(nworks);
+	std::vector<std::thread> vthread;
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread.emplace_back([&, k]() {
+			for (size_t i = 0; i < n; ++i)
+			{
+				Node* node = ConcurrentObjectPool<Node>::New();
+				assert(node->_val == 7); // 构造过了
+				node->_val = k * n + i;
+				nodes[k].push_back(node);
+				if (i % 3 == 0)
+				{ // 自己拿的随手还一些，弹匣会来回换
+					ConcurrentObjectPool<Node>::Delete(nodes[k].back());
+					nodes[k].pop_back();
+				}
+			}
+		});
+	}
+	for (auto& t : vthread)
+		t.join();
+
+	std::vector<Node*> all;
+	for (auto& v : nodes)
+	{
+		for (auto node : v)
+		{
+			assert(node->_val / n < nworks); // 没有被别的线程改掉
+			all.push_back(node);
+		}
+	}
+	std::sort(all.begin(), all.end());
+	assert(std::adjacent_find(all.begin(), all.end()) == all.end());
+	assert(ConcurrentObjectPool<Node>::ReservedBytes() >= all.size() * sizeof(Node));
+
+	// 换个线程还回去(拿的那些线程已经退出了)，再拿的时候用的是还回去的
+	vthread.clear();
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread.emplace_back([&, k]() {
+			for (auto node : nodes[(k + 1) % nworks])
+				ConcurrentObjectPool<Node>::Delete(node);
+		});
+	}
+	for (auto& t : vthread)
+		t.join();
+
+	size_t reserved = ConcurrentObjectPool<Node>::ReservedBytes();
+	std::thread t([&]() {
+		std::vector<Node*> v;
+		for (size_t i = 0; i < all.size(); ++i)
+			v.push_back(ConcurrentObjectPool<Node>::New());
+		for (auto node : v)
+			ConcurrentObjectPool<Node>::Delete(node);
+	});
+	t.join();
+	assert(ConcurrentObjectPool<Node>::ReservedBytes() == reserved);
+	(void)reserved;
+
+	// 线程退出的时候弹匣还回仓库了，之后别的thread_local对象析构的时候还在New/Delete，要直接走仓库，
+	// 拿的比一个弹匣多，还从手上的弹匣拿的话就会拿空了再去仓库把刚还回去的那个拿回来
+	static bool lateOk = false;
+	struct LateNew
+	{
+		~LateNew()
+		{
+			std::vector<Node*> v;
+			for (size_t i = 0; i < OBJECT_POOL_MAGAZINE_SLOTS + 1; ++i)
+				v.push_back(ConcurrentObjectPool<Node>::New());
+			std::vector<Node*> sorted = v;
+			std::sort(sorted.begin(), sorted.end());
+			lateOk = std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end();
+			for (auto node : v)
+				ConcurrentObjectPool<Node>::Delete(node);
+		}
+	};
+	std::thread([]() {
+		thread_local LateNew late; // 比t_releaser先构造，就在它之后析构
+		(void)late;
+		ConcurrentObjectPool<Node>::Delete(ConcurrentObjectPool<Node>::New());
+	}).join();
+	assert(lateOk);
+	(void)lateOk;
+}
+
+// arena里切出来的都对齐、不重叠，Reset之后同一个线程的下一个arena用留下来的span，不再找pc
+void TestArena()
+{
+	struct Item
+	{
+		double _d;
+		size_t _id;
+		Item(size_t id) : _d(id * 0.5), _id(id) {}
+	};
+
+	size_t before = ConcurrentGetStats()._arenaSpanFetches;
+	for (int request = 0; request < 10; ++request)
+	{
+		ConcurrentArena arena;
+		std::vector<Item*> items;
+		for (size_t i = 0; i < 5000; ++i)
+		{
+			items.push_back(arena.New<Item>(i));
+			assert((uintptr_t)items.back() % alignof(Item) == 0);
+
+			char* bytes = (char*)arena.Alloc(i % 100 + 1, 1);
+			memset(bytes, 0xAB, i % 100 + 1);
+		}
+		void* aligned = arena.Alloc(24, 64);
+		assert((uintptr_t)aligned % 64 == 0);
+		(void)aligned;
+		char* big = (char*)arena.Alloc(100 * 1024); // 单独要span
+		memset(big, 0xCD, 100 * 1024);
+
+		for (size_t i = 0; i < items.size(); ++i)
+			assert(items[i]->_id == i && items[i]->_d == i * 0.5);
+		assert(arena.BytesUsed() >= 5000 * sizeof(Item) + 100 * 1024);
+		assert(arena.BytesReserved() >= arena.BytesUsed());
+		assert(ConcurrentGetStats()._arenaBytes >= arena.BytesReserved());
+
+		if (request == 0)
+			before = ConcurrentGetStats()._arenaSpanFetches;
+		// 析构的时候一起还掉
+	}
+
+	// 第一个请求之后标准span都是线程留下来的，只有单独要的大span还要找pc
+	size_t fetches = ConcurrentGetStats()._arenaSpanFetches - before;
+	assert(fetches == 9);
+	(void)fetches;
+
+	// Reset之后接着用
+	ConcurrentArena arena;
+	void* p1 = arena.Alloc(100);
+	arena.Reset();
+	assert(arena.BytesReserved() == 0);
+	void* p2 = arena.Alloc(100);
+	assert(p1 == p2); // 还回去的span又拿回来了
+	(void)p1;
+	(void)p2;
+
+	bool thrown = false;
+	try
+	{
+		arena.Alloc(SIZE_MAX - 8, 16);
+	}
+	catch (const std::bad_alloc&)
+	{
+		thrown = true;
+	}
+	void* after = arena.Alloc(8);
+	assert(thrown && after != nullptr); // 失败了arena还能接着用
+	(void)thrown;
+	(void)after;
+
+	// 线程留着的span退出的时候还掉了，之后别的thread_local对象析构的时候再用arena，span要直接还给pc
+	struct LateArena
+	{
+		~LateArena()
+		{
+			ConcurrentArena late;
+			memset(late.Alloc(100), 0xEF, 100);
+		}
+	};
+	size_t arenaBytes = ConcurrentGetStats()._arenaBytes;
+	std::thread([]() {
+		thread_local LateArena late; // 比t_arenaSpansReleaser先构造，就在它之后析构
+		(void)late;
+		ConcurrentArena first;
+		first.Alloc(100);
+	}).join();
+	assert(ConcurrentGetStats()._arenaBytes == arenaBytes);
+	(void)arenaBytes;
+}
+
+void TestAlignedAlloc()
+{
+	// 不超过一页的对齐走桶，块大小是align的倍数
+	for (size_t align = 16; align <= 8192; align <<= 1)
+	{
+		for (size_t size = 1; size <= 20000; size += 333)
+		{
+			char* p = (char*)ConcurrentAlignedAlloc(size, align);
+			assert((uintptr_t)p % align == 0);
+			memset(p, 0x5A, size);
+			if (size % 2)
+				ConcurrentAlignedFree(p, size, align);
+			else
+				ConcurrentFree(p);
+		}
+	}
+
+	// 超过一页的对齐向pc要首页对齐的span，小块和大块都有
+	std::vector<std::pair<void*, size_t>> blocks;
+	for (size_t align = 16 * 1024; align <= 4 * 1024 * 1024; align <<= 1)
+	{
+		for (size_t size : { (size_t)64, (size_t)100 * 1024, (size_t)300 * 1024, (size_t)2 * 1024 * 1024 })
+		{
+			char* p = (char*)ConcurrentAlignedAlloc(size, align);
+			assert((uintptr_t)p % align == 0);
+			memset(p, 0x6B, size);
+			blocks.emplace_back(p, align);
+		}
+	}
+	for (size_t i = 0; i < blocks.size(); ++i)
+	{
+		if (i % 2)
+			ConcurrentFree(blocks[i].first);
+		else
+			ConcurrentAlignedFree(blocks[i].first, 64, blocks[i].second); // size不影响，都要查span
+	}
+
+	// 页堆里放不下的对齐span直接向os要正好够的页，小块不会被补成128页以上
+	for (size_t align : { (size_t)2 * 1024 * 1024, (size_t)8 * 1024 * 1024 })
+	{
+		AllocStats before = ConcurrentGetStats();
+		void* p = ConcurrentAlignedAlloc(64, align);
+		assert((uintptr_t)p % align == 0);
+		Span* span = PageCache::GetInstance()->MapObjectToSpan(p);
+		assert(span->_n == 1 && span->_large);
+		assert(ConcurrentGetStats()._mappedBytes - before._mappedBytes == ((size_t)1 << PAGE_SHIFT));
+		ConcurrentFree(p);
+		assert(ConcurrentGetStats()._largeSpans == before._largeSpans);
+		(void)before;
+		(void)span;
+	}
+
+	// 对齐多拿的页马上还回页堆，后面的申请接着用，不会一直多占一倍
+	size_t mapped = ConcurrentGetStats()._mappedBytes;
+	std::vector<void*> lines;
+	for (int i = 0; i < 200; ++i)
+	{
+		lines.push_back(ConcurrentAlignedAlloc(32 * 1024, 32 * 1024));
+		assert((uintptr_t)lines.back() % (32 * 1024) == 0);
+	}
+	assert(ConcurrentGetStats()._mappedBytes - mapped <= 200 * 32 * 1024 * 5 / 4 + 2 * 1024 * 1024);
+	(void)mapped;
+	for (auto p : lines)
+		ConcurrentFree(p);
+}
+
+void TestRealloc()
+{
+	// 小块：同一个桶里不动，换桶了内容要跟过去
+	char* p = (char*)ConcurrentRealloc(nullptr, 100);
+	for (int i = 0; i < 100; ++i)
+		p[i] = (char)i;
+	void* same = ConcurrentRealloc(p, SizeClass::RoundUp(100));
+	assert(same == p);
+	(void)same;
+	for (size_t size = 200; size <= 200 * 1024; size *= 2)
+	{
+		p = (char*)ConcurrentRealloc(p, size);
+		for (int i = 0; i < 100; ++i)
+			assert(p[i] == (char)i);
+	}
+	p = (char*)ConcurrentRealloc(p, 50); // 缩小到别的桶也要挪，带size释放的时候才找得对桶
+	for (int i = 0; i < 50; ++i)
+		assert(p[i] == (char)i);
+	ConcurrentFree(p, 50);
+
+	// 页堆里的span：右边的页空着就原地扩。放到一个没用过的(假装的)NUMA节点上，页堆都是新的，后面一定是空的
+	PageCache* pc = PageCache::GetInstance();
+	pc->FakeNumaNodes(4);
+	std::thread([]() {
+		PageCache::SetThreadNumaNode(3);
+		char* big = (char*)ConcurrentAlloc(300 * 1024);
+		memset(big, 0x11, 300 * 1024);
+		char* grown = (char*)ConcurrentRealloc(big, 600 * 1024);
+		assert(grown == big);
+		for (size_t i = 0; i < 300 * 1024; i += 4096)
+			assert(grown[i] == 0x11);
+		memset(grown, 0x22, 600 * 1024);
+
+		char* shrunk = (char*)ConcurrentRealloc(grown, 500 * 1024);
+		assert(shrunk == grown); // 缩得不多不动
+		(void)shrunk;
+		char* moved = (char*)ConcurrentRealloc(grown, 2 * 1024 * 1024); // 超过128页，只能挪
+		for (size_t i = 0; i < 500 * 1024; i += 4096)
+			assert(moved[i] == 0x22);
+
+		// 向os要的大span用mremap扩
+		char* huge = (char*)ConcurrentRealloc(moved, 16 * 1024 * 1024);
+		assert((uintptr_t)huge % ((uintptr_t)1 << PAGE_SHIFT) == 0);
+		for (size_t i = 0; i < 500 * 1024; i += 4096)
+			assert(huge[i] == 0x22);
+		memset(huge, 0x33, 16 * 1024 * 1024);
+		assert(PageCache::GetInstance()->MapObjectToSpan(huge)->_objSize == 16 * 1024 * 1024);
+
+		huge = (char*)ConcurrentRealloc(huge, 1024); // 缩成小块
+		assert(huge[0] == 0x33 && huge[1023] == 0x33);
+		void* freed = ConcurrentRealloc(huge, 0);
+		assert(freed == nullptr);
+		(void)freed;
+	}).join();
+	pc->FakeNumaNodes(1);
+}
+
+void TestAllocator()
+{
+	std::vector<int, ConcurrentAllocator<int>> vec;
+	for (int i = 0; i < 100000; ++i)
+		vec.push_back(i);
+	for (int i = 0; i < 100000; ++i)
+		assert(vec[i] == i);
+
+	// 一个节点申请一次，增删混着来
+	std::map<int, int, std::less<int>, ConcurrentAllocator<std::pair<const int, int>>> m;
+	for (int round = 0; round < 3; ++round)
+	{
+		for (int i = 0; i < 20000; ++i)
+			m[i * 7 % 20000] = i;
+		for (int i = 0; i < 20000; i += 2)
+			m.erase(i);
+	}
+	assert(m.size() == 10000);
+
+	std::basic_string<char, std::char_traits<char>, ConcurrentAllocator<char>> str;
+	for (int i = 0; i < 1000; ++i)
+		str += "concurrent";
+	assert(str.size() == 10000);
+
+	// 对齐超过8的类型，块大小要挑align的倍数
+	struct alignas(64) Line
+	{
+		char _data[72];
+	};
+	std::list<Line, ConcurrentAllocator<Line>> lines;
+	for (int i = 0; i < 1000; ++i)
+	{
+		lines.emplace_back();
+		assert((uintptr_t)&lines.back() % 64 == 0);
+	}
+	ConcurrentAllocator<Line> lineAlloc;
+	Line* arr = lineAlloc.allocate(5);
+	assert((uintptr_t)arr % 64 == 0);
+	lineAlloc.deallocate(arr, 5);
+
+	bool thrown = false;
+	try
+	{
+		ConcurrentAllocator<Line>().allocate(SIZE_MAX / 32);
+	}
+	catch (const std::bad_array_new_length&)
+	{
+		thrown = true;
+	}
+	assert(thrown);
+	(void)thrown;
+	assert(ConcurrentAllocator<int>() == ConcurrentAllocator<Line>());
+
+#ifdef CMP_HAVE_MEMORY_RESOURCE
+	std::pmr::memory_resource* resource = ConcurrentGetMemoryResource();
+	{
+		std::pmr::map<int, std::pmr::string> pm(resource);
+		for (int i = 0; i < 10000; ++i)
+			pm.emplace(i, std::pmr::string(50, 'x'));
+		for (int i = 0; i < 10000; i += 3)
+			pm.erase(i);
+		for (auto& kv : pm)
+		{
+			assert(kv.second.size() == 50 && kv.second.get_allocator().resource() == resource);
+			(void)kv;
+		}
+	}
+
+	void* p = resource->allocate(100, 32);
+	assert((uintptr_t)p % 32 == 0);
+	resource->deallocate(p, 100, 32);
+	p = resource->allocate(300 * 1024, 4096);
+	assert((uintptr_t)p % 4096 == 0);
+	resource->deallocate(p, 300 * 1024, 4096);
+
+	ConcurrentMemoryResource other;
+	assert(resource->is_equal(other) && !resource->is_equal(*std::pmr::new_delete_resource()));
+#endif
+}
+
+// per-cpu模式下多线程申请释放，块不串、cpu缓存里有东西、不开tc
+void TestPerCpuCache()
+{
+	bool perCpu = CpuCache::IsActive();
+	if (!CpuCache::GetInstance()->Supported() || !ConcurrentSetPerCpuCache(true))
+		return; // 当前机器用不了rseq或者没编进去(CMP_PER_CPU_CACHE)
+
+	size_t threadCaches = ConcurrentGetStats()._threadCaches;
+	const size_t nworks = 4;
+	const size_t n = 20000;
+	std::vector<std::vector<size_t*>> blocks(nworks);
+	std::vector<std::thread> vthread;
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread.emplace_back([&, k]() {
+			for (size_t i = 0; i < n; ++i)
+			{
+				size_t size = (i * 7919 + k) % 2048 + sizeof(size_t);
+				size_t* p = (size_t*)ConcurrentAlloc(size);
+				*p = k * n + i;
+				blocks[k].push_back(p);
+				if (i % 2 == 0)
+				{ // 一半随手还掉，cpu的桶里会来回压栈弹栈
+					ConcurrentFree(blocks[k].back());
+					blocks[k].pop_back();
+				}
+			}
+		});
+	}
+	for (auto& t : vthread)
+		t.join();
+
+	// 剩下的换个线程还(per-cpu模式下块不分线程)
+	vthread.clear();
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread.emplace_back([&, k]() {
+			for (auto p : blocks[(k + 1) % nworks])
+			{
+				assert(*p / n == (k + 1) % nworks); // 没有被别的线程改掉
+				ConcurrentFree(p);
+			}
+		});
+	}
+	for (auto& t : vthread)
+		t.join();
+
+	AllocStats stats = ConcurrentGetStats();
+	assert(stats._cpuBytes > 0); // 还回来的都留在cpu的缓存里了
+	assert(stats._threadCaches == threadCaches); // 这些线程都没有开tc
+	(void)stats;
+	(void)threadCaches;
+	ConcurrentSetPerCpuCache(perCpu);
+}
+
 int main()
 {
+	TestRandomAllocFree();
+	TestThreadCacheRecycle();
+	TestSizedFree();
+	TestThreadCacheBudget();
+	TestReleaseFreeMemory();
+	TestNumaHeaps();
+	TestStats();
+	TestHeapProfile();
+	TestRemoteFree();
+	TestConcurrentObjectPool();
+	TestArena();
+	TestAlignedAlloc();
+	TestRealloc();
+	TestAllocator();
+	TestPerCpuCache();
+
 	//BigAlloc();
 
 	//AllocTest();
@@ -0,0 +1,295 @@
+#include"Common.h"
+#include<cstdio>
+#include<cstdlib>
+#include<map>
+#include<string>
+#include<algorithm>
+
+/* 桶大小表生成器
+
+ SizeClass里默认的208个桶是按固定的几档对齐数(8/16/128/1024/8192)排出来的，span的页数也是按
+ NumMoveSize * size >> PAGE_SHIFT粗略算的，有些大小切完之后span尾巴上会剩下一大截用不了。
+ 这个工具读一份申请大小的直方图，按实际的负载重新排桶：
+	1. 先按最大内碎片(-f)铺一层保底的桶，保证任何大小浪费都不超过这个比例(小于128的受16字节对齐限制除外)
+	2. 再把直方图里最常申请的大小单独开成桶，每次挑一个能省下最多字节的，直到桶的个数到上限(-n)
+	3. 每个桶在[保底页数, 2倍保底页数]里挑一个切完尾巴浪费不超过-t的页数，都超过就挑浪费最少的
+ 生成的头文件在cmake的时候用-DCMP_SIZE_CLASS_HEADER=<头文件的绝对路径>编进去，不给就还是默认的表
+
+ 直方图是文本文件，每行"大小 次数"，#开头的是注释，大于256KB的会被忽略(走的是pc，不用桶)
+
+ 用法：SizeClassGen <直方图> [-o 输出的头文件] [-f 最大内碎片] [-t 最大尾部浪费] [-n 最多多少个桶] */
+
+struct GenOptions
+{
+	const char* _input = nullptr;
+	const char* _output = "SizeClassGenerated.h";
+	double _maxFrag = 0.125; // 单次申请最多浪费多少比例
+	double _maxTail = 0.02; // span切完之后尾巴上最多浪费多少比例
+	size_t _maxClasses = 208; // 桶的个数，和默认的一样，tc的大小不变
+};
+
+struct GenClass
+{
+	size_t _size;
+	size_t _pages;
+};
+
+// 查表要求1024以内的桶是8的倍数，1024以上的是128的倍数
+static size_t RoundUpToGrain(size_t size)
+{
+	if (size <= SizeClassTable::SMALL_MAX)
+		return SizeClass::_RoundUp(size, 8);
+	return SizeClass::_RoundUp(size, 128);
+}
+
+static size_t RoundDownToGrain(size_t size)
+{
+	if (size <= SizeClassTable::SMALL_MAX)
+		return size & ~(size_t)15;
+	return size & ~(size_t)127;
+}
+
+// span切成size大小的块之后尾巴上浪费的比例
+static double TailRatio(size_t size, size_t pages)
+{
+	size_t bytes = pages << PAGE_SHIFT;
+	return (double)(bytes % size) / bytes;
+}
+
+// 给size大小的桶挑span的页数
+static size_t ChoosePages(size_t size, double maxTail)
+{
+	// 保底的页数：一个span至少够一批(NumMoveSize块)，至少放得下一块
+	size_t minPages = (SizeClass::NumMoveSize(size) * size) >> PAGE_SHIFT;
+	size_t onePages = (size + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+	minPages = std::max(minPages, onePages);
+	minPages = std::max(minPages, (size_t)1);
+
+	size_t maxPages = std::min(std::max(minPages * 2, minPages + 8), PAGE_NUM - 1);
+	size_t best = minPages;
+	for (size_t pages = minPages; pages <= maxPages; ++pages)
+	{
+		if (TailRatio(size, pages) <= maxTail)
+			return pages; // 页数越少越好，第一个满足的就要了
+		if (TailRatio(size, pages) < TailRatio(size, best))
+			best = pages;
+	}
+	return best;
+}
+
+// 按直方图统计一张表的浪费：申请的总字节数、内碎片、摊到每一块上的span尾巴浪费
+struct GenStats
+{
+	double _requested = 0;
+	double _internal = 0;
+	double _tail = 0;
+	double _maxTail = 0;
+};
+
+template<class ClassOf>
+static GenStats Evaluate(const std::map<size_t, double>& hist, ClassOf classOf)
+{
+	GenStats stats;
+	for (auto& e : hist)
+	{
+		GenClass cls = classOf(e.first);
+		size_t spanBytes = cls._pages << PAGE_SHIFT;
+		double tailPerObj = (double)(spanBytes % cls._size) / (spanBytes / cls._size);
+
+		stats._requested += e.second * e.first;
+		stats._internal += e.second * (cls._size - e.first);
+		stats._tail += e.second * tailPerObj;
+		stats._maxTail = std::max(stats._maxTail, TailRatio(cls._size, cls._pages));
+	}
+	return stats;
+}
+
+static void PrintStats(const char* name, size_t num, const GenStats& stats)
+{
+	printf("%s: %zu个桶, 内碎片%.2f%%, span尾部浪费%.2f%%(单个桶最多%.2f%%)\n", name, num,
+		100 * stats._internal / stats._requested, 100 * stats._tail / stats._requested, 100 * stats._maxTail);
+}
+
+static bool ReadHistogram(const char* path, std::map<size_t, double>& hist)
+{
+	FILE* fp = fopen(path, "r");
+	if (fp == nullptr)
+		return false;
+
+	char line[256];
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (line[0] == '#')
+			continue;
+
+		unsigned long long size = 0;
+		double count = 0;
+		if (sscanf(line, "%llu %lf", &size, &count) != 2)
+			continue;
+		if (size == 0 || size > MAX_BYTES || count <= 0)
+			continue;
+		hist[(size_t)size] += count;
+	}
+	fclose(fp);
+	return true;
+}
+
+static std::vector<size_t> GenerateSizes(const std::map<size_t, double>& hist, const GenOptions& opt)
+{
+	// 1. 保底的桶：上一个桶是c的话，c+1会落到下一个桶，下一个桶最大只能是(c+1)/(1-f)
+	// 保底的桶都是16的倍数，不是16的倍数的只在第2步按需要加
+	std::vector<size_t> sizes = { 8, 16 };
+	while (sizes.back() < MAX_BYTES)
+	{
+		size_t c = sizes.back();
+		size_t next = RoundDownToGrain((size_t)((c + 1) / (1 - opt._maxFrag)));
+		next = std::max(next, c + 16);
+		sizes.push_back(std::min(next, MAX_BYTES));
+	}
+
+	if (sizes.size() > opt._maxClasses)
+	{
+		fprintf(stderr, "最大内碎片%.3f至少要%zu个桶，超过了-n给的%zu个\n", opt._maxFrag, sizes.size(), opt._maxClasses);
+		exit(1);
+	}
+
+	// 直方图按大小排好，算一下前缀和，这样能很快算出一段大小里一共申请了多少次
+	std::vector<size_t> histSizes;
+	std::vector<double> prefix = { 0 };
+	for (auto& e : hist)
+	{
+		histSizes.push_back(e.first);
+		prefix.push_back(prefix.back() + e.second);
+	}
+	auto countIn = [&](size_t lo, size_t hi) { // (lo, hi]里一共申请了多少次
+		size_t l = std::upper_bound(histSizes.begin(), histSizes.end(), lo) - histSizes.begin();
+		size_t h = std::upper_bound(histSizes.begin(), histSizes.end(), hi) - histSizes.begin();
+		return prefix[h] - prefix[l];
+	};
+
+	std::vector<size_t> candidates;
+	for (size_t size : histSizes)
+		candidates.push_back(RoundUpToGrain(size));
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+	// 2. 每次加一个省得最多的桶：在(p, c]之间加一个x，(p, x]里的申请每次都少浪费c - x
+	// malloc会先按16字节取整再找桶，为了找到的桶都是16字节对齐的，不是16的倍数的桶x前面必须紧挨着一个x-8的桶，
+	// 这种要一次加两个
+	auto isClass = [&](size_t x) { return std::binary_search(sizes.begin(), sizes.end(), x); };
+	while (sizes.size() < opt._maxClasses)
+	{
+		double bestSave = 0;
+		size_t best = 0;
+		for (size_t x : candidates)
+		{
+			auto it = std::lower_bound(sizes.begin(), sizes.end(), x);
+			if (*it == x)
+				continue; // 已经是桶了
+
+			size_t need = (x % 16 != 0 && !isClass(x - 8)) ? 2 : 1;
+			if (sizes.size() + need > opt._maxClasses)
+				continue;
+
+			size_t c = *it;
+			size_t p = it == sizes.begin() ? 0 : *(it - 1);
+			double save = (double)(c - x) * countIn(p, x) / need; // 要加两个桶的按每个桶省了多少算
+			if (save > bestSave)
+			{
+				bestSave = save;
+				best = x;
+			}
+		}
+
+		if (best == 0)
+			break; // 再加桶也省不下来了
+		sizes.insert(std::lower_bound(sizes.begin(), sizes.end(), best), best);
+		if (best % 16 != 0 && !isClass(best - 8))
+			sizes.insert(std::lower_bound(sizes.begin(), sizes.end(), best - 8), best - 8);
+	}
+
+	return sizes;
+}
+
+static bool WriteHeader(const GenOptions& opt, const std::vector<GenClass>& classes, const GenStats& stats)
+{
+	FILE* fp = fopen(opt._output, "w");
+	if (fp == nullptr)
+		return false;
+
+	fprintf(fp, "#pragma once\n\n");
+	fprintf(fp, "// 由tools/SizeClassGen.cpp根据%s生成，不要手改\n", opt._input);
+	fprintf(fp, "// 参数: -f %.3f -t %.3f -n %zu\n", opt._maxFrag, opt._maxTail, opt._maxClasses);
+	fprintf(fp, "// 按直方图算: 内碎片%.2f%%, span尾部浪费%.2f%%\n\n",
+		100 * stats._internal / stats._requested, 100 * stats._tail / stats._requested);
+
+	fprintf(fp, "static const size_t GEN_CLASS_NUM = %zu;\n\n", classes.size());
+
+	fprintf(fp, "// 每个桶的块大小\nstatic constexpr uint32_t GEN_CLASS_SIZES[GEN_CLASS_NUM] = {");
+	for (size_t i = 0; i < classes.size(); ++i)
+		fprintf(fp, "%s%zu,", i % 8 == 0 ? "\n\t" : " ", classes[i]._size);
+	fprintf(fp, "\n};\n\n");
+
+	fprintf(fp, "// 每个桶向pc要span的时候要多少页\nstatic constexpr uint16_t GEN_CLASS_PAGES[GEN_CLASS_NUM] = {");
+	for (size_t i = 0; i < classes.size(); ++i)
+		fprintf(fp, "%s%zu,", i % 8 == 0 ? "\n\t" : " ", classes[i]._pages);
+	fprintf(fp, "\n};\n");
+
+	fclose(fp);
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	GenOptions opt;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "-o" && i + 1 < argc)
+			opt._output = argv[++i];
+		else if (arg == "-f" && i + 1 < argc)
+			opt._maxFrag = atof(argv[++i]);
+		else if (arg == "-t" && i + 1 < argc)
+			opt._maxTail = atof(argv[++i]);
+		else if (arg == "-n" && i + 1 < argc)
+			opt._maxClasses = (size_t)atoi(argv[++i]);
+		else
+			opt._input = argv[i];
+	}
+
+	if (opt._input == nullptr || opt._maxFrag <= 0 || opt._maxFrag >= 1 || opt._maxClasses > 256)
+	{
+		fprintf(stderr, "用法: %s <直方图> [-o 输出的头文件] [-f 最大内碎片] [-t 最大尾部浪费] [-n 最多多少个桶(<=256)]\n", argv[0]);
+		return 1;
+	}
+
+	std::map<size_t, double> hist;
+	if (!ReadHistogram(opt._input, hist) || hist.empty())
+	{
+		fprintf(stderr, "读不到直方图%s\n", opt._input);
+		return 1;
+	}
+
+	std::vector<GenClass> classes;
+	for (size_t size : GenerateSizes(hist, opt))
+		classes.push_back({ size, ChoosePages(size, opt._maxTail) });
+
+	// 和现在编进去的表比一下
+	GenStats oldStats = Evaluate(hist, [](size_t size) {
+		size_t index = SizeClass::Index(size);
+		return GenClass{ SizeClass::ClassSize(index), SizeClass::ClassPages(index) };
+	});
+	GenStats newStats = Evaluate(hist, [&](size_t size) {
+		return *std::lower_bound(classes.begin(), classes.end(), size,
+			[](const GenClass& cls, size_t size) { return cls._size < size; });
+	});
+	PrintStats("现在的表", FREE_LIST_NUM, oldStats);
+	PrintStats("生成的表", classes.size(), newStats);
+
+	if (!WriteHeader(opt, classes, newStats))
+	{
+		fprintf(stderr, "写不了%s\n", opt._output);
+		return 1;
+	}
+	printf("已写入%s\n", opt._output);
+	return 0;
+}